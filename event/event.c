@@ -1,8 +1,16 @@
-﻿#include <stdlib.h>
+﻿#if defined( _LINUX ) && !defined( _GNU_SOURCE )
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
 #include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 #include "lua.h"
 #include "lualib.h"
@@ -17,17 +25,77 @@
 #include <event2/http.h>
 #include <event2/keyvalq_struct.h>
 #include <event2/dns.h>
+#include <event2/thread.h>
 
 #ifdef _WIN32
 #include <WinSock2.h>
+#include <WS2tcpip.h>
+#include <io.h>
 #pragma comment(lib, "ws2_32.lib")
 #define EXPORT __declspec(dllexport)
 #else
 #define EXPORT
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/prctl.h> 
 #include <sys/un.h>
+#include <dirent.h>
+#include <stddef.h>
+#endif
+
+#ifdef _WIN32
+typedef HANDLE lthread_t;
+typedef CRITICAL_SECTION lmutex_t;
+typedef CONDITION_VARIABLE lcond_t;
+typedef SRWLOCK lrwlock_t;
+#define THREAD_PROC DWORD WINAPI
+#define THREAD_CREATE(t, func, ud) ( ( *( t ) = CreateThread(NULL, 0, func, ud, 0, NULL) ) != NULL )
+#define THREAD_JOIN(t) ( WaitForSingleObject(t, INFINITE), CloseHandle(t) )
+#define MUTEX_INIT(m) InitializeCriticalSection(m)
+#define MUTEX_FREE(m) DeleteCriticalSection(m)
+#define MUTEX_LOCK(m) EnterCriticalSection(m)
+#define MUTEX_UNLOCK(m) LeaveCriticalSection(m)
+#define COND_INIT(c) InitializeConditionVariable(c)
+#define COND_FREE(c)
+#define COND_WAIT(c, m) SleepConditionVariableCS(c, m, INFINITE)
+#define COND_SIGNAL(c) WakeConditionVariable(c)
+#define COND_BROADCAST(c) WakeAllConditionVariable(c)
+#define RWLOCK_STATIC_INIT SRWLOCK_INIT
+#define RWLOCK_RDLOCK(l) AcquireSRWLockShared(l)
+#define RWLOCK_RDUNLOCK(l) ReleaseSRWLockShared(l)
+#define RWLOCK_WRLOCK(l) AcquireSRWLockExclusive(l)
+#define RWLOCK_WRUNLOCK(l) ReleaseSRWLockExclusive(l)
+#define ATOM_CAS_POINTER(ptr, oval, nval) ( InterlockedCompareExchangePointer((PVOID volatile*)( ptr ), ( nval ), ( oval )) == ( oval ) )
+#define ATOM_XCHG_POINTER(ptr, nval) InterlockedExchangePointer((PVOID volatile*)( ptr ), ( nval ))
+#define EVTHREAD_INIT() evthread_use_windows_threads()
+#else
+typedef pthread_t lthread_t;
+typedef pthread_mutex_t lmutex_t;
+typedef pthread_cond_t lcond_t;
+typedef pthread_rwlock_t lrwlock_t;
+#define THREAD_PROC void*
+#define THREAD_CREATE(t, func, ud) ( pthread_create(t, NULL, func, ud) == 0 )
+#define THREAD_JOIN(t) pthread_join(t, NULL)
+#define MUTEX_INIT(m) pthread_mutex_init(m, NULL)
+#define MUTEX_FREE(m) pthread_mutex_destroy(m)
+#define MUTEX_LOCK(m) pthread_mutex_lock(m)
+#define MUTEX_UNLOCK(m) pthread_mutex_unlock(m)
+#define COND_INIT(c) pthread_cond_init(c, NULL)
+#define COND_FREE(c) pthread_cond_destroy(c)
+#define COND_WAIT(c, m) pthread_cond_wait(c, m)
+#define COND_SIGNAL(c) pthread_cond_signal(c)
+#define COND_BROADCAST(c) pthread_cond_broadcast(c)
+#define RWLOCK_STATIC_INIT PTHREAD_RWLOCK_INITIALIZER
+#define RWLOCK_RDLOCK(l) pthread_rwlock_rdlock(l)
+#define RWLOCK_RDUNLOCK(l) pthread_rwlock_unlock(l)
+#define RWLOCK_WRLOCK(l) pthread_rwlock_wrlock(l)
+#define RWLOCK_WRUNLOCK(l) pthread_rwlock_unlock(l)
+#define ATOM_CAS_POINTER(ptr, oval, nval) __sync_bool_compare_and_swap(ptr, oval, nval)
+#define ATOM_XCHG_POINTER(ptr, nval) __atomic_exchange_n(ptr, nval, __ATOMIC_SEQ_CST)
+#define EVTHREAD_INIT() evthread_use_pthreads()
 #endif
 
 #define LUA_EV_ERROR    0
@@ -37,15 +105,67 @@
 #define LUA_EV_DATA     4
 #define LUA_EV_HTTP 	5
 #define LUA_EV_DNS		6
+#define LUA_EV_BATCH	7
+#define LUA_EV_MAIL		8
+#define LUA_EV_EXPIRE	9
+#define LUA_EV_WRITABLE	10
+#define LUA_EV_UDP		11
+#define LUA_EV_JOB		12
+#define LUA_EV_MAX		13
 
 #define META_EVENT 			"meta_event"
 #define META_EVBUFFER 		"meta_evbuffer"
 #define META_TIMER			"meta_timer"
+#define META_WHEEL			"meta_wheel"
 #define META_LISTENER 		"meta_listener"
+#define META_RATE_GROUP		"meta_rate_group"
+#define META_UDP			"meta_udp"
+#define META_POOL			"meta_pool"
 #define META_HTTP 			"meta_http"
 #define META_HTTP_REQUEST 	"meta_http_request"
 
+#define WORKER_KEY			"event_core_worker"
+
+//smaller strings are cheaper to copy than to pin
+#define PIN_MIN_SIZE		1024
+
+#define UDP_BATCH			32
+#define UDP_MAX_SIZE		2048
+//largest ipv4 udp payload
+#define UDP_MAX_PAYLOAD		65507
+
+//log linear histogram,8 sub buckets per power of two,values in microseconds
+#define STATS_SUB_BITS		3
+#define STATS_SUB			( 1 << STATS_SUB_BITS )
+#define STATS_BUCKETS		280
+#define STATS_MAX_VALUE		( ( (uint64_t)1 << 36 ) - 1 )
+
+#define STATS_ADD(levent, field, n) do { if ( ( levent )->stats ) ( levent )->stats->field += ( n ); } while ( 0 )
+
+#define WHEEL_NEAR_SHIFT	8
+#define WHEEL_NEAR			( 1 << WHEEL_NEAR_SHIFT )
+#define WHEEL_LEVEL_SHIFT	6
+#define WHEEL_LEVEL			( 1 << WHEEL_LEVEL_SHIFT )
+#define WHEEL_NEAR_MASK		( WHEEL_NEAR - 1 )
+#define WHEEL_LEVEL_MASK	( WHEEL_LEVEL - 1 )
+
 struct levtimer;
+struct lworker;
+struct lpin;
+struct lrate_group;
+struct ldns_cache;
+struct lpool_key;
+struct lstats;
+struct lfile_cache;
+struct lsched;
+
+typedef struct levbatch {
+	int type;
+	int ref;
+	int arg;
+	void* ud;
+	int serial;
+} levbatch_t;
 
 typedef struct levent {
 	struct event_base* ev_base;
@@ -54,21 +174,94 @@ typedef struct levent {
 	int ref;
 	int callback;
 	struct levtimer* freelist;
+
+	struct event* batch_ev;
+	levbatch_t* batch;
+	int batch_size;
+	int batch_count;
+	int batch_table;
+
+	struct lworker* worker;
+	struct lpin* pins;
+	struct ldns_cache* dns_cache;
+
+	struct lstats* stats;
+	struct lfile_cache* file_cache;
+	struct lsched* sched;
+	struct ljob_port* jobs;
+	struct ludp* udp_lingering;
+	int priorities;
+	int live_buffers;
+	int live_timers;
+	int live_listeners;
 } levent_t;
 
+typedef struct lhistogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+	uint32_t buckets[STATS_BUCKETS];
+} lhistogram_t;
+
+typedef struct lstats {
+	lhistogram_t callback[LUA_EV_MAX];
+	lhistogram_t iteration;
+	lhistogram_t lag;
+	uint64_t iterations;
+	uint64_t bytes_read;
+	uint64_t bytes_written;
+	uint64_t iter_first;
+	uint64_t iter_last;
+	struct event* probe;
+	uint64_t probe_interval;
+	uint64_t probe_expect;
+} lstats_t;
+
+typedef struct lpin {
+	levent_t* levent;
+	int ref;
+	struct lpin* next;
+} lpin_t;
+
 typedef struct levbuffer {
 	levent_t* levent;
 	struct bufferevent* core;
 	int ref;
 	int closed;
 	int connect_session;
+	int frame_header;
+	int frame_big_endian;
+	size_t frame_max;
+	size_t read_high;
+	size_t write_high;
+	int write_wait;
+	struct ev_token_bucket_cfg* rate_cfg;
+	struct lrate_group* rate_group;
+	struct lpool_key* pool_key;
+	int pool_idle;
+	struct levbuffer* pool_prev;
+	struct levbuffer* pool_next;
 } levbuffer_t;
 
+typedef struct lrate_group {
+	levent_t* levent;
+	struct bufferevent_rate_limit_group* group;
+	int ref;
+	int closed;
+	int members;
+} lrate_group_t;
+
 typedef struct levlistener {
 	levent_t* levent;
 	struct evconnlistener* listener;
 	int ref;
 	int closed;
+	int batch;
+	int pending;
+	int pending_ref;
+	struct event* flush_ev;
+	int priority;
 } levlistener_t;
 
 typedef struct levtimer {
@@ -76,30 +269,135 @@ typedef struct levtimer {
 	struct event* ev;
 	int ref;
 	int cancel;
+	int serial;
 	struct levtimer* next;
 } levtimer_t;
 
+typedef struct lwheel_node {
+	int next;
+	int prev;
+	int* list;
+	uint32_t expire;
+	uint32_t serial;
+	lua_Integer session;
+} lwheel_node_t;
+
+typedef struct lwheel {
+	levent_t* levent;
+	struct event* ev;
+	int ref;
+	int closed;
+	int resolution;
+	uint32_t time;
+	uint64_t last;
+
+	int near[WHEEL_NEAR];
+	int level[4][WHEEL_LEVEL];
+
+	lwheel_node_t* nodes;
+	int size;
+	int count;
+	int freelist;
+	int expired;
+} lwheel_t;
+
 typedef struct lhttpd {
 	levent_t* levent;
 	struct evhttp* ev;
 	int ref;
 	int closed;
+	int lazy_body;
+	int priority;
 } lhttpd_t;
 
 typedef struct lrequest {
+	levent_t* levent;
 	struct evhttp_request* request;
+	struct evbuffer* chunk;
 	int ref;
 	int closed;
+	int streaming;
+	int lost;
 } lrequest_t;
 
 typedef struct levdns {
 	levent_t* levent;
 	struct evdns_getaddrinfo_request* req;
 	int ref;
+	struct levdns* next;
 } levdns_t;
 
+#define DNS_PENDING		0
+#define DNS_OK			1
+#define DNS_FAIL		2
+
+typedef struct ldns_entry {
+	struct ldns_entry* hnext;
+	struct ldns_entry* prev;
+	struct ldns_entry* next;
+	struct ldns_cache* cache;
+	char* host;
+	uint32_t hash;
+	int state;
+	uint64_t expire;
+	int naddr;
+	char(*addrs)[INET6_ADDRSTRLEN];
+	const char* error;
+	levdns_t* waiters;
+	//A and AAAA queries still out,the smaller ttl of their answers
+	int pending;
+	int ttl;
+	int shutdown;
+} ldns_entry_t;
+
+typedef struct ldns_cache {
+	levent_t* levent;
+	ldns_entry_t** slots;
+	int nslot;
+	int count;
+	int max;
+	int neg_ttl;
+	int max_ttl;
+	int def_ttl;
+	//lru list,head is the most recently used
+	ldns_entry_t* head;
+	ldns_entry_t* tail;
+	uint64_t hit;
+	uint64_t miss;
+	uint64_t coalesced;
+	uint64_t evicted;
+} ldns_cache_t;
+
+typedef struct lmail {
+	struct lmail* next;
+	int source;
+	size_t size;
+	char data[1];
+} lmail_t;
+
+typedef struct lworker {
+	int id;
+	lthread_t thread;
+	lmutex_t lock;
+	lmail_t* volatile mailbox;
+	struct event* mail_ev;
+} lworker_t;
+
+typedef struct lworker_group {
+	//count is settled by the spawning thread under lock,once every thread it could start is started
+	lmutex_t lock;
+	int count;
+	lworker_t* workers;
+	char* script;
+	char* path;
+	char* cpath;
+} lworker_group_t;
+
+static lworker_group_t* WORKERS = NULL;
+
 static int _bufferevent_destroy(levbuffer_t* levbuffer);
 static levbuffer_t* _bufferevent_create(lua_State* L, levent_t* levent, evutil_socket_t sock, int opt);
+static void pool_detach(levbuffer_t* levbuffer);
 
 static int
 _meta_init(lua_State* L, const char* meta) {
@@ -109,14 +407,313 @@ _meta_init(lua_State* L, const char* meta) {
 	return luaL_ref(L, LUA_REGISTRYINDEX);
 }
 
+//0 is served first,-1 keep libevent's default(the middle queue)
+static int
+check_priority(lua_State* L, levent_t* levent, int index) {
+	int priority = luaL_optinteger(L, index, -1);
+	luaL_argcheck(L, priority >= -1 && priority < levent->priorities, index, "priority out of range");
+	return priority;
+}
+
+//priority field of an options table
+static int
+option_priority(lua_State* L, levent_t* levent, int index) {
+	if ( lua_type(L, index) != LUA_TTABLE ) {
+		return -1;
+	}
+	lua_getfield(L, index, "priority");
+	int priority = luaL_optinteger(L, -1, -1);
+	lua_pop(L, 1);
+	if ( priority < -1 || priority >= levent->priorities ) {
+		luaL_error(L, "priority:%d out of range", priority);
+	}
+	return priority;
+}
+
+static uint64_t
+stats_clock() {
+#ifdef _WIN32
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+	if ( !freq.QuadPart ) {
+		QueryPerformanceFrequency(&freq);
+	}
+	QueryPerformanceCounter(&now);
+	return (uint64_t)( now.QuadPart * 1000000 / freq.QuadPart );
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+static void
+histogram_record(lhistogram_t* histogram, uint64_t value) {
+	if ( value > STATS_MAX_VALUE ) {
+		value = STATS_MAX_VALUE;
+	}
+	int index;
+	if ( value < STATS_SUB * 2 ) {
+		index = (int)value;
+	}
+	else {
+#ifdef _WIN32
+		unsigned long msb;
+		_BitScanReverse64(&msb, value);
+#else
+		int msb = 63 - __builtin_clzll(value);
+#endif
+		int shift = msb - STATS_SUB_BITS;
+		index = ( shift + 1 ) * STATS_SUB + (int)( ( value >> shift ) & ( STATS_SUB - 1 ) );
+	}
+	histogram->buckets[index]++;
+	if ( histogram->count == 0 || value < histogram->min ) {
+		histogram->min = value;
+	}
+	if ( value > histogram->max ) {
+		histogram->max = value;
+	}
+	histogram->count++;
+	histogram->sum += value;
+}
+
+//every lua callback go through here,the event type is the first argument
+static void
+levent_pcall(levent_t* levent, int nargs) {
+	lua_State* L = levent->L;
+	if ( !levent->stats ) {
+		lua_pcall(L, nargs, 0, 0);
+		return;
+	}
+	int type = (int)lua_tointeger(L, -nargs);
+	uint64_t start = stats_clock();
+	lua_pcall(L, nargs, 0, 0);
+	uint64_t now = stats_clock();
+	//the callback may have turned stats off or on again
+	lstats_t* stats = levent->stats;
+	if ( !stats ) {
+		return;
+	}
+	if ( type >= 0 && type < LUA_EV_MAX ) {
+		histogram_record(&stats->callback[type], now - start);
+	}
+	if ( !stats->iter_first ) {
+		stats->iter_first = start;
+	}
+	stats->iter_last = now;
+}
+
+static void event_happen(struct bufferevent* core, short events, void* ud);
+
+static int
+batch_stale(levbatch_t* entry) {
+	switch ( entry->type ) {
+		case LUA_EV_DATA: {
+			levbuffer_t* levbuffer = entry->ud;
+			return levbuffer->closed;
+		}
+		case LUA_EV_TIMEOUT: {
+			levtimer_t* levtimer = entry->ud;
+			return levtimer->cancel || levtimer->serial != entry->serial;
+		}
+		default:
+			return 0;
+	}
+}
+
+//deliver queued events as callback(LUA_EV_BATCH,{type,obj,arg,...},count)
+static void
+batch_flush(levent_t* levent) {
+	if ( levent->batch_count == 0 ) {
+		return;
+	}
+	lua_State* L = levent->L;
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, levent->callback);
+	lua_pushinteger(L, LUA_EV_BATCH);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, levent->batch_table);
+
+	int count = 0;
+	int i;
+	for ( i = 0; i < levent->batch_count; i++ ) {
+		levbatch_t* entry = &levent->batch[i];
+		if ( !batch_stale(entry) ) {
+			lua_pushinteger(L, entry->type);
+			lua_rawseti(L, -2, count * 3 + 1);
+			lua_rawgeti(L, LUA_REGISTRYINDEX, entry->ref);
+			lua_rawseti(L, -2, count * 3 + 2);
+			lua_rawgeti(L, LUA_REGISTRYINDEX, entry->arg);
+			lua_rawseti(L, -2, count * 3 + 3);
+			count++;
+		}
+		luaL_unref(L, LUA_REGISTRYINDEX, entry->ref);
+		luaL_unref(L, LUA_REGISTRYINDEX, entry->arg);
+	}
+	levent->batch_count = 0;
+
+	if ( count == 0 ) {
+		lua_pop(L, 3);
+		return;
+	}
+
+	lua_pushinteger(L, count);
+	levent_pcall(levent, 3);
+
+	//drop references so delivered objects can be collected
+	lua_rawgeti(L, LUA_REGISTRYINDEX, levent->batch_table);
+	for ( i = 1; i <= count * 3; i++ ) {
+		lua_pushnil(L);
+		lua_rawseti(L, -2, i);
+	}
+	lua_pop(L, 1);
+}
+
+static void
+batch_timeout(int fd, short event, void* ud) {
+	batch_flush(ud);
+}
+
+//queue object(and arg if has_arg) on the stack top,flushed once per loop iteration
+static void
+batch_append(levent_t* levent, int type, void* ud, int serial, int has_arg) {
+	lua_State* L = levent->L;
+	if ( levent->batch_count == levent->batch_size ) {
+		int arg = has_arg ? luaL_ref(L, LUA_REGISTRYINDEX) : LUA_NOREF;
+		int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+		batch_flush(levent);
+		lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+		luaL_unref(L, LUA_REGISTRYINDEX, ref);
+		if ( has_arg ) {
+			lua_rawgeti(L, LUA_REGISTRYINDEX, arg);
+			luaL_unref(L, LUA_REGISTRYINDEX, arg);
+		}
+	}
+
+	levbatch_t* entry = &levent->batch[levent->batch_count++];
+	entry->type = type;
+	entry->ud = ud;
+	entry->serial = serial;
+	entry->arg = has_arg ? luaL_ref(L, LUA_REGISTRYINDEX) : LUA_NOREF;
+	entry->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+	if ( levent->batch_count == 1 ) {
+		event_active(levent->batch_ev, EV_TIMEOUT, 1);
+	}
+}
+
+static size_t
+frame_length(levbuffer_t* levbuffer, const unsigned char* header) {
+	size_t length = 0;
+	int i;
+	for ( i = 0; i < levbuffer->frame_header; i++ ) {
+		if ( levbuffer->frame_big_endian ) {
+			length = ( length << 8 ) | header[i];
+		}
+		else {
+			length |= (size_t)header[i] << ( i * 8 );
+		}
+	}
+	return length;
+}
+
+//deliver every complete frame in one callback,frame length include header
+static void
+read_frames(levbuffer_t* levbuffer) {
+	levent_t* levent = levbuffer->levent;
+	lua_State* L = levent->L;
+	struct evbuffer* input = bufferevent_get_input(levbuffer->core);
+	size_t header = levbuffer->frame_header;
+	size_t need = header;
+	int top = lua_gettop(L);
+	int count = 0;
+
+	lua_newtable(L);
+
+	for ( ;; ) {
+		size_t len = evbuffer_get_length(input);
+		if ( len < header ) {
+			need = header;
+			break;
+		}
+
+		unsigned char head[8];
+		evbuffer_copyout(input, head, header);
+		size_t total = frame_length(levbuffer, head);
+		if ( total < header || ( levbuffer->frame_max > 0 && total > levbuffer->frame_max ) ) {
+			lua_settop(L, top);
+			event_happen(levbuffer->core, BEV_EVENT_ERROR, levbuffer);
+			return;
+		}
+
+		if ( len < total ) {
+			need = total;
+			break;
+		}
+
+		const char* data = (const char*)evbuffer_pullup(input, total);
+		lua_pushlstring(L, data + header, total - header);
+		lua_rawseti(L, -2, ++count);
+		evbuffer_drain(input, total);
+		STATS_ADD(levent, bytes_read, total);
+	}
+
+	size_t high = levbuffer->read_high;
+	if ( high > 0 && high < need ) {
+		high = need;
+	}
+	bufferevent_setwatermark(levbuffer->core, EV_READ, need, high);
+
+	if ( count == 0 ) {
+		lua_settop(L, top);
+		return;
+	}
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, levbuffer->ref);
+	lua_insert(L, -2);
+	if ( levent->batch ) {
+		batch_append(levent, LUA_EV_DATA, levbuffer, 0, 1);
+		return;
+	}
+	lua_rawgeti(L, LUA_REGISTRYINDEX, levent->callback);
+	lua_pushinteger(L, LUA_EV_DATA);
+	lua_rotate(L, -4, 2);
+	levent_pcall(levent, 3);
+}
+
 static void
 read_complete(struct bufferevent* core, void* ud) {
 	levbuffer_t* levbuffer = ud;
 	levent_t* levent = levbuffer->levent;
+	if ( levbuffer->frame_header > 0 ) {
+		read_frames(levbuffer);
+		return;
+	}
+	if ( levent->batch ) {
+		lua_rawgeti(levent->L, LUA_REGISTRYINDEX, levbuffer->ref);
+		batch_append(levent, LUA_EV_DATA, levbuffer, 0, 0);
+		return;
+	}
 	lua_rawgeti(levent->L, LUA_REGISTRYINDEX, levent->callback);
 	lua_pushinteger(levent->L, LUA_EV_DATA);
 	lua_rawgeti(levent->L, LUA_REGISTRYINDEX, levbuffer->ref);
-	lua_pcall(levent->L, 2, 0, 0);
+	levent_pcall(levent, 2);
+}
+
+//output fell to the write low watermark,wake writers only if someone asked
+static void
+write_drain(struct bufferevent* core, void* ud) {
+	levbuffer_t* levbuffer = ud;
+	levent_t* levent = levbuffer->levent;
+	if ( !levbuffer->write_wait ) {
+		return;
+	}
+	levbuffer->write_wait = 0;
+
+	batch_flush(levent);
+	lua_rawgeti(levent->L, LUA_REGISTRYINDEX, levent->callback);
+	lua_pushinteger(levent->L, LUA_EV_WRITABLE);
+	lua_rawgeti(levent->L, LUA_REGISTRYINDEX, levbuffer->ref);
+	levent_pcall(levent, 2);
 }
 
 static void
@@ -125,10 +722,11 @@ write_complete(struct bufferevent* core, void* ud) {
 	levent_t* levent = levbuffer->levent;
 	assert(levbuffer->closed == 1);
 
+	batch_flush(levent);
 	lua_rawgeti(levent->L, LUA_REGISTRYINDEX, levent->callback);
 	lua_pushinteger(levent->L, LUA_EV_ERROR);
 	lua_rawgeti(levent->L, LUA_REGISTRYINDEX, levbuffer->ref);
-	lua_pcall(levent->L, 2, 0, 0);
+	levent_pcall(levent, 2);
 
 	_bufferevent_destroy(levbuffer);
 }
@@ -139,10 +737,11 @@ event_happen(struct bufferevent* core, short events, void* ud) {
 	levent_t* levent = levbuffer->levent;
 
 	if ( events & ( BEV_EVENT_ERROR | BEV_EVENT_EOF ) ) {
+		batch_flush(levent);
 		lua_rawgeti(levent->L, LUA_REGISTRYINDEX, levent->callback);
 		lua_pushinteger(levent->L, LUA_EV_ERROR);
 		lua_rawgeti(levent->L, LUA_REGISTRYINDEX, levbuffer->ref);
-		lua_pcall(levent->L, 2, 0, 0);
+		levent_pcall(levent, 2);
 		levbuffer->closed = 1;
 		_bufferevent_destroy(levbuffer);
 	}
@@ -156,13 +755,14 @@ connect_complete(struct bufferevent* core, short events, void* ud) {
 	levbuffer_t* levbuffer = ud;
 	levent_t* levent = levbuffer->levent;
 
+	batch_flush(levent);
 	lua_rawgeti(levent->L, LUA_REGISTRYINDEX, levent->callback);
 	lua_pushinteger(levent->L, LUA_EV_CONNECT);
 	lua_pushinteger(levent->L, levbuffer->connect_session);
 	if ( events & BEV_EVENT_CONNECTED ) {
 		lua_pushboolean(levent->L, 1);
 		lua_rawgeti(levent->L, LUA_REGISTRYINDEX, levbuffer->ref);
-		bufferevent_setcb(levbuffer->core, read_complete, NULL, event_happen, levbuffer);
+		bufferevent_setcb(levbuffer->core, read_complete, write_drain, event_happen, levbuffer);
 		bufferevent_enable(levbuffer->core, EV_READ);
 	}
 	else if ( events & BEV_EVENT_ERROR ){
@@ -175,48 +775,158 @@ connect_complete(struct bufferevent* core, short events, void* ud) {
 		_bufferevent_destroy(levbuffer);
 	}
 
-	lua_pcall(levent->L, 4, 0, 0);
+	levent_pcall(levent, 4);
 	return;
 }
 
+//ip,port of a peer,unix peers give their path("@name" in the abstract namespace,
+//"unix" when unnamed) and the peer pid from SO_PEERCRED when fd is known
+static int
+push_addr(lua_State* L, struct sockaddr* addr, int socklen, evutil_socket_t fd) {
+	char ip[INET6_ADDRSTRLEN];
+	if ( addr->sa_family == AF_INET ) {
+		struct sockaddr_in* sin = ( struct sockaddr_in* )addr;
+		evutil_inet_ntop(AF_INET, &sin->sin_addr, ip, sizeof( ip ));
+		lua_pushstring(L, ip);
+		lua_pushinteger(L, ntohs(sin->sin_port));
+	}
+	else if ( addr->sa_family == AF_INET6 ) {
+		struct sockaddr_in6* sin6 = ( struct sockaddr_in6* )addr;
+		evutil_inet_ntop(AF_INET6, &sin6->sin6_addr, ip, sizeof( ip ));
+		lua_pushstring(L, ip);
+		lua_pushinteger(L, ntohs(sin6->sin6_port));
+	}
+#ifdef _LINUX
+	else if ( addr->sa_family == AF_UNIX ) {
+		struct sockaddr_un* sun = ( struct sockaddr_un* )addr;
+		int size = socklen - (int)offsetof(struct sockaddr_un, sun_path);
+		if ( size <= 0 ) {
+			lua_pushstring(L, "unix");
+		}
+		else if ( sun->sun_path[0] == 0 ) {
+			lua_pushliteral(L, "@");
+			lua_pushlstring(L, sun->sun_path + 1, size - 1);
+			lua_concat(L, 2);
+		}
+		else {
+			lua_pushlstring(L, sun->sun_path, strnlen(sun->sun_path, size));
+		}
+		struct ucred cred;
+		socklen_t len = sizeof( cred );
+		if ( fd >= 0 && getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 ) {
+			lua_pushinteger(L, cred.pid);
+		}
+		else {
+			lua_pushnil(L);
+		}
+	}
+#endif
+	else {
+		lua_pushstring(L, "unknown");
+		lua_pushnil(L);
+	}
+	return 2;
+}
+
+//hand the accepted connections collected so far to lua as one array
+static void
+accept_flush(levlistener_t* levlistener) {
+	levent_t* levent = levlistener->levent;
+	if ( !levlistener->pending ) {
+		return;
+	}
+	lua_State* L = levent->L;
+	lua_rawgeti(L, LUA_REGISTRYINDEX, levent->callback);
+	lua_pushinteger(L, LUA_EV_ACCEPT);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, levlistener->ref);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, levlistener->pending_ref);
+	luaL_unref(L, LUA_REGISTRYINDEX, levlistener->pending_ref);
+	levlistener->pending_ref = LUA_NOREF;
+	levlistener->pending = 0;
+	levent_pcall(levent, 3);
+}
+
+static void
+accept_flush_cb(evutil_socket_t fd, short what, void* ud) {
+	levlistener_t* levlistener = ud;
+	batch_flush(levlistener->levent);
+	accept_flush(levlistener);
+}
+
 static void
 accept_socket(struct evconnlistener *listener, evutil_socket_t fd, struct sockaddr* addr, int socklen, void *ud) {
 	levlistener_t* levlistener = ud;
 	levent_t* levent = levlistener->levent;
+	lua_State* L = levent->L;
 
+	batch_flush(levent);
 	evutil_make_socket_nonblocking(fd);
 	evutil_make_socket_closeonexec(fd);
 
-	levbuffer_t* levbuffer = _bufferevent_create(levent->L, levent, fd, BEV_OPT_CLOSE_ON_FREE);
+	if ( levlistener->batch > 0 ) {
+		//libevent keep accepting until the backlog is empty,collect them as { buffer,ip,port,... ,n = count }
+		if ( !levlistener->pending ) {
+			lua_createtable(L, levlistener->batch * 3, 1);
+			levlistener->pending_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+			event_active(levlistener->flush_ev, EV_TIMEOUT, 0);
+		}
+		lua_rawgeti(L, LUA_REGISTRYINDEX, levlistener->pending_ref);
+		int base = levlistener->pending * 3;
 
-	bufferevent_setcb(levbuffer->core, read_complete, NULL, event_happen, levbuffer);
-	bufferevent_enable(levbuffer->core, EV_READ);
+		levbuffer_t* levbuffer = _bufferevent_create(L, levent, fd, BEV_OPT_CLOSE_ON_FREE);
+		if ( levlistener->priority >= 0 ) {
+			bufferevent_priority_set(levbuffer->core, levlistener->priority);
+		}
+		bufferevent_setcb(levbuffer->core, read_complete, write_drain, event_happen, levbuffer);
+		bufferevent_enable(levbuffer->core, EV_READ);
+		lua_rawseti(L, -2, base + 1);
 
-	lua_rawgeti(levent->L, LUA_REGISTRYINDEX, levent->callback);
-	lua_pushinteger(levent->L, LUA_EV_ACCEPT);
-	lua_rawgeti(levent->L, LUA_REGISTRYINDEX, levlistener->ref);
-	lua_pushvalue(levent->L, -4);
+		push_addr(L, addr, socklen, fd);
+		lua_rawseti(L, -3, base + 3);
+		lua_rawseti(L, -2, base + 2);
 
-	if ( addr->sa_family == AF_INET ) {
-		lua_pushstring(levent->L, inet_ntoa(( ( struct sockaddr_in* )addr )->sin_addr));
-		lua_pushinteger(levent->L, ( ( struct sockaddr_in* )addr )->sin_port);
+		levlistener->pending++;
+		lua_pushinteger(L, levlistener->pending);
+		lua_setfield(L, -2, "n");
+		lua_pop(L, 1);
+
+		if ( levlistener->pending >= levlistener->batch ) {
+			accept_flush(levlistener);
+		}
+		return;
 	}
-	else if ( addr->sa_family == AF_UNIX ){
-		lua_pushstring(levent->L, "unknown");
-		lua_pushnil(levent->L);
+
+	levbuffer_t* levbuffer = _bufferevent_create(L, levent, fd, BEV_OPT_CLOSE_ON_FREE);
+	if ( levlistener->priority >= 0 ) {
+		bufferevent_priority_set(levbuffer->core, levlistener->priority);
 	}
 
-	lua_pcall(levent->L, 5, 0, 0);
+	bufferevent_setcb(levbuffer->core, read_complete, write_drain, event_happen, levbuffer);
+	bufferevent_enable(levbuffer->core, EV_READ);
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, levent->callback);
+	lua_pushinteger(L, LUA_EV_ACCEPT);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, levlistener->ref);
+	lua_pushvalue(L, -4);
+	push_addr(L, addr, socklen, fd);
+
+	levent_pcall(levent, 5);
+	lua_pop(L, 1);
 }
 
 static void
 timeout(int fd, short event, void* ud) {
 	levtimer_t* levtimer = ud;
 	levent_t* levent = levtimer->levent;
+	if ( levent->batch ) {
+		lua_rawgeti(levent->L, LUA_REGISTRYINDEX, levtimer->ref);
+		batch_append(levent, LUA_EV_TIMEOUT, levtimer, levtimer->serial, 0);
+		return;
+	}
 	lua_rawgeti(levent->L, LUA_REGISTRYINDEX, levent->callback);
 	lua_pushinteger(levent->L, LUA_EV_TIMEOUT);
 	lua_rawgeti(levent->L, LUA_REGISTRYINDEX, levtimer->ref);
-	lua_pcall(levent->L, 2, 0, 0);
+	levent_pcall(levent, 2);
 }
 
 static void
@@ -226,6 +936,7 @@ dns_response(int err, struct evutil_addrinfo *ai, void* ud) {
 	
 	int args_count = 2;
 
+	batch_flush(levent);
 	lua_rawgeti(levent->L, LUA_REGISTRYINDEX, levent->callback);
 	lua_pushinteger(levent->L, LUA_EV_DNS);
 	lua_rawgeti(levent->L, LUA_REGISTRYINDEX, levdns->ref);
@@ -258,24 +969,47 @@ dns_response(int err, struct evutil_addrinfo *ai, void* ud) {
 		evutil_freeaddrinfo(ai);
 	}
 
-	lua_pcall(levent->L, args_count, 0, 0);
+	levent_pcall(levent, args_count);
 	
 	luaL_unref(levent->L, LUA_REGISTRYINDEX, levdns->ref);
 }
 
+//the client went away before the reply was done,an unfinished request is detached
+//from its connection and left to us to free,a finished one libevent free itself
+static void
+request_lost(struct evhttp_connection* evcon, void* ud) {
+	lrequest_t* lrequest = ud;
+	lrequest->lost = 1;
+	if ( lrequest->chunk ) {
+		evbuffer_free(lrequest->chunk);
+		lrequest->chunk = NULL;
+	}
+	if ( !evhttp_request_get_connection(lrequest->request) ) {
+		evhttp_request_free(lrequest->request);
+	}
+	lrequest->request = NULL;
+	luaL_unref(lrequest->levent->L, LUA_REGISTRYINDEX, lrequest->ref);
+}
+
 static void
 on_httpd_request(struct evhttp_request *req, void *ud) {
 	lhttpd_t* lhttpd = ud;
 	levent_t* levent = lhttpd->levent;
 
+	batch_flush(levent);
 	lua_rawgeti(levent->L, LUA_REGISTRYINDEX, levent->callback);
 	lua_pushinteger(levent->L, LUA_EV_HTTP);
 	lua_rawgeti(levent->L, LUA_REGISTRYINDEX, lhttpd->ref);
 
 	lrequest_t* lrequest = lua_newuserdata(levent->L, sizeof( *lrequest ));
+	lrequest->levent = levent;
 	lrequest->request = req;
+	lrequest->chunk = NULL;
 	lrequest->closed = 0;
+	lrequest->streaming = 0;
+	lrequest->lost = 0;
 	lrequest->ref = _meta_init(levent->L, META_HTTP_REQUEST);
+	evhttp_connection_set_closecb(evhttp_request_get_connection(req), request_lost, lrequest);
 
 	switch ( evhttp_request_get_command(req) ) {
 		case EVHTTP_REQ_GET: {
@@ -309,17 +1043,46 @@ on_httpd_request(struct evhttp_request *req, void *ud) {
 
 	struct evbuffer *buf = evhttp_request_get_input_buffer(req);
 	size_t len = evbuffer_get_length(buf);
-	if ( len == 0 ) {
+	if ( len == 0 || lhttpd->lazy_body ) {
+		//lazy body stay in libevent,fetch by request:body()/body_view()
 		lua_pushnil(levent->L);
 	}
 	else {
-		char* data = malloc(len);
-		evbuffer_remove(buf, data, len);
-		lua_pushlstring(levent->L, data, len);
-		free(data);
+		lua_pushlstring(levent->L, (const char*)evbuffer_pullup(buf, len), len);
+		evbuffer_drain(buf, len);
+	}
+
+	levent_pcall(levent, 8);
+}
+
+static void
+mail_arrive(int fd, short event, void* ud) {
+	levent_t* levent = ud;
+	lworker_t* worker = levent->worker;
+	lua_State* L = levent->L;
+
+	lmail_t* list = ATOM_XCHG_POINTER(&worker->mailbox, NULL);
+
+	//producers push on the head,reverse to restore send order
+	lmail_t* mail = NULL;
+	while ( list ) {
+		lmail_t* next = list->next;
+		list->next = mail;
+		mail = list;
+		list = next;
 	}
 
-	lua_pcall(levent->L, 8, 0, 0);
+	batch_flush(levent);
+	while ( mail ) {
+		lmail_t* next = mail->next;
+		lua_rawgeti(L, LUA_REGISTRYINDEX, levent->callback);
+		lua_pushinteger(L, LUA_EV_MAIL);
+		lua_pushinteger(L, mail->source);
+		lua_pushlstring(L, mail->data, mail->size);
+		levent_pcall(levent, 3);
+		free(mail);
+		mail = next;
+	}
 }
 
 levbuffer_t*
@@ -345,10 +1108,100 @@ _bufferevent_read(lua_State* L) {
 		size = len;
 	}
 
-	char* data = malloc(size);
-	evbuffer_remove(input, data, size);
+	const char* data = (const char*)evbuffer_pullup(input, size);
 	lua_pushlstring(L, data, size);
-	free(data);
+	evbuffer_drain(input, size);
+	STATS_ADD(levbuffer->levent, bytes_read, size);
+	return 1;
+}
+
+//borrowed view over input buffer,valid until next consume/read or callback return
+static int
+_bufferevent_peek(lua_State* L) {
+	levbuffer_t* levbuffer = get_evbuffer(L);
+	size_t size = luaL_optinteger(L, 2, 0);
+
+	struct evbuffer* input = bufferevent_get_input(levbuffer->core);
+	size_t len = evbuffer_get_length(input);
+	if ( len == 0 ) {
+		return 0;
+	}
+	if ( size == 0 ) {
+		struct evbuffer_iovec vec;
+		evbuffer_peek(input, -1, NULL, &vec, 1);
+		size = vec.iov_len;
+	}
+	else if ( size > len ) {
+		return 0;
+	}
+
+	unsigned char* data = evbuffer_pullup(input, size);
+	lua_pushlightuserdata(L, data);
+	lua_pushinteger(L, size);
+	return 2;
+}
+
+//borrowed views over every contiguous chunk,without pullup
+static int
+_bufferevent_slice(lua_State* L) {
+	levbuffer_t* levbuffer = get_evbuffer(L);
+	ev_ssize_t size = luaL_optinteger(L, 2, -1);
+
+	struct evbuffer* input = bufferevent_get_input(levbuffer->core);
+	if ( evbuffer_get_length(input) == 0 ) {
+		return 0;
+	}
+
+	int count = evbuffer_peek(input, size, NULL, NULL, 0);
+	struct evbuffer_iovec stack_vec[16];
+	struct evbuffer_iovec* vec = stack_vec;
+	if ( count > 16 ) {
+		vec = malloc(sizeof( *vec ) * count);
+	}
+	count = evbuffer_peek(input, size, NULL, vec, count);
+
+	lua_createtable(L, count * 2, 0);
+	int i;
+	size_t total = 0;
+	for ( i = 0; i < count; i++ ) {
+		size_t len = vec[i].iov_len;
+		if ( size >= 0 && total + len > (size_t)size ) {
+			len = size - total;
+		}
+		total += len;
+		lua_pushlightuserdata(L, vec[i].iov_base);
+		lua_rawseti(L, -2, i * 2 + 1);
+		lua_pushinteger(L, len);
+		lua_rawseti(L, -2, i * 2 + 2);
+	}
+
+	if ( vec != stack_vec ) {
+		free(vec);
+	}
+	lua_pushinteger(L, total);
+	return 2;
+}
+
+static int
+_bufferevent_consume(lua_State* L) {
+	levbuffer_t* levbuffer = get_evbuffer(L);
+	size_t size = luaL_checkinteger(L, 2);
+
+	struct evbuffer* input = bufferevent_get_input(levbuffer->core);
+	size_t len = evbuffer_get_length(input);
+	if ( size > len ) {
+		size = len;
+	}
+	evbuffer_drain(input, size);
+	STATS_ADD(levbuffer->levent, bytes_read, size);
+	lua_pushinteger(L, len - size);
+	return 1;
+}
+
+static int
+_bufferevent_input_size(lua_State* L) {
+	levbuffer_t* levbuffer = get_evbuffer(L);
+	lua_pushinteger(L, evbuffer_get_length(bufferevent_get_input(levbuffer->core)));
 	return 1;
 }
 
@@ -364,31 +1217,276 @@ _bufferevent_read_line(lua_State* L) {
 	}
 
 	lua_pushlstring(L, line, len);
+	free(line);
+	STATS_ADD(levbuffer->levent, bytes_read, len);
 	return 1;
 }
 
+static void
+unpin_string(const void* data, size_t size, void* ud) {
+	lpin_t* pin = ud;
+	levent_t* levent = pin->levent;
+	luaL_unref(levent->L, LUA_REGISTRYINDEX, pin->ref);
+	pin->next = levent->pins;
+	levent->pins = pin;
+}
+
+//append string at index to output,pinned in registry instead of copied when reference
+static int
+output_add(lua_State* L, levbuffer_t* levbuffer, int index, int reference) {
+	size_t size;
+	const char* data = lua_tolstring(L, index, &size);
+	if ( !data ) {
+		luaL_error(L, "write string expected,got %s", luaL_typename(L, index));
+	}
+	struct evbuffer* output = bufferevent_get_output(levbuffer->core);
+	levent_t* levent = levbuffer->levent;
+	STATS_ADD(levent, bytes_written, size);
+	if ( !reference || size < PIN_MIN_SIZE ) {
+		return evbuffer_add(output, data, size);
+	}
+
+	lpin_t* pin = levent->pins;
+	if ( pin ) {
+		levent->pins = pin->next;
+	}
+	else {
+		pin = malloc(sizeof( *pin ));
+		pin->levent = levent;
+	}
+	lua_pushvalue(L, index);
+	pin->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+	if ( evbuffer_add_reference(output, data, size, unpin_string, pin) < 0 ) {
+		unpin_string(data, size, pin);
+		return -1;
+	}
+	return 0;
+}
+
 static int
 _bufferevent_write(lua_State* L) {
 	levbuffer_t* levbuffer = get_evbuffer(L);
 	size_t size;
-	const char* data = luaL_checklstring(L, 2, &size);
+	luaL_checklstring(L, 2, &size);
+	int reference = lua_toboolean(L, 3);
 	if (size == 0) {
 		lua_pushboolean(L, 0);
 	} else {
-		int ok = bufferevent_write(levbuffer->core, data, size);
+		int ok = output_add(L, levbuffer, 2, reference);
 		lua_pushboolean(L, ok == 0);
 	}
 	return 1;
 }
 
+static int
+_bufferevent_writev(lua_State* L) {
+	levbuffer_t* levbuffer = get_evbuffer(L);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	int reference = lua_toboolean(L, 3);
+
+	int ok = 0;
+	int count = lua_rawlen(L, 2);
+	int i;
+	for ( i = 1; i <= count && ok == 0; i++ ) {
+		lua_rawgeti(L, 2, i);
+		ok = output_add(L, levbuffer, -1, reference);
+		lua_pop(L, 1);
+	}
+	lua_pushboolean(L, ok == 0);
+	return 1;
+}
+
+static int
+_bufferevent_frame(lua_State* L) {
+	levbuffer_t* levbuffer = get_evbuffer(L);
+	int header = luaL_checkinteger(L, 2);
+	size_t max = luaL_optinteger(L, 3, 0);
+	int big_endian = lua_toboolean(L, 4);
+
+	luaL_argcheck(L, header >= 0 && header <= 8, 2, "header size must in [0,8]");
+
+	levbuffer->frame_header = header;
+	levbuffer->frame_max = max;
+	levbuffer->frame_big_endian = big_endian;
+
+	bufferevent_setwatermark(levbuffer->core, EV_READ, header, levbuffer->read_high);
+	return 0;
+}
+
+//in frame mode the read low watermark is owned by the frame reader
+static int
+_bufferevent_set_watermark(lua_State* L) {
+	levbuffer_t* levbuffer = get_evbuffer(L);
+	size_t read_low = luaL_optinteger(L, 2, 0);
+	size_t read_high = luaL_optinteger(L, 3, 0);
+	size_t write_low = luaL_optinteger(L, 4, 0);
+	size_t write_high = luaL_optinteger(L, 5, 0);
+
+	levbuffer->read_high = read_high;
+	if ( levbuffer->frame_header > 0 ) {
+		read_low = levbuffer->frame_header;
+	}
+	bufferevent_setwatermark(levbuffer->core, EV_READ, read_low, read_high);
+	bufferevent_setwatermark(levbuffer->core, EV_WRITE, write_low, 0);
+	levbuffer->write_high = write_high;
+	return 0;
+}
+
+static int
+_bufferevent_output_size(lua_State* L) {
+	levbuffer_t* levbuffer = get_evbuffer(L);
+	lua_pushinteger(L, evbuffer_get_length(bufferevent_get_output(levbuffer->core)));
+	return 1;
+}
+
+//true if output is above the write high watermark,LUA_EV_WRITABLE follows once drained
+static int
+_bufferevent_wait_writable(lua_State* L) {
+	levbuffer_t* levbuffer = get_evbuffer(L);
+	size_t len = evbuffer_get_length(bufferevent_get_output(levbuffer->core));
+	if ( levbuffer->write_high > 0 && len > levbuffer->write_high ) {
+		levbuffer->write_wait = 1;
+		lua_pushboolean(L, 1);
+	}
+	else {
+		lua_pushboolean(L, 0);
+	}
+	return 1;
+}
+
+static void
+rate_group_leave(levbuffer_t* levbuffer) {
+	if ( levbuffer->rate_group ) {
+		bufferevent_remove_from_rate_limit_group(levbuffer->core);
+		levbuffer->rate_group->members--;
+		levbuffer->rate_group = NULL;
+	}
+}
+
 static int
 _bufferevent_destroy(levbuffer_t* levbuffer) {
 	levent_t* levent = levbuffer->levent;
+	levent->live_buffers--;
 	luaL_unref(levent->L, LUA_REGISTRYINDEX, levbuffer->ref);
+	if ( levbuffer->pool_key ) {
+		pool_detach(levbuffer);
+	}
+	rate_group_leave(levbuffer);
+	if ( levbuffer->rate_cfg ) {
+		bufferevent_set_rate_limit(levbuffer->core, NULL);
+		ev_token_bucket_cfg_free(levbuffer->rate_cfg);
+		levbuffer->rate_cfg = NULL;
+	}
 	bufferevent_free(levbuffer->core);
 	return 0;
 }
 
+//rates are bytes per second,0 means unlimited,refilled every tick seconds
+static struct ev_token_bucket_cfg*
+bucket_cfg_new(lua_State* L, int index) {
+	lua_Number read_rate = luaL_optnumber(L, index, 0);
+	size_t read_burst = luaL_optinteger(L, index + 1, 0);
+	lua_Number write_rate = luaL_optnumber(L, index + 2, 0);
+	size_t write_burst = luaL_optinteger(L, index + 3, 0);
+	lua_Number tick = luaL_optnumber(L, index + 4, 0.1);
+	luaL_argcheck(L, tick > 0, index + 4, "tick must be positive");
+
+	size_t read_tick = EV_RATE_LIMIT_MAX;
+	if ( read_rate > 0 ) {
+		read_tick = (size_t)( read_rate * tick );
+		if ( read_tick == 0 ) {
+			read_tick = 1;
+		}
+	}
+	size_t write_tick = EV_RATE_LIMIT_MAX;
+	if ( write_rate > 0 ) {
+		write_tick = (size_t)( write_rate * tick );
+		if ( write_tick == 0 ) {
+			write_tick = 1;
+		}
+	}
+	if ( read_burst < read_tick ) {
+		read_burst = read_tick;
+	}
+	if ( write_burst < write_tick ) {
+		write_burst = write_tick;
+	}
+
+	struct timeval tv;
+	tv.tv_sec = (long)tick;
+	tv.tv_usec = (long)( ( tick - tv.tv_sec ) * 1000000 );
+
+	struct ev_token_bucket_cfg* cfg = ev_token_bucket_cfg_new(read_tick, read_burst, write_tick, write_burst, &tv);
+	if ( !cfg ) {
+		luaL_error(L, "invalid rate limit config");
+	}
+	return cfg;
+}
+
+//buf:rate_limit(read_rate,read_burst,write_rate,write_burst,tick),no args to remove
+static int
+_bufferevent_rate_limit(lua_State* L) {
+	levbuffer_t* levbuffer = get_evbuffer(L);
+	struct ev_token_bucket_cfg* cfg = NULL;
+	if ( lua_gettop(L) > 1 ) {
+		cfg = bucket_cfg_new(L, 2);
+	}
+	if ( bufferevent_set_rate_limit(levbuffer->core, cfg) < 0 ) {
+		if ( cfg ) {
+			ev_token_bucket_cfg_free(cfg);
+		}
+		lua_pushboolean(L, 0);
+		return 1;
+	}
+	if ( levbuffer->rate_cfg ) {
+		ev_token_bucket_cfg_free(levbuffer->rate_cfg);
+	}
+	levbuffer->rate_cfg = cfg;
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int
+_bufferevent_rate_stats(lua_State* L) {
+	levbuffer_t* levbuffer = get_evbuffer(L);
+	lua_pushinteger(L, bufferevent_get_read_limit(levbuffer->core));
+	lua_pushinteger(L, bufferevent_get_write_limit(levbuffer->core));
+	return 2;
+}
+
+static lrate_group_t*
+get_rate_group(lua_State* L, int index) {
+	lrate_group_t* lgroup = ( lrate_group_t* )luaL_checkudata(L, index, META_RATE_GROUP);
+	if ( lgroup->closed ) {
+		luaL_error(L, "rate group:0x%x already released", lgroup);
+	}
+	return lgroup;
+}
+
+static int
+_bufferevent_join_group(lua_State* L) {
+	levbuffer_t* levbuffer = get_evbuffer(L);
+	lrate_group_t* lgroup = get_rate_group(L, 2);
+	if ( levbuffer->rate_group == lgroup ) {
+		return 0;
+	}
+	if ( levbuffer->rate_group ) {
+		levbuffer->rate_group->members--;
+	}
+	bufferevent_add_to_rate_limit_group(levbuffer->core, lgroup->group);
+	levbuffer->rate_group = lgroup;
+	lgroup->members++;
+	return 0;
+}
+
+static int
+_bufferevent_leave_group(lua_State* L) {
+	levbuffer_t* levbuffer = get_evbuffer(L);
+	rate_group_leave(levbuffer);
+	return 0;
+}
+
 static int
 _bufferevent_close(lua_State* L) {
 	levbuffer_t* levbuffer = get_evbuffer(L);
@@ -402,6 +1500,10 @@ _bufferevent_close(lua_State* L) {
 	if (immediately == 1) {
 		_bufferevent_destroy(levbuffer);
 	} else {
+		//a closing buffer is no longer a member,its group can be released while it drain
+		rate_group_leave(levbuffer);
+		//write_complete must wait for the output to drain fully,not down to a low watermark
+		bufferevent_setwatermark(levbuffer->core, EV_WRITE, 0, 0);
 		bufferevent_setcb(levbuffer->core, NULL, write_complete, event_happen, levbuffer);
 		bufferevent_enable(levbuffer->core, EV_WRITE);
 		bufferevent_disable(levbuffer->core, EV_READ);
@@ -417,6 +1519,20 @@ _bufferevent_alive(lua_State* L) {
 	return 1;
 }
 
+//buf:priority(n),with no argument return the current one
+static int
+_bufferevent_priority(lua_State* L) {
+	levbuffer_t* levbuffer = get_evbuffer(L);
+	if ( !lua_isnoneornil(L, 2) ) {
+		int priority = check_priority(L, levbuffer->levent, 2);
+		if ( priority >= 0 && bufferevent_priority_set(levbuffer->core, priority) < 0 ) {
+			luaL_error(L, "buffer priority set failed");
+		}
+	}
+	lua_pushinteger(L, bufferevent_get_priority(levbuffer->core));
+	return 1;
+}
+
 static levbuffer_t*
 _bufferevent_create(lua_State* L, levent_t* levent, evutil_socket_t sock, int opt) {
 	levbuffer_t* levbuffer = lua_newuserdata(L, sizeof( levbuffer_t ));
@@ -425,21 +1541,341 @@ _bufferevent_create(lua_State* L, levent_t* levent, evutil_socket_t sock, int op
 	levbuffer->closed = 0;
 
 	levbuffer->core = bufferevent_socket_new(levent->ev_base, sock, opt);
+	levent->live_buffers++;
 
 	levbuffer->ref = _meta_init(L, META_EVBUFFER);
 
 	return levbuffer;
 }
 
+typedef struct lfile {
+	char* path;
+	struct evbuffer_file_segment* seg;
+	ev_off_t size;
+	time_t mtime;
+	uint64_t checked;
+	struct lfile* prev;
+	struct lfile* next;
+} lfile_t;
+
+//open file segments by path,most recently used first
+typedef struct lfile_cache {
+	lfile_t* head;
+	lfile_t* tail;
+	int count;
+	int max;
+	uint64_t check_ms;
+	uint64_t hit;
+	uint64_t miss;
+} lfile_cache_t;
+
+#ifdef _WIN32
+#define file_close(fd) _close(fd)
+#else
+#define file_close(fd) close(fd)
+#endif
+
+static int
+file_stat(int fd, const char* path, ev_off_t* size, time_t* mtime) {
+#ifdef _WIN32
+	struct _stat64 st;
+	int result = path ? _stat64(path, &st) : _fstat64(fd, &st);
+	if ( result < 0 ) {
+		return -1;
+	}
+	if ( !( st.st_mode & _S_IFREG ) ) {
+		errno = EISDIR;
+		return -1;
+	}
+#else
+	struct stat st;
+	int result = path ? stat(path, &st) : fstat(fd, &st);
+	if ( result < 0 ) {
+		return -1;
+	}
+	if ( !S_ISREG(st.st_mode) ) {
+		errno = EISDIR;
+		return -1;
+	}
+#endif
+	*size = st.st_size;
+	*mtime = st.st_mtime;
+	return 0;
+}
+
 static int
-_reply_send(lua_State* L) {
+file_open(const char* path, ev_off_t* size, time_t* mtime) {
+#ifdef _WIN32
+	int fd = _open(path, _O_RDONLY | _O_BINARY);
+#else
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+#endif
+	if ( fd < 0 ) {
+		return -1;
+	}
+	if ( file_stat(fd, NULL, size, mtime) < 0 ) {
+		int err = errno;
+		file_close(fd);
+		errno = err;
+		return -1;
+	}
+	return fd;
+}
+
+static void
+file_unlink(lfile_cache_t* cache, lfile_t* file) {
+	if ( file->prev ) {
+		file->prev->next = file->next;
+	}
+	else {
+		cache->head = file->next;
+	}
+	if ( file->next ) {
+		file->next->prev = file->prev;
+	}
+	else {
+		cache->tail = file->prev;
+	}
+	file->prev = file->next = NULL;
+}
+
+static void
+file_push(lfile_cache_t* cache, lfile_t* file) {
+	file->prev = NULL;
+	file->next = cache->head;
+	if ( cache->head ) {
+		cache->head->prev = file;
+	}
+	else {
+		cache->tail = file;
+	}
+	cache->head = file;
+}
+
+//segments still queued in some output keep their fd until sent
+static void
+file_free(lfile_cache_t* cache, lfile_t* file) {
+	file_unlink(cache, file);
+	cache->count--;
+	evbuffer_file_segment_free(file->seg);
+	free(file->path);
+	free(file);
+}
+
+static void
+file_cache_free(lfile_cache_t* cache) {
+	while ( cache->head ) {
+		file_free(cache, cache->head);
+	}
+	free(cache);
+}
+
+//segment over the whole file,*owned tell whether the caller must free it
+static struct evbuffer_file_segment*
+file_segment(levent_t* levent, const char* path, ev_off_t* size, int* owned) {
+	lfile_cache_t* cache = levent->file_cache;
+	lfile_t* file = NULL;
+	uint64_t now = 0;
+	if ( cache ) {
+		struct timeval tv;
+		event_base_gettimeofday_cached(levent->ev_base, &tv);
+		now = (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+
+		for ( file = cache->head; file; file = file->next ) {
+			if ( strcmp(file->path, path) == 0 ) {
+				break;
+			}
+		}
+		if ( file && now - file->checked >= cache->check_ms ) {
+			ev_off_t fsize;
+			time_t mtime;
+			file->checked = now;
+			if ( file_stat(-1, path, &fsize, &mtime) < 0 || fsize != file->size || mtime != file->mtime ) {
+				file_free(cache, file);
+				file = NULL;
+			}
+		}
+		if ( file ) {
+			cache->hit++;
+			file_unlink(cache, file);
+			file_push(cache, file);
+			*size = file->size;
+			*owned = 0;
+			return file->seg;
+		}
+		cache->miss++;
+	}
+
+	time_t mtime;
+	int fd = file_open(path, size, &mtime);
+	if ( fd < 0 ) {
+		return NULL;
+	}
+	struct evbuffer_file_segment* seg = evbuffer_file_segment_new(fd, 0, *size, EVBUF_FS_CLOSE_ON_FREE);
+	if ( !seg ) {
+		file_close(fd);
+		return NULL;
+	}
+	if ( !cache ) {
+		*owned = 1;
+		return seg;
+	}
+
+	if ( cache->count >= cache->max ) {
+		file_free(cache, cache->tail);
+	}
+	size_t len = strlen(path);
+	file = malloc(sizeof( *file ));
+	file->path = malloc(len + 1);
+	memcpy(file->path, path, len + 1);
+	file->seg = seg;
+	file->size = *size;
+	file->mtime = mtime;
+	file->checked = now;
+	file_push(cache, file);
+	cache->count++;
+	*owned = 0;
+	return seg;
+}
+
+//append [offset,offset+length) of a file to buf,length < 0 means to the end
+//return true,length or false,err
+static int
+file_add(lua_State* L, levent_t* levent, struct evbuffer* buf, int index) {
+	ev_off_t offset = luaL_optinteger(L, index + 1, 0);
+	ev_off_t length = luaL_optinteger(L, index + 2, -1);
+	ev_off_t size;
+	time_t mtime;
+	struct evbuffer_file_segment* seg;
+	int owned = 1;
+
+	if ( lua_type(L, index) == LUA_TNUMBER ) {
+		//the caller keep its fd,the segment own a duplicate
+#ifdef _WIN32
+		int fd = _dup((int)lua_tointeger(L, index));
+#else
+		int fd = dup((int)lua_tointeger(L, index));
+#endif
+		if ( fd < 0 || file_stat(fd, NULL, &size, &mtime) < 0 ) {
+			int err = errno;
+			if ( fd >= 0 ) {
+				file_close(fd);
+			}
+			lua_pushboolean(L, 0);
+			lua_pushstring(L, strerror(err));
+			return 2;
+		}
+		seg = evbuffer_file_segment_new(fd, 0, size, EVBUF_FS_CLOSE_ON_FREE);
+		if ( !seg ) {
+			file_close(fd);
+		}
+	}
+	else {
+		seg = file_segment(levent, luaL_checkstring(L, index), &size, &owned);
+	}
+	if ( !seg ) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, strerror(errno));
+		return 2;
+	}
+
+	if ( offset < 0 || offset > size ) {
+		if ( owned ) {
+			evbuffer_file_segment_free(seg);
+		}
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, "offset out of range");
+		return 2;
+	}
+	if ( length < 0 || offset + length > size ) {
+		length = size - offset;
+	}
+
+	int result = length > 0 ? evbuffer_add_file_segment(buf, seg, offset, length) : 0;
+	if ( owned ) {
+		evbuffer_file_segment_free(seg);
+	}
+	if ( result < 0 ) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, "add file segment failed");
+		return 2;
+	}
+	STATS_ADD(levent, bytes_written, length);
+	lua_pushboolean(L, 1);
+	lua_pushinteger(L, length);
+	return 2;
+}
+
+//buf:send_file(fd_or_path,offset,length),goes out by sendfile where the platform has it
+static int
+_bufferevent_send_file(lua_State* L) {
+	levbuffer_t* levbuffer = get_evbuffer(L);
+	return file_add(L, levbuffer->levent, bufferevent_get_output(levbuffer->core), 2);
+}
+
+//ev:file_cache(max,check_interval),cached files are checked for change at most every check_interval seconds
+static int
+_file_cache(lua_State* L) {
+	levent_t* levent = ( levent_t* )lua_touserdata(L, 1);
+	int max = luaL_optinteger(L, 2, 64);
+	double interval = luaL_optnumber(L, 3, 1);
+
+	if ( levent->file_cache ) {
+		file_cache_free(levent->file_cache);
+		levent->file_cache = NULL;
+	}
+	if ( max <= 0 ) {
+		return 0;
+	}
+	lfile_cache_t* cache = malloc(sizeof( *cache ));
+	memset(cache, 0, sizeof( *cache ));
+	cache->max = max;
+	cache->check_ms = (uint64_t)( interval * 1000 );
+	levent->file_cache = cache;
+	return 0;
+}
+
+//NULL once the connection is lost,callers answer with request_gone
+static lrequest_t*
+get_request(lua_State* L) {
 	lrequest_t* lrequest = ( lrequest_t* )lua_touserdata(L, 1);
 	if ( lrequest->closed == 1 ) {
 		luaL_error(L, "request already closed");
 	}
-	luaL_unref(L, LUA_REGISTRYINDEX, lrequest->ref);
+	if ( lrequest->lost ) {
+		return NULL;
+	}
+	return lrequest;
+}
+
+static int
+request_gone(lua_State* L) {
+	lua_pushboolean(L, 0);
+	lua_pushstring(L, "connection lost");
+	return 2;
+}
 
+//reply fully handed to libevent,the connection no longer report to this request
+static void
+request_done(lua_State* L, lrequest_t* lrequest) {
+	struct evhttp_connection* evcon = evhttp_request_get_connection(lrequest->request);
+	if ( evcon ) {
+		evhttp_connection_set_closecb(evcon, NULL, NULL);
+	}
+	luaL_unref(L, LUA_REGISTRYINDEX, lrequest->ref);
 	lrequest->closed = 1;
+}
+
+static int
+_reply_send(lua_State* L) {
+	lrequest_t* lrequest = get_request(L);
+	if ( !lrequest ) {
+		return request_gone(L);
+	}
+	if ( lrequest->streaming ) {
+		luaL_error(L, "request already start chunked reply");
+	}
+	request_done(L, lrequest);
 
 	int code = lua_tointeger(L, 2);
 	const char* reason = lua_tostring(L, 3);
@@ -459,45 +1895,229 @@ _reply_send(lua_State* L) {
 	return 0;
 }
 
+//req:reply_file(code,path,offset,length),false,err without reply if the file can not be used
 static int
-_reply_set_header(lua_State* L) {
-	lrequest_t* lrequest = ( lrequest_t* )lua_touserdata(L, 1);
-	if ( lrequest->closed == 1 ) {
-		luaL_error(L, "request already closed");
+_reply_file(lua_State* L) {
+	lrequest_t* lrequest = get_request(L);
+	if ( !lrequest ) {
+		return request_gone(L);
 	}
-	const char* key = lua_tostring(L, 2);
-	const char* value = lua_tostring(L, 3);
+	if ( lrequest->streaming ) {
+		luaL_error(L, "request already start chunked reply");
+	}
+	int code = luaL_checkinteger(L, 2);
+	luaL_checkstring(L, 3);
 
-	evhttp_add_header(evhttp_request_get_output_headers(lrequest->request), key, value);
+	struct evbuffer *evb = evbuffer_new();
+	int count = file_add(L, lrequest->levent, evb, 3);
+	if ( !lua_toboolean(L, -count) ) {
+		evbuffer_free(evb);
+		return count;
+	}
+
+	request_done(L, lrequest);
+	evhttp_send_reply(lrequest->request, code, NULL, evb);
+	evbuffer_free(evb);
+	return count;
+}
+
+static int
+_reply_start(lua_State* L) {
+	lrequest_t* lrequest = get_request(L);
+	if ( !lrequest ) {
+		return request_gone(L);
+	}
+	if ( lrequest->streaming ) {
+		luaL_error(L, "request already start chunked reply");
+	}
+	int code = lua_tointeger(L, 2);
+	const char* reason = lua_tostring(L, 3);
+
+	lrequest->streaming = 1;
+	lrequest->chunk = evbuffer_new();
+	evhttp_send_reply_start(lrequest->request, code, reason);
 	return 0;
 }
 
 static int
-_listen_close(lua_State* L) {
-	levlistener_t* levlistener = ( levlistener_t* )lua_touserdata(L, 1);
-	if ( levlistener->closed ) {
-		luaL_error(L, "listener:0x%x alreay closed", levlistener);
+_reply_chunk(lua_State* L) {
+	lrequest_t* lrequest = get_request(L);
+	if ( !lrequest ) {
+		return request_gone(L);
+	}
+	if ( !lrequest->streaming ) {
+		luaL_error(L, "request not start chunked reply");
+	}
+	size_t size;
+	const char* data = luaL_checklstring(L, 2, &size);
+	if ( size > 0 ) {
+		evbuffer_add(lrequest->chunk, data, size);
+		evhttp_send_reply_chunk(lrequest->request, lrequest->chunk);
 	}
-	levlistener->closed = 1;
-	luaL_unref(L, LUA_REGISTRYINDEX, levlistener->ref);
-	evconnlistener_free(levlistener->listener);
 	return 0;
 }
 
 static int
-_listen_alive(lua_State* L) {
-	levlistener_t* levlistener = ( levlistener_t* )lua_touserdata(L, 1);
-	lua_pushboolean(L, levlistener->closed == 0);
-	return 1;
+_reply_end(lua_State* L) {
+	lrequest_t* lrequest = get_request(L);
+	if ( !lrequest ) {
+		return request_gone(L);
+	}
+	if ( !lrequest->streaming ) {
+		luaL_error(L, "request not start chunked reply");
+	}
+	request_done(L, lrequest);
+	evhttp_send_reply_end(lrequest->request);
+	evbuffer_free(lrequest->chunk);
+	lrequest->chunk = NULL;
+	return 0;
 }
 
-union un_sockaddr {
-#ifdef _LINUX
-	struct sockaddr_un su;
-#endif
-	struct sockaddr_in si;
-};
+//bytes still queued toward the peer,nothing if the connection is gone
+static int
+_reply_pending(lua_State* L) {
+	lrequest_t* lrequest = get_request(L);
+	if ( !lrequest ) {
+		return request_gone(L);
+	}
+	struct evhttp_connection* evcon = evhttp_request_get_connection(lrequest->request);
+	if ( !evcon ) {
+		return 0;
+	}
+	struct bufferevent* bev = evhttp_connection_get_bufferevent(evcon);
+	lua_pushinteger(L, evbuffer_get_length(bufferevent_get_output(bev)));
+	return 1;
+}
 
+static int
+_request_body(lua_State* L) {
+	lrequest_t* lrequest = get_request(L);
+	if ( !lrequest ) {
+		return request_gone(L);
+	}
+	struct evbuffer* buf = evhttp_request_get_input_buffer(lrequest->request);
+	size_t len = evbuffer_get_length(buf);
+	if ( len == 0 ) {
+		return 0;
+	}
+	lua_pushlstring(L, (const char*)evbuffer_pullup(buf, len), len);
+	return 1;
+}
+
+//borrowed view over request body,valid until the reply is sent
+static int
+_request_body_view(lua_State* L) {
+	lrequest_t* lrequest = get_request(L);
+	if ( !lrequest ) {
+		return request_gone(L);
+	}
+	struct evbuffer* buf = evhttp_request_get_input_buffer(lrequest->request);
+	size_t len = evbuffer_get_length(buf);
+	if ( len == 0 ) {
+		return 0;
+	}
+	lua_pushlightuserdata(L, evbuffer_pullup(buf, len));
+	lua_pushinteger(L, len);
+	return 2;
+}
+
+//req:peer(),ip,port of the client as accept report them
+static int
+_request_peer(lua_State* L) {
+	lrequest_t* lrequest = get_request(L);
+	if ( !lrequest ) {
+		return request_gone(L);
+	}
+	struct evhttp_connection* conn = evhttp_request_get_connection(lrequest->request);
+	evutil_socket_t fd = bufferevent_getfd(evhttp_connection_get_bufferevent(conn));
+	struct sockaddr_storage ss;
+	ev_socklen_t len = sizeof( ss );
+	if ( getpeername(fd, ( struct sockaddr* )&ss, &len) < 0 ) {
+		return 0;
+	}
+	return push_addr(L, ( struct sockaddr* )&ss, len, fd);
+}
+
+static int
+_reply_set_header(lua_State* L) {
+	lrequest_t* lrequest = get_request(L);
+	if ( !lrequest ) {
+		return request_gone(L);
+	}
+	const char* key = lua_tostring(L, 2);
+	const char* value = lua_tostring(L, 3);
+
+	evhttp_add_header(evhttp_request_get_output_headers(lrequest->request), key, value);
+	return 0;
+}
+
+static int
+_listen_close(lua_State* L) {
+	levlistener_t* levlistener = ( levlistener_t* )lua_touserdata(L, 1);
+	if ( levlistener->closed ) {
+		luaL_error(L, "listener:0x%x alreay closed", levlistener);
+	}
+	levlistener->closed = 1;
+	levlistener->levent->live_listeners--;
+	luaL_unref(L, LUA_REGISTRYINDEX, levlistener->ref);
+	evconnlistener_free(levlistener->listener);
+	if ( levlistener->flush_ev ) {
+		event_free(levlistener->flush_ev);
+	}
+	//nobody will see the connections still waiting for flush
+	if ( levlistener->pending ) {
+		lua_rawgeti(L, LUA_REGISTRYINDEX, levlistener->pending_ref);
+		int i;
+		for ( i = 0; i < levlistener->pending; i++ ) {
+			lua_rawgeti(L, -1, i * 3 + 1);
+			levbuffer_t* levbuffer = lua_touserdata(L, -1);
+			levbuffer->closed = 1;
+			_bufferevent_destroy(levbuffer);
+			lua_pop(L, 1);
+		}
+		lua_pop(L, 1);
+		luaL_unref(L, LUA_REGISTRYINDEX, levlistener->pending_ref);
+		levlistener->pending = 0;
+	}
+	return 0;
+}
+
+static int
+_listen_alive(lua_State* L) {
+	levlistener_t* levlistener = ( levlistener_t* )lua_touserdata(L, 1);
+	lua_pushboolean(L, levlistener->closed == 0);
+	return 1;
+}
+
+#define UNLINK_NONE		0
+#define UNLINK_ANY		1
+#define UNLINK_STALE	2
+
+union un_sockaddr {
+#ifdef _LINUX
+	struct sockaddr_un su;
+#endif
+	struct sockaddr_in si;
+	struct sockaddr_in6 si6;
+};
+
+#ifdef _LINUX
+//a path nobody listen on any more,left by a process that did not clean up
+static void
+unlink_stale(const char* file, struct sockaddr_un* su) {
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if ( fd < 0 ) {
+		return;
+	}
+	if ( connect(fd, (struct sockaddr*)su, sizeof( *su )) != 0 && errno == ECONNREFUSED ) {
+		unlink(file);
+	}
+	close(fd);
+}
+#endif
+
+//{ file = path } for a unix socket,"@name" in the abstract namespace,or { ip = v4 or v6,port = port }
+//remove:UNLINK_ANY clear whatever sit on the path,UNLINK_STALE only a dead socket so a live sibling keep it
 struct sockaddr*
 make_addr(lua_State* L, int index, union un_sockaddr* sa, int* len, int remove) {
 	luaL_checktype(L, index, LUA_TTABLE);
@@ -507,82 +2127,485 @@ make_addr(lua_State* L, int index, union un_sockaddr* sa, int* len, int remove)
 
 	if (!lua_isnil(L, -1)) {
 #ifdef _LINUX
-		sa->su.sun_family = AF_UNIX;  
-		const char* file = luaL_checkstring(L, -1);
-		strcpy(sa->su.sun_path, file);
-		if (remove) {
-			unlink(file);
+		size_t size;
+		const char* file = luaL_checklstring(L, -1, &size);
+		if ( size == 0 || size >= sizeof( sa->su.sun_path ) ) {
+			luaL_error(L, "bad unix socket path:%s", file);
+		}
+		memset(&sa->su, 0, sizeof( sa->su ));
+		sa->su.sun_family = AF_UNIX;
+		memcpy(sa->su.sun_path, file, size);
+		if ( file[0] == '@' ) {
+			//abstract names are not files,the length tell where the name end
+			sa->su.sun_path[0] = 0;
+			*len = (int)( offsetof(struct sockaddr_un, sun_path) + size );
+		}
+		else {
+			*len = sizeof( sa->su );
+			if ( remove == UNLINK_ANY ) {
+				unlink(file);
+			}
+			else if ( remove == UNLINK_STALE ) {
+				unlink_stale(file, &sa->su);
+			}
 		}
 		lua_pop(L, 1);
 
 		addr = (struct sockaddr*)&sa->su;
-		*len = sizeof(sa->su);
 #else
 		luaL_error(L, "no support unix socket");
 #endif
 	} else {
-		sa->si.sin_family = AF_INET;
-
 		lua_pop(L, 1);
 		lua_getfield(L, index, "ip");
 		const char* ip = luaL_checkstring(L, -1);
-		sa->si.sin_addr.s_addr = inet_addr(ip);
-		lua_pop(L, 1);
-
 		lua_getfield(L, index, "port");
 		int port = luaL_checkinteger(L, -1);
-		sa->si.sin_port = htons(port);
-		lua_pop(L, 1);
 
-		addr = (struct sockaddr*)&sa->si;
-		*len = sizeof( sa->si );
+		if ( evutil_inet_pton(AF_INET, ip, &sa->si.sin_addr) == 1 ) {
+			memset(sa->si.sin_zero, 0, sizeof( sa->si.sin_zero ));
+			sa->si.sin_family = AF_INET;
+			sa->si.sin_port = htons(port);
+			addr = (struct sockaddr*)&sa->si;
+			*len = sizeof( sa->si );
+		}
+		else {
+			memset(&sa->si6, 0, sizeof( sa->si6 ));
+			if ( evutil_inet_pton(AF_INET6, ip, &sa->si6.sin6_addr) != 1 ) {
+				luaL_error(L, "bad ip:%s", ip);
+			}
+			sa->si6.sin6_family = AF_INET6;
+			sa->si6.sin6_port = htons(port);
+			addr = (struct sockaddr*)&sa->si6;
+			*len = sizeof( sa->si6 );
+		}
+		lua_pop(L, 2);
 	}
 	return addr;
 }
 
+//unix sockets can not share a path through SO_REUSEPORT,the first listener own it and the rest fail to bind
+static int
+listen_flag(struct sockaddr* addr, int multi) {
+	int flag = LEV_OPT_REUSEABLE | LEV_OPT_CLOSE_ON_FREE | LEV_OPT_CLOSE_ON_EXEC;
+	if ( multi && ( addr->sa_family == AF_INET || addr->sa_family == AF_INET6 ) ) {
+		flag |= LEV_OPT_REUSEABLE_PORT;
+	}
+	return flag;
+}
+
+//listen options table:backlog,defer_accept(wake up only when data arrive),accept_batch
+static int
+listen_options(lua_State* L, int index, int* flag, int* backlog, int* batch) {
+	*backlog = SOMAXCONN;
+	*batch = 0;
+	if ( lua_type(L, index) != LUA_TTABLE ) {
+		return 0;
+	}
+	lua_getfield(L, index, "backlog");
+	*backlog = luaL_optinteger(L, -1, SOMAXCONN);
+	lua_pop(L, 1);
+
+	lua_getfield(L, index, "defer_accept");
+	if ( lua_toboolean(L, -1) ) {
+		*flag |= LEV_OPT_DEFERRED_ACCEPT;
+	}
+	lua_pop(L, 1);
+
+	lua_getfield(L, index, "accept_batch");
+	*batch = luaL_optinteger(L, -1, 0);
+	lua_pop(L, 1);
+	return 0;
+}
+
 static int
 _listen(lua_State* L) {
 	levent_t* levent = ( levent_t* )lua_touserdata(L, 1);
 
 	int multi = lua_toboolean(L, 2);
 
+	//listeners sharing a port must not take the path from under each other
 	union un_sockaddr addr_un;
 	int len;
-	struct sockaddr* addr = make_addr(L, 3, &addr_un, &len, 1);
+	struct sockaddr* addr = make_addr(L, 3, &addr_un, &len, multi ? UNLINK_STALE : UNLINK_ANY);
+
+	int flag = listen_flag(addr, multi);
+	int backlog, batch;
+	listen_options(L, 4, &flag, &backlog, &batch);
+	//evconnlistener keep its accept event private,the priority go to accepted buffers
+	int priority = option_priority(L, levent, 4);
 
 	levlistener_t* levlistener = lua_newuserdata(L, sizeof( *levlistener ));
+	memset(levlistener, 0, sizeof( *levlistener ));
 	levlistener->levent = levent;
 	levlistener->closed = 0;
+	levlistener->batch = batch;
+	levlistener->pending_ref = LUA_NOREF;
+	levlistener->priority = priority;
 
-	int flag = LEV_OPT_REUSEABLE | LEV_OPT_CLOSE_ON_FREE | LEV_OPT_CLOSE_ON_EXEC;
-	if ( multi ) {
-		flag |= LEV_OPT_REUSEABLE_PORT;
-	}
-
-	struct evconnlistener* listener = evconnlistener_new_bind(levent->ev_base, accept_socket, levlistener, flag, 16, addr, len);
+	struct evconnlistener* listener = evconnlistener_new_bind(levent->ev_base, accept_socket, levlistener, flag, backlog, addr, len);
 	if ( !listener ) {
 		lua_pushboolean(L, 0);
 		lua_pushstring(L, evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
-		return 0;
+		return 2;
 	}
 
 	levlistener->listener = listener;
+	levent->live_listeners++;
+	if ( batch > 0 ) {
+		levlistener->flush_ev = event_new(levent->ev_base, -1, 0, accept_flush_cb, levlistener);
+		if ( priority >= 0 ) {
+			event_priority_set(levlistener->flush_ev, priority);
+		}
+	}
 
 	levlistener->ref = _meta_init(L, META_LISTENER);
 
 	return 1;
 }
 
+typedef struct ludp {
+	levent_t* levent;
+	struct event* rio;
+	struct event* wio;
+	evutil_socket_t fd;
+	int ref;
+	int closed;
+	int packets;
+	size_t max_size;
+
+	char* recv_pool;
+	size_t recv_size[UDP_BATCH];
+	struct sockaddr_storage recv_addr[UDP_BATCH];
+
+	int send_count;
+	char* send_pool;
+	size_t send_size[UDP_BATCH];
+	struct sockaddr_storage send_addr[UDP_BATCH];
+	ev_socklen_t send_addrlen[UDP_BATCH];
+
+	struct ludp* next_lingering;
+} ludp_t;
+
+static int
+udp_addr(const char* ip, int port, struct sockaddr_storage* ss, ev_socklen_t* len) {
+	memset(ss, 0, sizeof( *ss ));
+	struct sockaddr_in* sin = ( struct sockaddr_in* )ss;
+	if ( evutil_inet_pton(AF_INET, ip, &sin->sin_addr) == 1 ) {
+		sin->sin_family = AF_INET;
+		sin->sin_port = htons(port);
+		*len = sizeof( *sin );
+		return 0;
+	}
+	struct sockaddr_in6* sin6 = ( struct sockaddr_in6* )ss;
+	if ( evutil_inet_pton(AF_INET6, ip, &sin6->sin6_addr) == 1 ) {
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = htons(port);
+		*len = sizeof( *sin6 );
+		return 0;
+	}
+	return -1;
+}
+
+//drain up to UDP_BATCH datagrams into the receive pool,one syscall on linux
+//datagrams larger than max_size arrive truncated,they are dropped instead of handed to lua
 static int
-_connect(lua_State* L) {
+udp_recv(ludp_t* ludp) {
+#ifdef _LINUX
+	struct mmsghdr msgs[UDP_BATCH];
+	struct iovec iovs[UDP_BATCH];
+	int i;
+	for ( i = 0; i < UDP_BATCH; i++ ) {
+		iovs[i].iov_base = ludp->recv_pool + i * ludp->max_size;
+		iovs[i].iov_len = ludp->max_size;
+		memset(&msgs[i].msg_hdr, 0, sizeof( msgs[i].msg_hdr ));
+		msgs[i].msg_hdr.msg_name = &ludp->recv_addr[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof( ludp->recv_addr[i] );
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	int count = recvmmsg(ludp->fd, msgs, UDP_BATCH, MSG_DONTWAIT, NULL);
+	if ( count < 0 ) {
+		return 0;
+	}
+	int kept = 0;
+	for ( i = 0; i < count; i++ ) {
+		if ( msgs[i].msg_hdr.msg_flags & MSG_TRUNC ) {
+			continue;
+		}
+		if ( kept != i ) {
+			memcpy(ludp->recv_pool + kept * ludp->max_size, iovs[i].iov_base, msgs[i].msg_len);
+			ludp->recv_addr[kept] = ludp->recv_addr[i];
+		}
+		ludp->recv_size[kept++] = msgs[i].msg_len;
+	}
+	return kept;
+#else
+	int count = 0;
+	while ( count < UDP_BATCH ) {
+		ev_socklen_t len = sizeof( ludp->recv_addr[count] );
+		int n = recvfrom(ludp->fd, ludp->recv_pool + count * ludp->max_size, (int)ludp->max_size, 0, ( struct sockaddr* )&ludp->recv_addr[count], &len);
+		if ( n < 0 ) {
+#ifdef _WIN32
+			if ( WSAGetLastError() == WSAEMSGSIZE ) {
+				continue;
+			}
+#endif
+			break;
+		}
+		ludp->recv_size[count] = n;
+		count++;
+	}
+	return count;
+#endif
+}
+
+//send queued datagrams,keep the unsent tail queued
+static void
+udp_flush(ludp_t* ludp) {
+	int sent = 0;
+#ifdef _LINUX
+	struct mmsghdr msgs[UDP_BATCH];
+	struct iovec iovs[UDP_BATCH];
+	int i;
+	for ( i = 0; i < ludp->send_count; i++ ) {
+		iovs[i].iov_base = ludp->send_pool + i * ludp->max_size;
+		iovs[i].iov_len = ludp->send_size[i];
+		memset(&msgs[i].msg_hdr, 0, sizeof( msgs[i].msg_hdr ));
+		msgs[i].msg_hdr.msg_name = &ludp->send_addr[i];
+		msgs[i].msg_hdr.msg_namelen = ludp->send_addrlen[i];
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	while ( sent < ludp->send_count ) {
+		int n = sendmmsg(ludp->fd, msgs + sent, ludp->send_count - sent, MSG_DONTWAIT);
+		if ( n <= 0 ) {
+			break;
+		}
+		sent += n;
+	}
+#else
+	while ( sent < ludp->send_count ) {
+		int n = sendto(ludp->fd, ludp->send_pool + sent * ludp->max_size, (int)ludp->send_size[sent], 0, ( struct sockaddr* )&ludp->send_addr[sent], ludp->send_addrlen[sent]);
+		if ( n < 0 ) {
+			break;
+		}
+		sent++;
+	}
+#endif
+	if ( sent > 0 && sent < ludp->send_count ) {
+		int left = ludp->send_count - sent;
+		memmove(ludp->send_pool, ludp->send_pool + sent * ludp->max_size, left * ludp->max_size);
+		memmove(ludp->send_size, ludp->send_size + sent, left * sizeof( size_t ));
+		memmove(ludp->send_addr, ludp->send_addr + sent, left * sizeof( struct sockaddr_storage ));
+		memmove(ludp->send_addrlen, ludp->send_addrlen + sent, left * sizeof( ev_socklen_t ));
+	}
+	ludp->send_count -= sent;
+}
+
+static void
+udp_destroy(ludp_t* ludp) {
+	lua_State* L = ludp->levent->L;
+	event_free(ludp->rio);
+	event_free(ludp->wio);
+	evutil_closesocket(ludp->fd);
+	free(ludp->recv_pool);
+	free(ludp->send_pool);
+	luaL_unref(L, LUA_REGISTRYINDEX, ludp->packets);
+	luaL_unref(L, LUA_REGISTRYINDEX, ludp->ref);
+}
+
+static void
+udp_writable(int fd, short event, void* ud) {
+	ludp_t* ludp = ud;
+	udp_flush(ludp);
+	if ( ludp->send_count > 0 ) {
+		event_add(ludp->wio, NULL);
+		return;
+	}
+	if ( ludp->closed ) {
+		ludp_t** link = &ludp->levent->udp_lingering;
+		while ( *link != ludp ) {
+			link = &( *link )->next_lingering;
+		}
+		*link = ludp->next_lingering;
+		udp_destroy(ludp);
+	}
+}
+
+static void
+udp_readable(int fd, short event, void* ud) {
+	ludp_t* ludp = ud;
+	levent_t* levent = ludp->levent;
+	lua_State* L = levent->L;
+
+	int count = udp_recv(ludp);
+	if ( count == 0 ) {
+		return;
+	}
+
+	batch_flush(levent);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, levent->callback);
+	lua_pushinteger(L, LUA_EV_UDP);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, ludp->ref);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, ludp->packets);
+	int i;
+	for ( i = 0; i < count; i++ ) {
+		lua_pushlstring(L, ludp->recv_pool + i * ludp->max_size, ludp->recv_size[i]);
+		lua_rawseti(L, -2, i * 3 + 1);
+		push_addr(L, ( struct sockaddr* )&ludp->recv_addr[i], sizeof( ludp->recv_addr[i] ), -1);
+		lua_rawseti(L, -3, i * 3 + 3);
+		lua_rawseti(L, -2, i * 3 + 2);
+	}
+	lua_pushinteger(L, count);
+	levent_pcall(levent, 4);
+}
+
+static ludp_t*
+get_udp(lua_State* L) {
+	ludp_t* ludp = ( ludp_t* )lua_touserdata(L, 1);
+	if ( ludp->closed ) {
+		luaL_error(L, "udp:0x%x already closed", ludp);
+	}
+	return ludp;
+}
+
+//queue a datagram,flushed with one sendmmsg when the socket is next writable
+static int
+_udp_send(lua_State* L) {
+	ludp_t* ludp = get_udp(L);
+	size_t size;
+	const char* data = luaL_checklstring(L, 2, &size);
+	const char* ip = luaL_checkstring(L, 3);
+	int port = luaL_checkinteger(L, 4);
+
+	struct sockaddr_storage ss;
+	ev_socklen_t len = 0;
+	if ( udp_addr(ip, port, &ss, &len) < 0 ) {
+		luaL_error(L, "invalid udp address:%s", ip);
+	}
+
+	if ( size > ludp->max_size ) {
+		int n = sendto(ludp->fd, data, (int)size, 0, ( struct sockaddr* )&ss, len);
+		lua_pushboolean(L, n == (int)size);
+		return 1;
+	}
+
+	if ( ludp->send_count == UDP_BATCH ) {
+		udp_flush(ludp);
+		if ( ludp->send_count == UDP_BATCH ) {
+			lua_pushboolean(L, 0);
+			return 1;
+		}
+	}
+
+	int index = ludp->send_count++;
+	memcpy(ludp->send_pool + index * ludp->max_size, data, size);
+	ludp->send_size[index] = size;
+	ludp->send_addr[index] = ss;
+	ludp->send_addrlen[index] = len;
+
+	if ( !event_pending(ludp->wio, EV_WRITE, NULL) ) {
+		event_add(ludp->wio, NULL);
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+//stop receiving and flush,datagrams the socket did not take yet keep it open until they drain
+//return how many are still queued,those left when the loop is released are dropped
+static int
+_udp_close(lua_State* L) {
+	ludp_t* ludp = get_udp(L);
+	ludp->closed = 1;
+	event_del(ludp->rio);
+	udp_flush(ludp);
+	if ( ludp->send_count == 0 ) {
+		udp_destroy(ludp);
+		lua_pushinteger(L, 0);
+		return 1;
+	}
+	if ( !event_pending(ludp->wio, EV_WRITE, NULL) ) {
+		event_add(ludp->wio, NULL);
+	}
+	ludp->next_lingering = ludp->levent->udp_lingering;
+	ludp->levent->udp_lingering = ludp;
+	lua_pushinteger(L, ludp->send_count);
+	return 1;
+}
+
+static int
+_udp_alive(lua_State* L) {
+	ludp_t* ludp = ( ludp_t* )lua_touserdata(L, 1);
+	lua_pushboolean(L, ludp->closed == 0);
+	return 1;
+}
+
+static int
+_udp(lua_State* L) {
 	levent_t* levent = ( levent_t* )lua_touserdata(L, 1);
-	int session = lua_tointeger(L, 2);
 
 	union un_sockaddr addr_un;
-	int len;
-	struct sockaddr* addr = make_addr(L, 3, &addr_un, &len, 0);
+	int len = 0;
+	struct sockaddr* addr = make_addr(L, 2, &addr_un, &len, UNLINK_NONE);
+	lua_Integer max_size = luaL_optinteger(L, 3, UDP_MAX_SIZE);
+	luaL_argcheck(L, max_size > 0 && max_size <= UDP_MAX_PAYLOAD, 3, "udp max size out of range");
+
+	char* recv_pool = malloc(max_size * UDP_BATCH);
+	char* send_pool = malloc(max_size * UDP_BATCH);
+	if ( !recv_pool || !send_pool ) {
+		free(recv_pool);
+		free(send_pool);
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, "udp pool out of memory");
+		return 2;
+	}
+
+	evutil_socket_t fd = socket(addr->sa_family, SOCK_DGRAM, 0);
+	if ( fd < 0 ) {
+		free(recv_pool);
+		free(send_pool);
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
+		return 2;
+	}
+	evutil_make_socket_nonblocking(fd);
+	evutil_make_socket_closeonexec(fd);
+	evutil_make_listen_socket_reuseable(fd);
+	if ( bind(fd, addr, len) < 0 ) {
+		int err = EVUTIL_SOCKET_ERROR();
+		evutil_closesocket(fd);
+		free(recv_pool);
+		free(send_pool);
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, evutil_socket_error_to_string(err));
+		return 2;
+	}
+
+	ludp_t* ludp = lua_newuserdata(L, sizeof( *ludp ));
+	memset(ludp, 0, sizeof( *ludp ));
+	ludp->levent = levent;
+	ludp->fd = fd;
+	ludp->max_size = max_size;
+	ludp->recv_pool = recv_pool;
+	ludp->send_pool = send_pool;
+	ludp->rio = event_new(levent->ev_base, fd, EV_READ | EV_PERSIST, udp_readable, ludp);
+	ludp->wio = event_new(levent->ev_base, fd, EV_WRITE, udp_writable, ludp);
+	event_add(ludp->rio, NULL);
+
+	lua_createtable(L, UDP_BATCH * 3, 0);
+	ludp->packets = luaL_ref(L, LUA_REGISTRYINDEX);
+
+	ludp->ref = _meta_init(L, META_UDP);
+	return 1;
+}
 
+//start a nonblocking connect,the result come back as LUA_EV_CONNECT with session
+//return NULL and leave the error string on the stack if it fail at once
+static levbuffer_t*
+connect_start(lua_State* L, levent_t* levent, int session, struct sockaddr* addr, int len) {
 	levbuffer_t* levbuffer = _bufferevent_create(L, levent, -1, BEV_OPT_CLOSE_ON_FREE);
+	lua_pop(L, 1);
 	levbuffer->levent = levent;
 	levbuffer->connect_session = session;
 
@@ -591,8 +2614,7 @@ _connect(lua_State* L) {
 	if ( !result ) {
 		evutil_socket_t fd = bufferevent_getfd(levbuffer->core);
 		evutil_make_socket_closeonexec(fd);
-		lua_pushboolean(L, 1);
-		return 1;
+		return levbuffer;
 	}
 
 	evutil_socket_t fd = bufferevent_getfd(levbuffer->core);
@@ -601,41 +2623,492 @@ _connect(lua_State* L) {
 	lua_pushstring(L, evutil_socket_error_to_string(err));
 	levbuffer->closed = 1;
 	_bufferevent_destroy(levbuffer);
-	lua_pushboolean(L, 0);
-	lua_pushvalue(L, -2);
-	return 2;
+	return NULL;
 }
 
 static int
-_bind(lua_State* L) {
+_connect(lua_State* L) {
 	levent_t* levent = ( levent_t* )lua_touserdata(L, 1);
-	evutil_socket_t fd = (evutil_socket_t)lua_tointeger(L, 2);
+	int session = lua_tointeger(L, 2);
 
-	levbuffer_t* levbuffer = _bufferevent_create(L, levent, fd, 0);
-	bufferevent_setcb(levbuffer->core, read_complete, NULL, event_happen, levbuffer);
-	bufferevent_enable(levbuffer->core, EV_READ);
-	return 1;
-}
+	union un_sockaddr addr_un;
+	int len;
+	struct sockaddr* addr = make_addr(L, 3, &addr_un, &len, UNLINK_NONE);
 
-static int
-_timer_cancel(lua_State* L) {
-	levtimer_t* levtimer = ( levtimer_t* )lua_touserdata(L, 1);
-	if ( levtimer->cancel == 1 ) {
-		luaL_error(L, "timer:0x%x already cancel", levtimer);
+	if ( connect_start(L, levent, session, addr, len) ) {
+		lua_pushboolean(L, 1);
+		return 1;
 	}
-	levent_t* levent = levtimer->levent;
-	evtimer_del(levtimer->ev);
-	levtimer->cancel = 1;
-	levtimer->next = levent->freelist;
-	levent->freelist = levtimer;
-	return 0;
+	lua_pushboolean(L, 0);
+	lua_pushvalue(L, -2);
+	return 2;
 }
 
-static int
-_timer_alive(lua_State* L) {
-	levtimer_t* levtimer = ( levtimer_t* )lua_touserdata(L, 1);
-	lua_pushboolean(L, levtimer->cancel == 0);
-	return 1;
+typedef struct lpool_waiter {
+	int session;
+	struct lpool_waiter* next;
+} lpool_waiter_t;
+
+typedef struct lpool_key {
+	struct lpool* pool;
+	union un_sockaddr addr;
+	int len;
+	int active;
+	int idle;
+	//idle connections stay in front,most recently returned first
+	levbuffer_t* head;
+	levbuffer_t* tail;
+	lpool_waiter_t* wait_head;
+	lpool_waiter_t* wait_tail;
+	struct lpool_key* next;
+} lpool_key_t;
+
+typedef struct lpool {
+	levent_t* levent;
+	int ref;
+	int closed;
+	int max_idle;
+	int max_active;
+	struct timeval idle_timeout;
+	struct event* kick;
+	lpool_key_t* keys;
+	uint64_t reuse;
+	uint64_t connect;
+	uint64_t wait;
+	uint64_t drop;
+} lpool_t;
+
+typedef struct lpool_fail {
+	levent_t* levent;
+	int session;
+} lpool_fail_t;
+
+static lpool_t*
+get_pool(lua_State* L, int index) {
+	lpool_t* lpool = ( lpool_t* )luaL_checkudata(L, index, META_POOL);
+	if ( lpool->closed ) {
+		luaL_error(L, "pool:0x%x already released", lpool);
+	}
+	return lpool;
+}
+
+static void
+pool_unlink(lpool_key_t* key, levbuffer_t* levbuffer) {
+	if ( levbuffer->pool_prev ) {
+		levbuffer->pool_prev->pool_next = levbuffer->pool_next;
+	}
+	else {
+		key->head = levbuffer->pool_next;
+	}
+	if ( levbuffer->pool_next ) {
+		levbuffer->pool_next->pool_prev = levbuffer->pool_prev;
+	}
+	else {
+		key->tail = levbuffer->pool_prev;
+	}
+	levbuffer->pool_prev = levbuffer->pool_next = NULL;
+	if ( levbuffer->pool_idle ) {
+		levbuffer->pool_idle = 0;
+		key->idle--;
+	}
+}
+
+static void
+pool_push_front(lpool_key_t* key, levbuffer_t* levbuffer) {
+	levbuffer->pool_prev = NULL;
+	levbuffer->pool_next = key->head;
+	if ( key->head ) {
+		key->head->pool_prev = levbuffer;
+	}
+	else {
+		key->tail = levbuffer;
+	}
+	key->head = levbuffer;
+}
+
+static void
+pool_push_back(lpool_key_t* key, levbuffer_t* levbuffer) {
+	levbuffer->pool_next = NULL;
+	levbuffer->pool_prev = key->tail;
+	if ( key->tail ) {
+		key->tail->pool_next = levbuffer;
+	}
+	else {
+		key->head = levbuffer;
+	}
+	key->tail = levbuffer;
+}
+
+static void
+pool_detach(levbuffer_t* levbuffer) {
+	lpool_key_t* key = levbuffer->pool_key;
+	pool_unlink(key, levbuffer);
+	key->active--;
+	levbuffer->pool_key = NULL;
+	if ( key->wait_head ) {
+		event_active(key->pool->kick, EV_TIMEOUT, 0);
+	}
+}
+
+static void
+pool_drop(levbuffer_t* levbuffer) {
+	levbuffer->pool_key->pool->drop++;
+	levbuffer->closed = 1;
+	_bufferevent_destroy(levbuffer);
+}
+
+//idle connection must stay silent,data or eof means it is no good any more
+static void
+pool_idle_read(struct bufferevent* core, void* ud) {
+	pool_drop(ud);
+}
+
+static void
+pool_idle_event(struct bufferevent* core, short events, void* ud) {
+	pool_drop(ud);
+}
+
+static int
+pool_alive(levbuffer_t* levbuffer) {
+	if ( evbuffer_get_length(bufferevent_get_input(levbuffer->core)) > 0 ) {
+		return 0;
+	}
+	evutil_socket_t fd = bufferevent_getfd(levbuffer->core);
+	char c;
+	int n = recv(fd, &c, 1, MSG_PEEK);
+	if ( n >= 0 ) {
+		return 0;
+	}
+#ifdef _WIN32
+	return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+	return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
+
+//pop the warmest idle connection which is still alive
+static levbuffer_t*
+pool_take(lpool_key_t* key) {
+	while ( key->head && key->head->pool_idle ) {
+		levbuffer_t* levbuffer = key->head;
+		if ( !pool_alive(levbuffer) ) {
+			pool_drop(levbuffer);
+			continue;
+		}
+		pool_unlink(key, levbuffer);
+		pool_push_back(key, levbuffer);
+		bufferevent_set_timeouts(levbuffer->core, NULL, NULL);
+		bufferevent_setcb(levbuffer->core, read_complete, write_drain, event_happen, levbuffer);
+		bufferevent_enable(levbuffer->core, EV_READ);
+		key->pool->reuse++;
+		return levbuffer;
+	}
+	return NULL;
+}
+
+static levbuffer_t*
+pool_dial(lua_State* L, lpool_key_t* key, int session) {
+	levbuffer_t* levbuffer = connect_start(L, key->pool->levent, session, ( struct sockaddr* )&key->addr, key->len);
+	if ( !levbuffer ) {
+		return NULL;
+	}
+	key->pool->connect++;
+	key->active++;
+	levbuffer->pool_key = key;
+	pool_push_back(key, levbuffer);
+	return levbuffer;
+}
+
+static void
+pool_fail(evutil_socket_t fd, short what, void* ud) {
+	lpool_fail_t* fail = ud;
+	levent_t* levent = fail->levent;
+
+	batch_flush(levent);
+	lua_rawgeti(levent->L, LUA_REGISTRYINDEX, levent->callback);
+	lua_pushinteger(levent->L, LUA_EV_CONNECT);
+	lua_pushinteger(levent->L, fail->session);
+	lua_pushboolean(levent->L, 0);
+	lua_pushstring(levent->L, "pool released");
+	levent_pcall(levent, 4);
+	free(fail);
+}
+
+//a slot freed or a connection came back,hand it to the oldest waiter
+static void
+pool_kick(evutil_socket_t fd, short what, void* ud) {
+	lpool_t* lpool = ud;
+	levent_t* levent = lpool->levent;
+	lua_State* L = levent->L;
+
+	batch_flush(levent);
+	lpool_key_t* key;
+	for ( key = lpool->keys; key; key = key->next ) {
+		while ( key->wait_head ) {
+			levbuffer_t* levbuffer = pool_take(key);
+			if ( !levbuffer && key->active >= lpool->max_active ) {
+				break;
+			}
+			lpool_waiter_t* waiter = key->wait_head;
+			key->wait_head = waiter->next;
+			if ( !key->wait_head ) {
+				key->wait_tail = NULL;
+			}
+			int session = waiter->session;
+			free(waiter);
+
+			if ( levbuffer ) {
+				lua_rawgeti(L, LUA_REGISTRYINDEX, levent->callback);
+				lua_pushinteger(L, LUA_EV_CONNECT);
+				lua_pushinteger(L, session);
+				lua_pushboolean(L, 1);
+				lua_rawgeti(L, LUA_REGISTRYINDEX, levbuffer->ref);
+				levent_pcall(levent, 4);
+			}
+			else if ( !pool_dial(L, key, session) ) {
+				lua_rawgeti(L, LUA_REGISTRYINDEX, levent->callback);
+				lua_pushinteger(L, LUA_EV_CONNECT);
+				lua_pushinteger(L, session);
+				lua_pushboolean(L, 0);
+				lua_rotate(L, -5, -1);
+				levent_pcall(levent, 4);
+			}
+		}
+	}
+}
+
+//pool:checkout(session,addr)
+//true,buffer for a warm connection,true alone means wait session,false,err on failure
+static int
+_pool_checkout(lua_State* L) {
+	lpool_t* lpool = get_pool(L, 1);
+	int session = luaL_checkinteger(L, 2);
+
+	union un_sockaddr addr_un;
+	memset(&addr_un, 0, sizeof( addr_un ));
+	int len = 0;
+	make_addr(L, 3, &addr_un, &len, UNLINK_NONE);
+
+	lpool_key_t* key;
+	for ( key = lpool->keys; key; key = key->next ) {
+		if ( key->len == len && memcmp(&key->addr, &addr_un, len) == 0 ) {
+			break;
+		}
+	}
+	if ( !key ) {
+		key = malloc(sizeof( *key ));
+		memset(key, 0, sizeof( *key ));
+		key->pool = lpool;
+		key->addr = addr_un;
+		key->len = len;
+		key->next = lpool->keys;
+		lpool->keys = key;
+	}
+
+	levbuffer_t* levbuffer = pool_take(key);
+	if ( levbuffer ) {
+		lua_pushboolean(L, 1);
+		lua_rawgeti(L, LUA_REGISTRYINDEX, levbuffer->ref);
+		return 2;
+	}
+
+	if ( key->active < lpool->max_active ) {
+		if ( !pool_dial(L, key, session) ) {
+			lua_pushboolean(L, 0);
+			lua_pushvalue(L, -2);
+			return 2;
+		}
+		lua_pushboolean(L, 1);
+		return 1;
+	}
+
+	lpool->wait++;
+	lpool_waiter_t* waiter = malloc(sizeof( *waiter ));
+	waiter->session = session;
+	waiter->next = NULL;
+	if ( key->wait_tail ) {
+		key->wait_tail->next = waiter;
+	}
+	else {
+		key->wait_head = waiter;
+	}
+	key->wait_tail = waiter;
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+//give a connection back,it is closed instead if it is dirty or the idle list is full
+static int
+_pool_checkin(lua_State* L) {
+	lpool_t* lpool = get_pool(L, 1);
+	levbuffer_t* levbuffer = ( levbuffer_t* )luaL_checkudata(L, 2, META_EVBUFFER);
+	if ( levbuffer->closed ) {
+		return 0;
+	}
+	lpool_key_t* key = levbuffer->pool_key;
+	if ( !key || key->pool != lpool ) {
+		luaL_error(L, "evbuff:0x%x not belong to pool:0x%x", levbuffer, lpool);
+	}
+	if ( levbuffer->pool_idle ) {
+		luaL_error(L, "evbuff:0x%x already in pool", levbuffer);
+	}
+
+	if ( key->idle >= lpool->max_idle || evbuffer_get_length(bufferevent_get_input(levbuffer->core)) > 0 ) {
+		pool_drop(levbuffer);
+		lua_pushboolean(L, 0);
+		return 1;
+	}
+
+	levbuffer->write_wait = 0;
+	pool_unlink(key, levbuffer);
+	pool_push_front(key, levbuffer);
+	levbuffer->pool_idle = 1;
+	key->idle++;
+
+	bufferevent_setcb(levbuffer->core, pool_idle_read, NULL, pool_idle_event, levbuffer);
+	if ( lpool->idle_timeout.tv_sec || lpool->idle_timeout.tv_usec ) {
+		bufferevent_set_timeouts(levbuffer->core, &lpool->idle_timeout, NULL);
+	}
+	bufferevent_enable(levbuffer->core, EV_READ);
+
+	if ( key->wait_head ) {
+		event_active(lpool->kick, EV_TIMEOUT, 0);
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int
+_pool_stats(lua_State* L) {
+	lpool_t* lpool = get_pool(L, 1);
+	int active = 0, idle = 0, waiting = 0;
+	lpool_key_t* key;
+	for ( key = lpool->keys; key; key = key->next ) {
+		active += key->active;
+		idle += key->idle;
+		lpool_waiter_t* waiter;
+		for ( waiter = key->wait_head; waiter; waiter = waiter->next ) {
+			waiting++;
+		}
+	}
+	lua_createtable(L, 0, 7);
+	lua_pushinteger(L, lpool->reuse);
+	lua_setfield(L, -2, "reuse");
+	lua_pushinteger(L, lpool->connect);
+	lua_setfield(L, -2, "connect");
+	lua_pushinteger(L, lpool->wait);
+	lua_setfield(L, -2, "wait");
+	lua_pushinteger(L, lpool->drop);
+	lua_setfield(L, -2, "drop");
+	lua_pushinteger(L, active);
+	lua_setfield(L, -2, "active");
+	lua_pushinteger(L, idle);
+	lua_setfield(L, -2, "idle");
+	lua_pushinteger(L, waiting);
+	lua_setfield(L, -2, "waiting");
+	return 1;
+}
+
+//idle connections are closed,checked out ones become plain connections,waiters fail
+static int
+_pool_release(lua_State* L) {
+	lpool_t* lpool = get_pool(L, 1);
+	levent_t* levent = lpool->levent;
+	lpool->closed = 1;
+
+	while ( lpool->keys ) {
+		lpool_key_t* key = lpool->keys;
+		lpool->keys = key->next;
+
+		while ( key->wait_head ) {
+			lpool_waiter_t* waiter = key->wait_head;
+			key->wait_head = waiter->next;
+			lpool_fail_t* fail = malloc(sizeof( *fail ));
+			fail->levent = levent;
+			fail->session = waiter->session;
+			event_base_once(levent->ev_base, -1, EV_TIMEOUT, pool_fail, fail, NULL);
+			free(waiter);
+		}
+		key->wait_tail = NULL;
+
+		while ( key->head ) {
+			levbuffer_t* levbuffer = key->head;
+			if ( levbuffer->pool_idle ) {
+				pool_drop(levbuffer);
+			}
+			else {
+				pool_unlink(key, levbuffer);
+				levbuffer->pool_key = NULL;
+			}
+		}
+		free(key);
+	}
+
+	event_free(lpool->kick);
+	luaL_unref(L, LUA_REGISTRYINDEX, lpool->ref);
+	return 0;
+}
+
+static int
+_pool_alive(lua_State* L) {
+	lpool_t* lpool = ( lpool_t* )lua_touserdata(L, 1);
+	lua_pushboolean(L, lpool->closed == 0);
+	return 1;
+}
+
+//ev:pool(max_idle,max_active,idle_timeout),connections keyed by address
+static int
+_pool(lua_State* L) {
+	levent_t* levent = ( levent_t* )lua_touserdata(L, 1);
+	int max_idle = luaL_optinteger(L, 2, 8);
+	int max_active = luaL_optinteger(L, 3, 64);
+	double idle_timeout = luaL_optnumber(L, 4, 60);
+	luaL_argcheck(L, max_idle >= 0, 2, "max_idle must not be negative");
+	luaL_argcheck(L, max_active > 0, 3, "max_active must be positive");
+
+	lpool_t* lpool = lua_newuserdata(L, sizeof( *lpool ));
+	memset(lpool, 0, sizeof( *lpool ));
+	lpool->levent = levent;
+	lpool->max_idle = max_idle;
+	lpool->max_active = max_active;
+	lpool->idle_timeout.tv_sec = (long)idle_timeout;
+	lpool->idle_timeout.tv_usec = (long)( ( idle_timeout - (long)idle_timeout ) * 1000000 );
+	lpool->kick = event_new(levent->ev_base, -1, 0, pool_kick, lpool);
+	lpool->ref = _meta_init(L, META_POOL);
+	return 1;
+}
+
+static int
+_bind(lua_State* L) {
+	levent_t* levent = ( levent_t* )lua_touserdata(L, 1);
+	evutil_socket_t fd = (evutil_socket_t)lua_tointeger(L, 2);
+
+	levbuffer_t* levbuffer = _bufferevent_create(L, levent, fd, 0);
+	bufferevent_setcb(levbuffer->core, read_complete, write_drain, event_happen, levbuffer);
+	bufferevent_enable(levbuffer->core, EV_READ);
+	return 1;
+}
+
+static int
+_timer_cancel(lua_State* L) {
+	levtimer_t* levtimer = ( levtimer_t* )lua_touserdata(L, 1);
+	if ( levtimer->cancel == 1 ) {
+		luaL_error(L, "timer:0x%x already cancel", levtimer);
+	}
+	levent_t* levent = levtimer->levent;
+	evtimer_del(levtimer->ev);
+	levtimer->cancel = 1;
+	levent->live_timers--;
+	levtimer->next = levent->freelist;
+	levent->freelist = levtimer;
+	return 0;
+}
+
+static int
+_timer_alive(lua_State* L) {
+	levtimer_t* levtimer = ( levtimer_t* )lua_touserdata(L, 1);
+	lua_pushboolean(L, levtimer->cancel == 0);
+	return 1;
 }
 
 static int
@@ -645,6 +3118,7 @@ _timer(lua_State* L) {
 
 	double ti = luaL_checknumber(L, 2);
 	int once = lua_toboolean(L, 3);
+	int priority = check_priority(L, levent, 4);
 
 	struct timeval tv;
 	tv.tv_sec = 0;
@@ -663,107 +3137,1998 @@ _timer(lua_State* L) {
 	if ( levent->freelist ) {
 		levtimer = levent->freelist;
 		levent->freelist = levent->freelist->next;
+		levtimer->serial++;
 		event_assign(levtimer->ev, ev_base, -1, flag, timeout, levtimer);
 		lua_rawgeti(L, LUA_REGISTRYINDEX, levtimer->ref);
 	}
 	else {
 		levtimer = lua_newuserdata(L, sizeof( *levtimer ));
 		levtimer->levent = levent;
+		levtimer->serial = 0;
 		levtimer->ref = _meta_init(L, META_TIMER);
 		levtimer->ev = event_new(ev_base, -1, flag, timeout, levtimer);
 	}
 
-	levtimer->cancel = 0;
+	//event_assign reset the priority of a recycled timer
+	if ( priority >= 0 ) {
+		event_priority_set(levtimer->ev, priority);
+	}
+	levtimer->cancel = 0;
+	levent->live_timers++;
+
+	evtimer_add(levtimer->ev, &tv);
+
+	return 1;
+}
+
+static uint64_t
+wheel_now(lwheel_t* lwheel) {
+	struct timeval tv;
+	event_base_gettimeofday_cached(lwheel->levent->ev_base, &tv);
+	return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static void
+wheel_link(lwheel_t* lwheel, int* list, int index) {
+	lwheel_node_t* node = &lwheel->nodes[index];
+	node->list = list;
+	node->prev = -1;
+	node->next = *list;
+	if ( *list >= 0 ) {
+		lwheel->nodes[*list].prev = index;
+	}
+	*list = index;
+}
+
+static void
+wheel_unlink(lwheel_t* lwheel, int index) {
+	lwheel_node_t* node = &lwheel->nodes[index];
+	if ( node->prev >= 0 ) {
+		lwheel->nodes[node->prev].next = node->next;
+	}
+	else {
+		*node->list = node->next;
+	}
+	if ( node->next >= 0 ) {
+		lwheel->nodes[node->next].prev = node->prev;
+	}
+	node->list = NULL;
+}
+
+static void
+wheel_place(lwheel_t* lwheel, int index) {
+	uint32_t expire = lwheel->nodes[index].expire;
+	uint32_t current = lwheel->time;
+
+	if ( ( expire | WHEEL_NEAR_MASK ) == ( current | WHEEL_NEAR_MASK ) ) {
+		wheel_link(lwheel, &lwheel->near[expire & WHEEL_NEAR_MASK], index);
+		return;
+	}
+
+	uint32_t mask = WHEEL_NEAR << WHEEL_LEVEL_SHIFT;
+	int i;
+	for ( i = 0; i < 3; i++ ) {
+		if ( ( expire | ( mask - 1 ) ) == ( current | ( mask - 1 ) ) ) {
+			break;
+		}
+		mask <<= WHEEL_LEVEL_SHIFT;
+	}
+	int slot = ( expire >> ( WHEEL_NEAR_SHIFT + i * WHEEL_LEVEL_SHIFT ) ) & WHEEL_LEVEL_MASK;
+	wheel_link(lwheel, &lwheel->level[i][slot], index);
+}
+
+static void
+wheel_cascade(lwheel_t* lwheel, int level, int slot) {
+	int index = lwheel->level[level][slot];
+	lwheel->level[level][slot] = -1;
+	while ( index >= 0 ) {
+		int next = lwheel->nodes[index].next;
+		wheel_place(lwheel, index);
+		index = next;
+	}
+}
+
+static void
+wheel_shift(lwheel_t* lwheel) {
+	uint32_t ct = ++lwheel->time;
+	if ( ct == 0 ) {
+		wheel_cascade(lwheel, 3, 0);
+		return;
+	}
+
+	uint32_t mask = WHEEL_NEAR;
+	uint32_t time = ct >> WHEEL_NEAR_SHIFT;
+	int i = 0;
+	while ( ( ct & ( mask - 1 ) ) == 0 ) {
+		int slot = time & WHEEL_LEVEL_MASK;
+		if ( slot != 0 ) {
+			wheel_cascade(lwheel, i, slot);
+			break;
+		}
+		mask <<= WHEEL_LEVEL_SHIFT;
+		time >>= WHEEL_LEVEL_SHIFT;
+		i++;
+	}
+}
+
+//move due sessions into the expired table at stack top
+static int
+wheel_expire(lwheel_t* lwheel, lua_State* L, int count) {
+	int* list = &lwheel->near[lwheel->time & WHEEL_NEAR_MASK];
+	while ( *list >= 0 ) {
+		int index = *list;
+		lwheel_node_t* node = &lwheel->nodes[index];
+		wheel_unlink(lwheel, index);
+
+		lua_pushinteger(L, node->session);
+		lua_rawseti(L, -2, ++count);
+
+		node->serial++;
+		node->next = lwheel->freelist;
+		lwheel->freelist = index;
+		lwheel->count--;
+	}
+	return count;
+}
+
+static void
+wheel_tick(int fd, short event, void* ud) {
+	lwheel_t* lwheel = ud;
+	levent_t* levent = lwheel->levent;
+	lua_State* L = levent->L;
+
+	uint64_t now = wheel_now(lwheel);
+	if ( now < lwheel->last ) {
+		lwheel->last = now;
+	}
+	uint64_t ticks = ( now - lwheel->last ) / lwheel->resolution;
+	lwheel->last += ticks * lwheel->resolution;
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, lwheel->expired);
+	int count = wheel_expire(lwheel, L, 0);
+	while ( ticks-- > 0 && lwheel->count > 0 ) {
+		wheel_shift(lwheel);
+		count = wheel_expire(lwheel, L, count);
+	}
+
+	if ( lwheel->count == 0 ) {
+		event_del(lwheel->ev);
+	}
+
+	if ( count == 0 ) {
+		lua_pop(L, 1);
+		return;
+	}
+
+	batch_flush(levent);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, levent->callback);
+	lua_pushinteger(L, LUA_EV_EXPIRE);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, lwheel->ref);
+	lua_pushvalue(L, -4);
+	lua_pushinteger(L, count);
+	levent_pcall(levent, 4);
+	lua_pop(L, 1);
+}
+
+static lwheel_t*
+get_wheel(lua_State* L) {
+	lwheel_t* lwheel = ( lwheel_t* )lua_touserdata(L, 1);
+	if ( lwheel->closed ) {
+		luaL_error(L, "wheel:0x%x already released", lwheel);
+	}
+	return lwheel;
+}
+
+//schedule session after ti seconds,return a handle for cancel
+static int
+_wheel_add(lua_State* L) {
+	lwheel_t* lwheel = get_wheel(L);
+	double ti = luaL_checknumber(L, 2);
+	lua_Integer session = luaL_checkinteger(L, 3);
+
+	if ( lwheel->freelist < 0 ) {
+		int size = lwheel->size * 2;
+		lwheel->nodes = realloc(lwheel->nodes, sizeof( lwheel_node_t ) * size);
+		int i;
+		for ( i = lwheel->size; i < size; i++ ) {
+			lwheel->nodes[i].serial = 0;
+			lwheel->nodes[i].list = NULL;
+			lwheel->nodes[i].next = i + 1 < size ? i + 1 : -1;
+		}
+		lwheel->freelist = lwheel->size;
+		lwheel->size = size;
+	}
+
+	if ( !event_pending(lwheel->ev, EV_TIMEOUT, NULL) ) {
+		struct timeval tv;
+		tv.tv_sec = lwheel->resolution / 1000;
+		tv.tv_usec = ( lwheel->resolution % 1000 ) * 1000;
+		lwheel->last = wheel_now(lwheel);
+		event_add(lwheel->ev, &tv);
+	}
+
+	double ticks = ti * 1000 / lwheel->resolution;
+	if ( ticks < 1 ) {
+		ticks = 1;
+	}
+	else if ( ticks > 0xffffffff ) {
+		ticks = 0xffffffff;
+	}
+
+	int index = lwheel->freelist;
+	lwheel_node_t* node = &lwheel->nodes[index];
+	lwheel->freelist = node->next;
+	node->expire = lwheel->time + (uint32_t)ticks;
+	node->session = session;
+	wheel_place(lwheel, index);
+	lwheel->count++;
+
+	lua_pushinteger(L, ( (lua_Integer)node->serial << 32 ) | index);
+	return 1;
+}
+
+//return the session of a pending handle,nothing if expired or cancelled
+static int
+_wheel_cancel(lua_State* L) {
+	lwheel_t* lwheel = get_wheel(L);
+	lua_Integer handle = luaL_checkinteger(L, 2);
+	int index = (int)( handle & 0xffffffff );
+	uint32_t serial = (uint32_t)( handle >> 32 );
+
+	if ( index < 0 || index >= lwheel->size ) {
+		return 0;
+	}
+	lwheel_node_t* node = &lwheel->nodes[index];
+	if ( node->serial != serial || node->list == NULL ) {
+		return 0;
+	}
+	wheel_unlink(lwheel, index);
+	node->serial++;
+	node->next = lwheel->freelist;
+	lwheel->freelist = index;
+	lwheel->count--;
+
+	lua_pushinteger(L, node->session);
+	return 1;
+}
+
+static int
+_wheel_size(lua_State* L) {
+	lwheel_t* lwheel = get_wheel(L);
+	lua_pushinteger(L, lwheel->count);
+	return 1;
+}
+
+static int
+_wheel_release(lua_State* L) {
+	lwheel_t* lwheel = get_wheel(L);
+	lwheel->closed = 1;
+	event_free(lwheel->ev);
+	free(lwheel->nodes);
+	luaL_unref(L, LUA_REGISTRYINDEX, lwheel->expired);
+	luaL_unref(L, LUA_REGISTRYINDEX, lwheel->ref);
+	return 0;
+}
+
+static int
+_wheel_alive(lua_State* L) {
+	lwheel_t* lwheel = ( lwheel_t* )lua_touserdata(L, 1);
+	lua_pushboolean(L, lwheel->closed == 0);
+	return 1;
+}
+
+static int
+_wheel(lua_State* L) {
+	levent_t* levent = ( levent_t* )lua_touserdata(L, 1);
+	double resolution = luaL_optnumber(L, 2, 0.01);
+
+	lwheel_t* lwheel = lua_newuserdata(L, sizeof( *lwheel ));
+	memset(lwheel, 0, sizeof( *lwheel ));
+	lwheel->levent = levent;
+	lwheel->resolution = (int)( resolution * 1000 );
+	if ( lwheel->resolution <= 0 ) {
+		lwheel->resolution = 1;
+	}
+
+	int i, j;
+	for ( i = 0; i < WHEEL_NEAR; i++ ) {
+		lwheel->near[i] = -1;
+	}
+	for ( i = 0; i < 4; i++ ) {
+		for ( j = 0; j < WHEEL_LEVEL; j++ ) {
+			lwheel->level[i][j] = -1;
+		}
+	}
+
+	lwheel->size = 64;
+	lwheel->nodes = malloc(sizeof( lwheel_node_t ) * lwheel->size);
+	for ( i = 0; i < lwheel->size; i++ ) {
+		lwheel->nodes[i].serial = 0;
+		lwheel->nodes[i].list = NULL;
+		lwheel->nodes[i].next = i + 1 < lwheel->size ? i + 1 : -1;
+	}
+	lwheel->freelist = 0;
+
+	lwheel->ev = event_new(levent->ev_base, -1, EV_PERSIST, wheel_tick, lwheel);
+
+	lua_newtable(L);
+	lwheel->expired = luaL_ref(L, LUA_REGISTRYINDEX);
+
+	lwheel->ref = _meta_init(L, META_WHEEL);
+	return 1;
+}
+
+static uint64_t
+dns_now(ldns_cache_t* cache) {
+	struct timeval tv;
+	event_base_gettimeofday_cached(cache->levent->ev_base, &tv);
+	return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static uint32_t
+dns_hash(const char* host) {
+	uint32_t h = 5381;
+	while ( *host ) {
+		h = ( h << 5 ) + h + (unsigned char)*host++;
+	}
+	return h;
+}
+
+static void
+dns_lru_unlink(ldns_cache_t* cache, ldns_entry_t* entry) {
+	if ( entry->prev ) {
+		entry->prev->next = entry->next;
+	}
+	else {
+		cache->head = entry->next;
+	}
+	if ( entry->next ) {
+		entry->next->prev = entry->prev;
+	}
+	else {
+		cache->tail = entry->prev;
+	}
+	entry->prev = entry->next = NULL;
+}
+
+static void
+dns_lru_touch(ldns_cache_t* cache, ldns_entry_t* entry) {
+	if ( cache->head == entry ) {
+		return;
+	}
+	if ( entry->prev || entry->next || cache->tail == entry ) {
+		dns_lru_unlink(cache, entry);
+	}
+	entry->next = cache->head;
+	if ( cache->head ) {
+		cache->head->prev = entry;
+	}
+	cache->head = entry;
+	if ( !cache->tail ) {
+		cache->tail = entry;
+	}
+}
+
+static void
+dns_entry_free(ldns_cache_t* cache, ldns_entry_t* entry) {
+	ldns_entry_t** link = &cache->slots[entry->hash & ( cache->nslot - 1 )];
+	while ( *link != entry ) {
+		link = &( *link )->hnext;
+	}
+	*link = entry->hnext;
+	dns_lru_unlink(cache, entry);
+	cache->count--;
+	free(entry->addrs);
+	free(entry->host);
+	free(entry);
+}
+
+//evict least recently used answers,in flight lookups stay
+static void
+dns_evict(ldns_cache_t* cache) {
+	ldns_entry_t* entry = cache->tail;
+	while ( entry && cache->count >= cache->max ) {
+		ldns_entry_t* prev = entry->prev;
+		if ( entry->state != DNS_PENDING ) {
+			dns_entry_free(cache, entry);
+			cache->evicted++;
+		}
+		entry = prev;
+	}
+}
+
+static void
+dns_push_result(lua_State* L, ldns_entry_t* entry) {
+	if ( entry->state == DNS_OK ) {
+		lua_createtable(L, entry->naddr, 0);
+		int i;
+		for ( i = 0; i < entry->naddr; i++ ) {
+			lua_pushstring(L, entry->addrs[i]);
+			lua_rawseti(L, -2, i + 1);
+		}
+	}
+	else {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, entry->error);
+	}
+}
+
+static void
+dns_settle(ldns_entry_t* entry, int ttl) {
+	ldns_cache_t* cache = entry->cache;
+	levent_t* levent = cache->levent;
+	lua_State* L = levent->L;
+
+	if ( ttl > cache->max_ttl ) {
+		ttl = cache->max_ttl;
+	}
+	entry->expire = dns_now(cache) + (uint64_t)ttl * 1000;
+
+	//waiters are pushed on the head,restore call order
+	levdns_t* waiters = NULL;
+	while ( entry->waiters ) {
+		levdns_t* next = entry->waiters->next;
+		entry->waiters->next = waiters;
+		waiters = entry->waiters;
+		entry->waiters = next;
+	}
+	if ( !waiters ) {
+		return;
+	}
+
+	//a callback may reset the cache,evict or restart this entry,answer every waiter from a copy
+	ldns_entry_t result = *entry;
+	result.addrs = NULL;
+	if ( entry->naddr > 0 ) {
+		result.addrs = malloc(sizeof( *entry->addrs ) * entry->naddr);
+		memcpy(result.addrs, entry->addrs, sizeof( *entry->addrs ) * entry->naddr);
+	}
+
+	batch_flush(levent);
+	while ( waiters ) {
+		levdns_t* levdns = waiters;
+		waiters = waiters->next;
+
+		lua_rawgeti(L, LUA_REGISTRYINDEX, levent->callback);
+		lua_pushinteger(L, LUA_EV_DNS);
+		lua_rawgeti(L, LUA_REGISTRYINDEX, levdns->ref);
+		dns_push_result(L, &result);
+		levent_pcall(levent, result.state == DNS_OK ? 3 : 4);
+		luaL_unref(L, LUA_REGISTRYINDEX, levdns->ref);
+	}
+	free(result.addrs);
+}
+
+static void
+dns_cache_addrinfo(int err, struct evutil_addrinfo *ai, void* ud) {
+	ldns_entry_t* entry = ud;
+	ldns_cache_t* cache = entry->cache;
+	if ( err ) {
+		entry->state = DNS_FAIL;
+		entry->error = evutil_gai_strerror(err);
+		dns_settle(entry, cache->neg_ttl);
+		return;
+	}
+
+	struct evutil_addrinfo* it;
+	int count = 0;
+	for ( it = ai; it; it = it->ai_next ) {
+		count++;
+	}
+	entry->addrs = realloc(entry->addrs, sizeof( *entry->addrs ) * count);
+	entry->naddr = 0;
+	for ( it = ai; it; it = it->ai_next ) {
+		if ( it->ai_family == PF_INET ) {
+			struct sockaddr_in *sin = ( struct sockaddr_in* )it->ai_addr;
+			evutil_inet_ntop(AF_INET, &sin->sin_addr, entry->addrs[entry->naddr++], INET6_ADDRSTRLEN);
+		}
+		else if ( it->ai_family == PF_INET6 ) {
+			struct sockaddr_in6 *sin6 = ( struct sockaddr_in6* )it->ai_addr;
+			evutil_inet_ntop(AF_INET6, &sin6->sin6_addr, entry->addrs[entry->naddr++], INET6_ADDRSTRLEN);
+		}
+	}
+	evutil_freeaddrinfo(ai);
+	entry->state = DNS_OK;
+	dns_settle(entry, cache->def_ttl);
+}
+
+static void
+dns_cache_fallback(ldns_entry_t* entry) {
+	struct evutil_addrinfo hints;
+	memset(&hints, 0, sizeof( hints ));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+	evdns_getaddrinfo(entry->cache->levent->dns_base, entry->host, NULL, &hints, dns_cache_addrinfo, entry);
+}
+
+//both queries are back,no address from either go through getaddrinfo(hosts file,cname only)
+static void
+dns_cache_answer(ldns_entry_t* entry) {
+	if ( entry->naddr > 0 ) {
+		entry->state = DNS_OK;
+		dns_settle(entry, entry->ttl);
+		return;
+	}
+	if ( entry->shutdown ) {
+		entry->state = DNS_FAIL;
+		entry->error = evdns_err_to_string(DNS_ERR_SHUTDOWN);
+		dns_settle(entry, 0);
+		return;
+	}
+	dns_cache_fallback(entry);
+}
+
+//A and AAAA answers carry the ttl,they are merged ipv4 first and keep the smaller one
+static void
+dns_cache_resolved(int result, char type, int count, int ttl, void* addresses, void* ud) {
+	ldns_entry_t* entry = ud;
+	if ( result == DNS_ERR_SHUTDOWN ) {
+		entry->shutdown = 1;
+	}
+	else if ( result == DNS_ERR_NONE && count > 0 && ( type == DNS_IPv4_A || type == DNS_IPv6_AAAA ) ) {
+		entry->addrs = realloc(entry->addrs, sizeof( *entry->addrs ) * ( entry->naddr + count ));
+		int i;
+		if ( type == DNS_IPv4_A ) {
+			memmove(entry->addrs + count, entry->addrs, sizeof( *entry->addrs ) * entry->naddr);
+			for ( i = 0; i < count; i++ ) {
+				evutil_inet_ntop(AF_INET, (uint32_t*)addresses + i, entry->addrs[i], INET6_ADDRSTRLEN);
+			}
+		}
+		else {
+			for ( i = 0; i < count; i++ ) {
+				evutil_inet_ntop(AF_INET6, (struct in6_addr*)addresses + i, entry->addrs[entry->naddr + i], INET6_ADDRSTRLEN);
+			}
+		}
+		entry->naddr += count;
+		if ( ttl < entry->ttl ) {
+			entry->ttl = ttl;
+		}
+	}
+	if ( --entry->pending > 0 ) {
+		return;
+	}
+	dns_cache_answer(entry);
+}
+
+static void
+dns_cache_free(ldns_cache_t* cache) {
+	while ( cache->head ) {
+		dns_entry_free(cache, cache->head);
+	}
+	free(cache->slots);
+	free(cache);
+}
+
+//ev:dns_cache(max,neg_ttl,max_ttl),max <= 0 turn it off
+static int
+_dns_cache(lua_State* L) {
+	levent_t* levent = ( levent_t* )lua_touserdata(L, 1);
+	int max = luaL_optinteger(L, 2, 1024);
+	int neg_ttl = luaL_optinteger(L, 3, 5);
+	int max_ttl = luaL_optinteger(L, 4, 3600);
+
+	if ( levent->dns_cache ) {
+		ldns_cache_t* cache = levent->dns_cache;
+		ldns_entry_t* entry;
+		for ( entry = cache->head; entry; entry = entry->next ) {
+			if ( entry->state == DNS_PENDING ) {
+				luaL_error(L, "dns cache has lookup in flight");
+			}
+		}
+		dns_cache_free(cache);
+		levent->dns_cache = NULL;
+	}
+	if ( max <= 0 ) {
+		return 0;
+	}
+
+	ldns_cache_t* cache = malloc(sizeof( *cache ));
+	memset(cache, 0, sizeof( *cache ));
+	cache->levent = levent;
+	cache->max = max;
+	cache->neg_ttl = neg_ttl;
+	cache->max_ttl = max_ttl;
+	cache->def_ttl = max_ttl < 60 ? max_ttl : 60;
+	cache->nslot = 16;
+	while ( cache->nslot < max ) {
+		cache->nslot *= 2;
+	}
+	cache->slots = malloc(sizeof( ldns_entry_t* ) * cache->nslot);
+	memset(cache->slots, 0, sizeof( ldns_entry_t* ) * cache->nslot);
+	levent->dns_cache = cache;
+	return 0;
+}
+
+static int
+_dns_stats(lua_State* L) {
+	levent_t* levent = ( levent_t* )lua_touserdata(L, 1);
+	ldns_cache_t* cache = levent->dns_cache;
+	if ( !cache ) {
+		return 0;
+	}
+	lua_createtable(L, 0, 5);
+	lua_pushinteger(L, cache->hit);
+	lua_setfield(L, -2, "hit");
+	lua_pushinteger(L, cache->miss);
+	lua_setfield(L, -2, "miss");
+	lua_pushinteger(L, cache->coalesced);
+	lua_setfield(L, -2, "coalesced");
+	lua_pushinteger(L, cache->evicted);
+	lua_setfield(L, -2, "evicted");
+	lua_pushinteger(L, cache->count);
+	lua_setfield(L, -2, "size");
+	return 1;
+}
+
+//cached answer return true,addrs or false,err at once,otherwise a levdns to wait on
+static int
+_dns_cached(lua_State* L, levent_t* levent, const char* host) {
+	ldns_cache_t* cache = levent->dns_cache;
+
+	struct in6_addr numeric;
+	if ( evutil_inet_pton(AF_INET, host, &numeric) == 1 || evutil_inet_pton(AF_INET6, host, &numeric) == 1 ) {
+		lua_pushboolean(L, 1);
+		lua_createtable(L, 1, 0);
+		lua_pushstring(L, host);
+		lua_rawseti(L, -2, 1);
+		return 2;
+	}
+
+	uint32_t hash = dns_hash(host);
+	ldns_entry_t* entry = cache->slots[hash & ( cache->nslot - 1 )];
+	while ( entry && ( entry->hash != hash || strcmp(entry->host, host) != 0 ) ) {
+		entry = entry->hnext;
+	}
+
+	if ( entry && entry->state != DNS_PENDING && entry->expire > dns_now(cache) ) {
+		cache->hit++;
+		dns_lru_touch(cache, entry);
+		lua_pushboolean(L, entry->state == DNS_OK);
+		if ( entry->state == DNS_OK ) {
+			dns_push_result(L, entry);
+		}
+		else {
+			lua_pushstring(L, entry->error);
+		}
+		return 2;
+	}
+
+	if ( entry && entry->state == DNS_PENDING ) {
+		cache->coalesced++;
+	}
+	else {
+		cache->miss++;
+		if ( !entry ) {
+			dns_evict(cache);
+			size_t size = strlen(host);
+			entry = malloc(sizeof( *entry ));
+			memset(entry, 0, sizeof( *entry ));
+			entry->cache = cache;
+			entry->hash = hash;
+			entry->host = malloc(size + 1);
+			memcpy(entry->host, host, size + 1);
+			ldns_entry_t** slot = &cache->slots[hash & ( cache->nslot - 1 )];
+			entry->hnext = *slot;
+			*slot = entry;
+			cache->count++;
+		}
+		dns_lru_touch(cache, entry);
+		entry->state = DNS_PENDING;
+		entry->naddr = 0;
+		entry->ttl = cache->max_ttl;
+		entry->shutdown = 0;
+
+		//single label names(localhost) usually live in the hosts file,which only getaddrinfo consult
+		if ( !strchr(host, '.') ) {
+			dns_cache_fallback(entry);
+		}
+		else {
+			entry->pending = 2;
+			if ( !evdns_base_resolve_ipv4(levent->dns_base, host, 0, dns_cache_resolved, entry) ) {
+				entry->pending--;
+			}
+			if ( !evdns_base_resolve_ipv6(levent->dns_base, host, 0, dns_cache_resolved, entry) ) {
+				entry->pending--;
+			}
+			if ( entry->pending == 0 ) {
+				dns_cache_answer(entry);
+			}
+		}
+		//answered synchronously(hosts file or immediate error)
+		if ( entry->state != DNS_PENDING ) {
+			lua_pushboolean(L, entry->state == DNS_OK);
+			if ( entry->state == DNS_OK ) {
+				dns_push_result(L, entry);
+			}
+			else {
+				lua_pushstring(L, entry->error);
+			}
+			return 2;
+		}
+	}
+
+	levdns_t* levdns = lua_newuserdata(L, sizeof( *levdns ));
+	levdns->levent = levent;
+	levdns->req = NULL;
+	lua_pushvalue(L, -1);
+	levdns->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	levdns->next = entry->waiters;
+	entry->waiters = levdns;
+	return 1;
+}
+
+static int
+_dns(lua_State* L) {
+	levent_t* levent = ( levent_t* )lua_touserdata(L, 1);
+	const char* host = lua_tostring(L, 2);
+
+	if ( levent->dns_cache ) {
+		return _dns_cached(L, levent, luaL_checkstring(L, 2));
+	}
+
+	struct evutil_addrinfo hints;
+	memset(&hints, 0, sizeof( hints ));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_flags = EVUTIL_AI_CANONNAME;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+
+	levdns_t* levdns = lua_newuserdata(L, sizeof( *levdns ));
+	levdns->levent = levent;
+
+	lua_pushvalue(L, -1);
+	levdns->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+	levdns->req = evdns_getaddrinfo(levent->dns_base, host, NULL, &hints, dns_response, levdns);
+
+	if ( !levdns->req ) {
+		lua_pushboolean(L, 0);
+	}
+	
+	return 1;
+}
+
+static int
+_rate_group_set(lua_State* L) {
+	lrate_group_t* lgroup = get_rate_group(L, 1);
+	struct ev_token_bucket_cfg* cfg = bucket_cfg_new(L, 2);
+	bufferevent_rate_limit_group_set_cfg(lgroup->group, cfg);
+	ev_token_bucket_cfg_free(cfg);
+	return 0;
+}
+
+static int
+_rate_group_min_share(lua_State* L) {
+	lrate_group_t* lgroup = get_rate_group(L, 1);
+	bufferevent_rate_limit_group_set_min_share(lgroup->group, luaL_checkinteger(L, 2));
+	return 0;
+}
+
+static int
+_rate_group_totals(lua_State* L) {
+	lrate_group_t* lgroup = get_rate_group(L, 1);
+	ev_uint64_t total_read, total_written;
+	bufferevent_rate_limit_group_get_totals(lgroup->group, &total_read, &total_written);
+	lua_pushinteger(L, total_read);
+	lua_pushinteger(L, total_written);
+	lua_pushinteger(L, lgroup->members);
+	return 3;
+}
+
+static int
+_rate_group_reset(lua_State* L) {
+	lrate_group_t* lgroup = get_rate_group(L, 1);
+	bufferevent_rate_limit_group_reset_totals(lgroup->group);
+	return 0;
+}
+
+static int
+_rate_group_release(lua_State* L) {
+	lrate_group_t* lgroup = get_rate_group(L, 1);
+	if ( lgroup->members > 0 ) {
+		luaL_error(L, "rate group:0x%x still has %d members", lgroup, lgroup->members);
+	}
+	lgroup->closed = 1;
+	bufferevent_rate_limit_group_free(lgroup->group);
+	luaL_unref(L, LUA_REGISTRYINDEX, lgroup->ref);
+	return 0;
+}
+
+static int
+_rate_group_alive(lua_State* L) {
+	lrate_group_t* lgroup = ( lrate_group_t* )lua_touserdata(L, 1);
+	lua_pushboolean(L, lgroup->closed == 0);
+	return 1;
+}
+
+//shared token bucket over many buffers,args same as buf:rate_limit
+static int
+_rate_group(lua_State* L) {
+	levent_t* levent = ( levent_t* )lua_touserdata(L, 1);
+	struct ev_token_bucket_cfg* cfg = bucket_cfg_new(L, 2);
+
+	lrate_group_t* lgroup = lua_newuserdata(L, sizeof( *lgroup ));
+	lgroup->levent = levent;
+	lgroup->closed = 0;
+	lgroup->members = 0;
+	lgroup->group = bufferevent_rate_limit_group_new(levent->ev_base, cfg);
+	ev_token_bucket_cfg_free(cfg);
+	lgroup->ref = _meta_init(L, META_RATE_GROUP);
+	return 1;
+}
+
+static int
+_httpd_close(lua_State* L) {
+	lhttpd_t* lhttpd = (lhttpd_t*)lua_touserdata(L, 1);
+	if ( lhttpd->closed == 1 ) {
+		luaL_error(L, "httpd already closed");
+	}
+	luaL_unref(L, LUA_REGISTRYINDEX, lhttpd->ref);
+	evhttp_free(lhttpd->ev);
+	lhttpd->closed = 1;
+	return 0;
+}
+
+static int
+_httpd_lazy_body(lua_State* L) {
+	lhttpd_t* lhttpd = (lhttpd_t*)lua_touserdata(L, 1);
+	lhttpd->lazy_body = lua_toboolean(L, 2);
+	return 0;
+}
+
+static int
+_httpd_max_body(lua_State* L) {
+	lhttpd_t* lhttpd = (lhttpd_t*)lua_touserdata(L, 1);
+	if ( lhttpd->closed == 1 ) {
+		luaL_error(L, "httpd already closed");
+	}
+	evhttp_set_max_body_size(lhttpd->ev, (ev_ssize_t)luaL_checkinteger(L, 2));
+	return 0;
+}
+
+static int
+_httpd_alive(lua_State* L) {
+	lhttpd_t* lhttpd = (lhttpd_t*)lua_touserdata(L, 1);
+	lua_pushboolean(L, lhttpd->closed == 0);
+	return 1;
+}
+
+//same buffer evhttp would make by itself,only with the httpd's priority
+static struct bufferevent*
+httpd_buffer(struct event_base* base, void* ud) {
+	lhttpd_t* lhttpd = ud;
+	struct bufferevent* bev = bufferevent_socket_new(base, -1, BEV_OPT_CLOSE_ON_FREE);
+	if ( bev ) {
+		bufferevent_priority_set(bev, lhttpd->priority);
+	}
+	return bev;
+}
+
+//ev:httpd(addr,multi,opts),addr as in listen
+static int
+_httpd(lua_State* L) {
+	levent_t* levent = (levent_t*)lua_touserdata(L, 1);
+	int multi = lua_toboolean(L, 3);
+	union un_sockaddr addr_un;
+	int len;
+	struct sockaddr* addr = make_addr(L, 2, &addr_un, &len, multi ? UNLINK_STALE : UNLINK_ANY);
+	int backlog, batch;
+
+	int flag = listen_flag(addr, multi);
+	//evhttp accept by itself,accept_batch has no meaning here
+	listen_options(L, 4, &flag, &backlog, &batch);
+	int priority = option_priority(L, levent, 4);
+
+	struct evconnlistener* listener = evconnlistener_new_bind(levent->ev_base, NULL, NULL, flag, backlog, addr, len);
+	if ( !listener ) {
+		return 0;
+	}
+	struct evhttp* ev = evhttp_new(levent->ev_base);
+	if ( !evhttp_bind_listener(ev, listener) ) {
+		evconnlistener_free(listener);
+		evhttp_free(ev);
+		return 0;
+	}
+
+	lhttpd_t* lhttpd = lua_newuserdata(L, sizeof( *lhttpd ));
+	lhttpd->levent = levent;
+	lhttpd->ev = ev;
+	lhttpd->closed = 0;
+	lhttpd->lazy_body = 0;
+	lhttpd->priority = priority;
+	lhttpd->ref = _meta_init(L, META_HTTP);
+
+	evhttp_set_gencb(lhttpd->ev, on_httpd_request, lhttpd);
+	if ( priority >= 0 ) {
+		evhttp_set_bevcb(lhttpd->ev, httpd_buffer, lhttpd);
+	}
+
+	return 1;
+}
+
+typedef struct lco {
+	lua_State* co;
+	int ref;
+	lua_Integer session;
+} lco_t;
+
+typedef struct lsched_entry {
+	lua_Integer session;
+	int base;
+	int nargs;
+} lsched_entry_t;
+
+typedef struct lsched_queue {
+	lsched_entry_t* ring;
+	int cap;
+	int head;
+	int count;
+} lsched_queue_t;
+
+//fork and wakeup arguments wait on the store thread's stack,no table per message
+typedef struct lsched {
+	lua_State* store;
+	int store_ref;
+	lsched_queue_t forks;
+	lsched_queue_t wakeups;
+
+	lco_t** idle;
+	int idle_count;
+	int idle_cap;
+
+	//session -> suspended coroutine,open addressing
+	lco_t** slots;
+	int slot_cap;
+	int waiting;
+
+	lco_t* running;
+	int yielding;
+	int dispatching;
+} lsched_t;
+
+static void
+sched_queue_push(lsched_queue_t* queue, lua_Integer session, int base, int nargs) {
+	if ( queue->count == queue->cap ) {
+		int cap = queue->cap ? queue->cap * 2 : 64;
+		lsched_entry_t* ring = malloc(sizeof( *ring ) * cap);
+		int i;
+		for ( i = 0; i < queue->count; i++ ) {
+			ring[i] = queue->ring[( queue->head + i ) & ( queue->cap - 1 )];
+		}
+		free(queue->ring);
+		queue->ring = ring;
+		queue->cap = cap;
+		queue->head = 0;
+	}
+	lsched_entry_t* entry = &queue->ring[( queue->head + queue->count ) & ( queue->cap - 1 )];
+	entry->session = session;
+	entry->base = base;
+	entry->nargs = nargs;
+	queue->count++;
+}
+
+static lsched_entry_t
+sched_queue_pop(lsched_queue_t* queue) {
+	lsched_entry_t entry = queue->ring[queue->head];
+	queue->head = ( queue->head + 1 ) & ( queue->cap - 1 );
+	queue->count--;
+	return entry;
+}
+
+static void sched_map_put(lsched_t* sched, lco_t* lco);
+
+static void
+sched_map_grow(lsched_t* sched) {
+	lco_t** slots = sched->slots;
+	int cap = sched->slot_cap;
+	sched->slot_cap = cap ? cap * 2 : 256;
+	sched->slots = malloc(sizeof( lco_t* ) * sched->slot_cap);
+	memset(sched->slots, 0, sizeof( lco_t* ) * sched->slot_cap);
+	sched->waiting = 0;
+	int i;
+	for ( i = 0; i < cap; i++ ) {
+		if ( slots[i] ) {
+			sched_map_put(sched, slots[i]);
+		}
+	}
+	free(slots);
+}
+
+static void
+sched_map_put(lsched_t* sched, lco_t* lco) {
+	if ( ( sched->waiting + 1 ) * 2 > sched->slot_cap ) {
+		sched_map_grow(sched);
+	}
+	int mask = sched->slot_cap - 1;
+	int i = (int)( lco->session & mask );
+	while ( sched->slots[i] ) {
+		i = ( i + 1 ) & mask;
+	}
+	sched->slots[i] = lco;
+	sched->waiting++;
+}
+
+static lco_t*
+sched_map_take(lsched_t* sched, lua_Integer session) {
+	if ( !sched->waiting ) {
+		return NULL;
+	}
+	int mask = sched->slot_cap - 1;
+	int i = (int)( session & mask );
+	while ( sched->slots[i] && sched->slots[i]->session != session ) {
+		i = ( i + 1 ) & mask;
+	}
+	lco_t* lco = sched->slots[i];
+	if ( !lco ) {
+		return NULL;
+	}
+	sched->slots[i] = NULL;
+	sched->waiting--;
+
+	//shift back the rest of the probe chain so lookups never stop early
+	int j = i;
+	for ( ;; ) {
+		j = ( j + 1 ) & mask;
+		lco_t* next = sched->slots[j];
+		if ( !next ) {
+			break;
+		}
+		int k = (int)( next->session & mask );
+		if ( ( j > i && ( k <= i || k > j ) ) || ( j < i && ( k <= i && k > j ) ) ) {
+			sched->slots[i] = next;
+			sched->slots[j] = NULL;
+			i = j;
+		}
+	}
+	return lco;
+}
+
+static lsched_t*
+get_sched(lua_State* L, levent_t* levent) {
+	if ( !levent->sched ) {
+		lsched_t* sched = malloc(sizeof( *sched ));
+		memset(sched, 0, sizeof( *sched ));
+		sched->store = lua_newthread(L);
+		sched->store_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+		levent->sched = sched;
+	}
+	return levent->sched;
+}
+
+static void
+sched_drop(lua_State* L, lco_t* lco) {
+	luaL_unref(L, LUA_REGISTRYINDEX, lco->ref);
+	free(lco);
+}
+
+static void
+sched_resume(lua_State* L, lsched_t* sched, lco_t* lco, int nargs) {
+	sched->running = lco;
+	sched->yielding = 0;
+	int status = lua_resume(lco->co, L, nargs);
+	sched->running = NULL;
+
+	if ( status == LUA_OK ) {
+		lua_settop(lco->co, 0);
+		if ( sched->idle_count == sched->idle_cap ) {
+			sched->idle_cap = sched->idle_cap ? sched->idle_cap * 2 : 64;
+			sched->idle = realloc(sched->idle, sizeof( lco_t* ) * sched->idle_cap);
+		}
+		sched->idle[sched->idle_count++] = lco;
+	}
+	else if ( status == LUA_YIELD ) {
+		lua_settop(lco->co, 0);
+		if ( sched->yielding ) {
+			sched_map_put(sched, lco);
+		}
+		else {
+			fprintf(stderr, "coroutine yield outside wait,dropped\n");
+			sched_drop(L, lco);
+		}
+	}
+	else {
+		luaL_traceback(L, lco->co, lua_tostring(lco->co, -1), 0);
+		fprintf(stderr, "%s\n", lua_tostring(L, -1));
+		lua_pop(L, 1);
+		sched_drop(L, lco);
+	}
+}
+
+//ev:fork(func,...)
+static int
+_fork(lua_State* L) {
+	levent_t* levent = ( levent_t* )lua_touserdata(L, 1);
+	luaL_checktype(L, 2, LUA_TFUNCTION);
+	lsched_t* sched = get_sched(L, levent);
+	int nargs = lua_gettop(L) - 1;
+	if ( !lua_checkstack(sched->store, nargs) ) {
+		luaL_error(L, "fork queue overflow");
+	}
+	int base = lua_gettop(sched->store) + 1;
+	lua_xmove(L, sched->store, nargs);
+	sched_queue_push(&sched->forks, 0, base, nargs);
+	return 0;
+}
+
+//ev:wakeup(session,...),the values become the results of wait
+static int
+_wakeup(lua_State* L) {
+	levent_t* levent = ( levent_t* )lua_touserdata(L, 1);
+	lua_Integer session = luaL_checkinteger(L, 2);
+	lsched_t* sched = get_sched(L, levent);
+	int nargs = lua_gettop(L) - 2;
+	if ( !lua_checkstack(sched->store, nargs) ) {
+		luaL_error(L, "wakeup queue overflow");
+	}
+	int base = lua_gettop(sched->store) + 1;
+	lua_xmove(L, sched->store, nargs);
+	sched_queue_push(&sched->wakeups, session, base, nargs);
+	return 0;
+}
+
+//ev:wait(session),only from a coroutine started by fork
+static int
+_wait(lua_State* L) {
+	levent_t* levent = ( levent_t* )lua_touserdata(L, 1);
+	lua_Integer session = luaL_checkinteger(L, 2);
+	lsched_t* sched = levent->sched;
+	if ( !sched || !sched->running || sched->running->co != L ) {
+		luaL_error(L, "cannot wait outside a forked coroutine");
+	}
+	sched->running->session = session;
+	sched->yielding = 1;
+	return lua_yield(L, 0);
+}
+
+//resume everything queued,wakeups first,until both queues are empty
+static int
+_sched_run(lua_State* L) {
+	levent_t* levent = ( levent_t* )lua_touserdata(L, 1);
+	lsched_t* sched = levent->sched;
+	if ( !sched || sched->dispatching ) {
+		return 0;
+	}
+	sched->dispatching = 1;
+	lua_State* store = sched->store;
+
+	while ( sched->wakeups.count || sched->forks.count ) {
+		while ( sched->wakeups.count ) {
+			lsched_entry_t entry = sched_queue_pop(&sched->wakeups);
+			lco_t* lco = sched_map_take(sched, entry.session);
+			if ( !lco ) {
+				fprintf(stderr, "error wakeup:session:%lld not found\n", (long long)entry.session);
+				continue;
+			}
+			lua_checkstack(lco->co, entry.nargs);
+			int i;
+			for ( i = 0; i < entry.nargs; i++ ) {
+				lua_pushvalue(store, entry.base + i);
+				lua_xmove(store, lco->co, 1);
+			}
+			sched_resume(L, sched, lco, entry.nargs);
+		}
+		while ( sched->forks.count ) {
+			lsched_entry_t entry = sched_queue_pop(&sched->forks);
+			lco_t* lco;
+			if ( sched->idle_count ) {
+				lco = sched->idle[--sched->idle_count];
+			}
+			else {
+				lco = malloc(sizeof( *lco ));
+				lco->co = lua_newthread(L);
+				lco->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+			}
+			lua_checkstack(lco->co, entry.nargs);
+			int i;
+			for ( i = 0; i < entry.nargs; i++ ) {
+				lua_pushvalue(store, entry.base + i);
+				lua_xmove(store, lco->co, 1);
+			}
+			sched_resume(L, sched, lco, entry.nargs - 1);
+		}
+	}
+	lua_settop(store, 0);
+	sched->dispatching = 0;
+	return 0;
+}
+
+//idle threads,suspended coroutines
+static int
+_sched_stats(lua_State* L) {
+	levent_t* levent = ( levent_t* )lua_touserdata(L, 1);
+	lsched_t* sched = get_sched(L, levent);
+	lua_pushinteger(L, sched->idle_count);
+	lua_pushinteger(L, sched->waiting);
+	return 2;
+}
+
+static int
+_sched_clean(lua_State* L) {
+	levent_t* levent = ( levent_t* )lua_touserdata(L, 1);
+	lsched_t* sched = levent->sched;
+	if ( !sched ) {
+		return 0;
+	}
+	while ( sched->idle_count ) {
+		sched_drop(L, sched->idle[--sched->idle_count]);
+	}
+	return 0;
+}
+
+static void
+sched_free(lua_State* L, lsched_t* sched) {
+	while ( sched->idle_count ) {
+		sched_drop(L, sched->idle[--sched->idle_count]);
+	}
+	int i;
+	for ( i = 0; i < sched->slot_cap; i++ ) {
+		if ( sched->slots[i] ) {
+			sched_drop(L, sched->slots[i]);
+		}
+	}
+	luaL_unref(L, LUA_REGISTRYINDEX, sched->store_ref);
+	free(sched->idle);
+	free(sched->slots);
+	free(sched->forks.ring);
+	free(sched->wakeups.ring);
+	free(sched);
+}
+
+typedef struct ljob_arg {
+	const char* data;
+	size_t size;
+} ljob_arg_t;
+
+//native job,runs on a pool thread and must never touch a lua_State
+//return 0 with the result in a malloc'd *out,or non zero with the error message in *out
+typedef int(*ljob_func)( const ljob_arg_t* argv, int argc, char** out, size_t* out_size );
+
+#define JOB_MAX_ARGS	4
+#define JOB_MAX_TYPES	64
+
+typedef struct ljob_type {
+	char name[32];
+	ljob_func func;
+} ljob_type_t;
+
+//completions of one event loop,outlive the loop until every pending job is back
+typedef struct ljob_port {
+	lmutex_t lock;
+	struct ljob* volatile done;
+	struct event* ev;
+	int pending;
+} ljob_port_t;
+
+typedef struct ljob {
+	struct ljob* next;
+	ljob_func func;
+	ljob_port_t* port;
+	lua_Integer session;
+	int argc;
+	ljob_arg_t argv[JOB_MAX_ARGS];
+	int status;
+	char* out;
+	size_t out_size;
+} ljob_t;
+
+typedef struct ljob_pool {
+	int count;
+	lthread_t* threads;
+	lmutex_t lock;
+	lcond_t cond;
+	ljob_t* head;
+	ljob_t* tail;
+	int queued;
+	int quit;
+} ljob_pool_t;
+
+//register_job run on any worker while others submit,writers take it exclusive
+static lrwlock_t JOB_TYPES_LOCK = RWLOCK_STATIC_INIT;
+static ljob_type_t JOB_TYPES[JOB_MAX_TYPES];
+static int JOB_TYPE_COUNT = 0;
+//submit hold it shared while it use the pool,offload and offload_stop exclusive to publish or take it
+static lrwlock_t JOBS_LOCK = RWLOCK_STATIC_INIT;
+static ljob_pool_t* JOBS = NULL;
+
+static int
+job_error(char** out, size_t* out_size, const char* err) {
+	*out_size = strlen(err);
+	*out = malloc(*out_size + 1);
+	memcpy(*out, err, *out_size + 1);
+	return -1;
+}
+
+//read_file(path)
+static int
+job_read_file(const ljob_arg_t* argv, int argc, char** out, size_t* out_size) {
+	FILE* fp = fopen(argv[0].data, "rb");
+	if ( !fp ) {
+		return job_error(out, out_size, strerror(errno));
+	}
+	size_t cap = 4096;
+	size_t size = 0;
+	char* data = malloc(cap);
+	for ( ;; ) {
+		size_t n = fread(data + size, 1, cap - size, fp);
+		size += n;
+		if ( size < cap ) {
+			break;
+		}
+		cap *= 2;
+		data = realloc(data, cap);
+	}
+	if ( ferror(fp) ) {
+		int err = errno;
+		fclose(fp);
+		free(data);
+		return job_error(out, out_size, strerror(err));
+	}
+	fclose(fp);
+	*out = data;
+	*out_size = size;
+	return 0;
+}
+
+static int
+job_put_file(const ljob_arg_t* argv, int argc, char** out, size_t* out_size, const char* mode) {
+	if ( argc < 2 ) {
+		return job_error(out, out_size, "need path and data");
+	}
+	FILE* fp = fopen(argv[0].data, mode);
+	if ( !fp ) {
+		return job_error(out, out_size, strerror(errno));
+	}
+	size_t n = fwrite(argv[1].data, 1, argv[1].size, fp);
+	if ( fclose(fp) != 0 || n != argv[1].size ) {
+		return job_error(out, out_size, strerror(errno));
+	}
+	*out = NULL;
+	*out_size = 0;
+	return 0;
+}
+
+//write_file(path,data)
+static int
+job_write_file(const ljob_arg_t* argv, int argc, char** out, size_t* out_size) {
+	return job_put_file(argv, argc, out, out_size, "wb");
+}
+
+//append_file(path,data)
+static int
+job_append_file(const ljob_arg_t* argv, int argc, char** out, size_t* out_size) {
+	return job_put_file(argv, argc, out, out_size, "ab");
+}
+
+//list_dir(path),entry names separated by \n,without . and ..
+static int
+job_list_dir(const ljob_arg_t* argv, int argc, char** out, size_t* out_size) {
+	struct evbuffer* buf = evbuffer_new();
+#ifdef _WIN32
+	char pattern[MAX_PATH];
+	_snprintf(pattern, sizeof( pattern ), "%s\\*", argv[0].data);
+	WIN32_FIND_DATAA data;
+	HANDLE handle = FindFirstFileA(pattern, &data);
+	if ( handle == INVALID_HANDLE_VALUE ) {
+		evbuffer_free(buf);
+		return job_error(out, out_size, "find first file failed");
+	}
+	do {
+		const char* name = data.cFileName;
+#else
+	DIR* dir = opendir(argv[0].data);
+	if ( !dir ) {
+		evbuffer_free(buf);
+		return job_error(out, out_size, strerror(errno));
+	}
+	struct dirent* entry;
+	while ( ( entry = readdir(dir) ) != NULL ) {
+		const char* name = entry->d_name;
+#endif
+		if ( strcmp(name, ".") == 0 || strcmp(name, "..") == 0 ) {
+			continue;
+		}
+		if ( evbuffer_get_length(buf) ) {
+			evbuffer_add(buf, "\n", 1);
+		}
+		evbuffer_add(buf, name, strlen(name));
+#ifdef _WIN32
+	} while ( FindNextFileA(handle, &data) );
+	FindClose(handle);
+#else
+	}
+	closedir(dir);
+#endif
+	*out_size = evbuffer_get_length(buf);
+	*out = malloc(*out_size + 1);
+	evbuffer_remove(buf, *out, *out_size);
+	evbuffer_free(buf);
+	return 0;
+}
+
+//caller hold JOB_TYPES_LOCK exclusive
+static int
+job_register_locked(const char* name, ljob_func func) {
+	int i;
+	for ( i = 0; i < JOB_TYPE_COUNT; i++ ) {
+		if ( strcmp(JOB_TYPES[i].name, name) == 0 ) {
+			JOB_TYPES[i].func = func;
+			return 0;
+		}
+	}
+	if ( JOB_TYPE_COUNT == JOB_MAX_TYPES || strlen(name) >= sizeof( JOB_TYPES[0].name ) ) {
+		return -1;
+	}
+	strcpy(JOB_TYPES[JOB_TYPE_COUNT].name, name);
+	JOB_TYPES[JOB_TYPE_COUNT].func = func;
+	JOB_TYPE_COUNT++;
+	return 0;
+}
+
+static int
+job_register(const char* name, ljob_func func) {
+	RWLOCK_WRLOCK(&JOB_TYPES_LOCK);
+	int result = job_register_locked(name, func);
+	RWLOCK_WRUNLOCK(&JOB_TYPES_LOCK);
+	return result;
+}
+
+//main state open first,workers find the builtin jobs already there
+static void
+job_register_builtin() {
+	RWLOCK_WRLOCK(&JOB_TYPES_LOCK);
+	if ( !JOB_TYPE_COUNT ) {
+		job_register_locked("read_file", job_read_file);
+		job_register_locked("write_file", job_write_file);
+		job_register_locked("append_file", job_append_file);
+		job_register_locked("list_dir", job_list_dir);
+	}
+	RWLOCK_WRUNLOCK(&JOB_TYPES_LOCK);
+}
+
+static ljob_func
+job_find(const char* name) {
+	ljob_func func = NULL;
+	RWLOCK_RDLOCK(&JOB_TYPES_LOCK);
+	int i;
+	for ( i = 0; i < JOB_TYPE_COUNT; i++ ) {
+		if ( strcmp(JOB_TYPES[i].name, name) == 0 ) {
+			func = JOB_TYPES[i].func;
+			break;
+		}
+	}
+	RWLOCK_RDUNLOCK(&JOB_TYPES_LOCK);
+	return func;
+}
+
+static void
+job_port_free(ljob_port_t* port) {
+	while ( port->done ) {
+		ljob_t* job = port->done;
+		port->done = job->next;
+		free(job->out);
+		free(job);
+	}
+	MUTEX_FREE(&port->lock);
+	free(port);
+}
+
+//hand a finished job back to its loop,the last one out of a closed port free it
+static void
+job_post(ljob_t* job) {
+	ljob_port_t* port = job->port;
+	ljob_t* head;
+	do {
+		head = port->done;
+		job->next = head;
+	} while ( !ATOM_CAS_POINTER(&port->done, head, job) );
+
+	MUTEX_LOCK(&port->lock);
+	int orphan = --port->pending == 0 && !port->ev;
+	if ( port->ev ) {
+		event_active(port->ev, EV_READ, 1);
+	}
+	MUTEX_UNLOCK(&port->lock);
+
+	if ( orphan ) {
+		job_port_free(port);
+	}
+}
+
+static THREAD_PROC
+job_main(void* ud) {
+	ljob_pool_t* pool = ud;
+	for ( ;; ) {
+		MUTEX_LOCK(&pool->lock);
+		while ( !pool->head && !pool->quit ) {
+			COND_WAIT(&pool->cond, &pool->lock);
+		}
+		ljob_t* job = pool->head;
+		if ( !job ) {
+			MUTEX_UNLOCK(&pool->lock);
+			break;
+		}
+		pool->head = job->next;
+		if ( !pool->head ) {
+			pool->tail = NULL;
+		}
+		pool->queued--;
+		MUTEX_UNLOCK(&pool->lock);
+
+		job->out = NULL;
+		job->out_size = 0;
+		job->status = job->func(job->argv, job->argc, &job->out, &job->out_size);
+		job_post(job);
+	}
+	return 0;
+}
+
+static void
+job_arrive(int fd, short event, void* ud) {
+	levent_t* levent = ud;
+	lua_State* L = levent->L;
+
+	ljob_t* list = ATOM_XCHG_POINTER(&levent->jobs->done, NULL);
+
+	//pool threads push on the head,reverse to restore completion order
+	ljob_t* job = NULL;
+	while ( list ) {
+		ljob_t* next = list->next;
+		list->next = job;
+		job = list;
+		list = next;
+	}
+
+	batch_flush(levent);
+	while ( job ) {
+		ljob_t* next = job->next;
+		lua_rawgeti(L, LUA_REGISTRYINDEX, levent->callback);
+		lua_pushinteger(L, LUA_EV_JOB);
+		lua_pushinteger(L, job->session);
+		lua_pushboolean(L, job->status == 0);
+		if ( job->out ) {
+			lua_pushlstring(L, job->out, job->out_size);
+		}
+		else {
+			lua_pushnil(L);
+		}
+		levent_pcall(levent, 4);
+		free(job->out);
+		free(job);
+		job = next;
+	}
+}
+
+static void
+job_detach(levent_t* levent) {
+	ljob_port_t* port = levent->jobs;
+
+	MUTEX_LOCK(&port->lock);
+	struct event* ev = port->ev;
+	port->ev = NULL;
+	int orphan = port->pending == 0;
+	MUTEX_UNLOCK(&port->lock);
+
+	event_free(ev);
+	if ( orphan ) {
+		job_port_free(port);
+	}
+	levent->jobs = NULL;
+}
+
+//let the threads run what is queued,join them and free the pool
+static void
+job_pool_free(ljob_pool_t* pool) {
+	MUTEX_LOCK(&pool->lock);
+	pool->quit = 1;
+	COND_BROADCAST(&pool->cond);
+	MUTEX_UNLOCK(&pool->lock);
+
+	int i;
+	for ( i = 0; i < pool->count; i++ ) {
+		THREAD_JOIN(pool->threads[i]);
+	}
+	COND_FREE(&pool->cond);
+	MUTEX_FREE(&pool->lock);
+	free(pool->threads);
+	free(pool);
+}
+
+//event.core.offload(threads),start the process wide job pool once
+static int
+_offload(lua_State* L) {
+	int count = luaL_optinteger(L, 1, 4);
+	luaL_argcheck(L, count > 0, 1, "thread count must be positive");
+	RWLOCK_RDLOCK(&JOBS_LOCK);
+	int running = JOBS ? JOBS->count : 0;
+	RWLOCK_RDUNLOCK(&JOBS_LOCK);
+	if ( running > 0 ) {
+		lua_pushinteger(L, running);
+		return 1;
+	}
+
+	ljob_pool_t* pool = malloc(sizeof( *pool ));
+	memset(pool, 0, sizeof( *pool ));
+	MUTEX_INIT(&pool->lock);
+	COND_INIT(&pool->cond);
+	pool->threads = malloc(sizeof( lthread_t ) * count);
+
+	//threads start before the pool is published,submit never see a pool nobody serve
+	int i;
+	for ( i = 0; i < count; i++ ) {
+		if ( !THREAD_CREATE(&pool->threads[i], job_main, pool) ) {
+			break;
+		}
+		pool->count++;
+	}
+	if ( pool->count == 0 ) {
+		job_pool_free(pool);
+		luaL_error(L, "job pool could not start any thread");
+	}
+
+	//loops in other workers may race to start it,only one pool win
+	RWLOCK_WRLOCK(&JOBS_LOCK);
+	ljob_pool_t* current = JOBS;
+	if ( !current ) {
+		JOBS = pool;
+	}
+	running = current ? current->count : pool->count;
+	RWLOCK_WRUNLOCK(&JOBS_LOCK);
+	if ( current ) {
+		job_pool_free(pool);
+	}
+	lua_pushinteger(L, running);
+	return 1;
+}
+
+//event.core.offload_stop(),run what is queued then join the pool threads
+static int
+_offload_stop(lua_State* L) {
+	RWLOCK_WRLOCK(&JOBS_LOCK);
+	ljob_pool_t* pool = JOBS;
+	JOBS = NULL;
+	RWLOCK_WRUNLOCK(&JOBS_LOCK);
+	if ( !pool ) {
+		return 0;
+	}
+	job_pool_free(pool);
+	return 0;
+}
+
+//event.core.register_job(name,func),func is a lightuserdata ljob_func exported by a native module
+static int
+_register_job(lua_State* L) {
+	const char* name = luaL_checkstring(L, 1);
+	luaL_checktype(L, 2, LUA_TLIGHTUSERDATA);
+	if ( job_register(name, (ljob_func)lua_touserdata(L, 2)) < 0 ) {
+		luaL_error(L, "register job:%s failed", name);
+	}
+	return 0;
+}
+
+//ev:submit(session,name,...),string arguments are copied,the result come back as LUA_EV_JOB
+static int
+_submit(lua_State* L) {
+	levent_t* levent = ( levent_t* )lua_touserdata(L, 1);
+	lua_Integer session = luaL_checkinteger(L, 2);
+	const char* name = luaL_checkstring(L, 3);
+	int argc = lua_gettop(L) - 3;
+	luaL_argcheck(L, argc >= 1 && argc <= JOB_MAX_ARGS, 4, "job take 1 to 4 arguments");
+
+	ljob_func func = job_find(name);
+	if ( !func ) {
+		luaL_error(L, "no such job:%s", name);
+	}
+
+	size_t total = 0;
+	int i;
+	for ( i = 0; i < argc; i++ ) {
+		size_t size;
+		luaL_checklstring(L, 4 + i, &size);
+		total += size + 1;
+	}
 
-	evtimer_add(levtimer->ev, &tv);
+	//arguments live right after the job,each zero terminated
+	ljob_t* job = malloc(sizeof( *job ) + total);
+	char* cursor = (char*)( job + 1 );
+	for ( i = 0; i < argc; i++ ) {
+		size_t size;
+		const char* data = lua_tolstring(L, 4 + i, &size);
+		memcpy(cursor, data, size);
+		cursor[size] = 0;
+		job->argv[i].data = cursor;
+		job->argv[i].size = size;
+		cursor += size + 1;
+	}
+	job->next = NULL;
+	job->func = func;
+	job->session = session;
+	job->argc = argc;
+
+	//offload_stop can not free the pool until the job is queued
+	RWLOCK_RDLOCK(&JOBS_LOCK);
+	ljob_pool_t* pool = JOBS;
+	if ( !pool ) {
+		RWLOCK_RDUNLOCK(&JOBS_LOCK);
+		free(job);
+		luaL_error(L, "offload pool not started");
+	}
 
-	return 1;
+	if ( !levent->jobs ) {
+		ljob_port_t* port = malloc(sizeof( *port ));
+		MUTEX_INIT(&port->lock);
+		port->done = NULL;
+		port->pending = 0;
+		port->ev = event_new(levent->ev_base, -1, EV_PERSIST, job_arrive, levent);
+		levent->jobs = port;
+	}
+	job->port = levent->jobs;
+	MUTEX_LOCK(&job->port->lock);
+	job->port->pending++;
+	MUTEX_UNLOCK(&job->port->lock);
+
+	MUTEX_LOCK(&pool->lock);
+	if ( pool->tail ) {
+		pool->tail->next = job;
+	}
+	else {
+		pool->head = job;
+	}
+	pool->tail = job;
+	pool->queued++;
+	COND_SIGNAL(&pool->cond);
+	MUTEX_UNLOCK(&pool->lock);
+	RWLOCK_RDUNLOCK(&JOBS_LOCK);
+	return 0;
 }
 
+//jobs of this loop not back yet,jobs waiting for a pool thread
 static int
-_dns(lua_State* L) {
+_job_stats(lua_State* L) {
 	levent_t* levent = ( levent_t* )lua_touserdata(L, 1);
-	const char* host = lua_tostring(L, 2);
-
-	struct evutil_addrinfo hints;
-	memset(&hints, 0, sizeof( hints ));
-	hints.ai_family = AF_UNSPEC;
-	hints.ai_flags = EVUTIL_AI_CANONNAME;
-	hints.ai_socktype = SOCK_STREAM;
-	hints.ai_protocol = IPPROTO_TCP;
+	int pending = 0;
+	if ( levent->jobs ) {
+		MUTEX_LOCK(&levent->jobs->lock);
+		pending = levent->jobs->pending;
+		MUTEX_UNLOCK(&levent->jobs->lock);
+	}
+	int queued = 0;
+	RWLOCK_RDLOCK(&JOBS_LOCK);
+	ljob_pool_t* pool = JOBS;
+	if ( pool ) {
+		MUTEX_LOCK(&pool->lock);
+		queued = pool->queued;
+		MUTEX_UNLOCK(&pool->lock);
+	}
+	RWLOCK_RDUNLOCK(&JOBS_LOCK);
+	lua_pushinteger(L, pending);
+	lua_pushinteger(L, queued);
+	return 2;
+}
 
-	levdns_t* levdns = lua_newuserdata(L, sizeof( *levdns ));
-	levdns->levent = levent;
+static const char* EV_NAMES[LUA_EV_MAX] = {
+	"error", "timeout", "accept", "connect", "data", "http",
+	"dns", "batch", "mail", "expire", "writable", "udp", "job",
+};
 
-	lua_pushvalue(L, -1);
-	levdns->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+static uint64_t
+histogram_quantile(lhistogram_t* histogram, double q) {
+	if ( histogram->count == 0 ) {
+		return 0;
+	}
+	uint64_t rank = (uint64_t)( q * histogram->count + 0.5 );
+	if ( rank < 1 ) {
+		rank = 1;
+	}
+	uint64_t seen = 0;
+	int i;
+	for ( i = 0; i < STATS_BUCKETS; i++ ) {
+		seen += histogram->buckets[i];
+		if ( seen >= rank ) {
+			break;
+		}
+	}
+	//report the upper edge of the bucket,never above the real max
+	uint64_t value;
+	if ( i < STATS_SUB * 2 ) {
+		value = i;
+	}
+	else {
+		int shift = i / STATS_SUB - 1;
+		value = ( ( (uint64_t)( STATS_SUB + i % STATS_SUB ) + 1 ) << shift ) - 1;
+	}
+	return value > histogram->max ? histogram->max : value;
+}
 
-	levdns->req = evdns_getaddrinfo(levent->dns_base, host, NULL, &hints, dns_response, levdns);
+static const double QUANTILES[] = { 0.5, 0.9, 0.99, 0.999 };
+static const char* QUANTILE_NAMES[] = { "p50", "p90", "p99", "p999" };
 
-	if ( !levdns->req ) {
-		lua_pushboolean(L, 0);
+static void
+push_histogram(lua_State* L, lhistogram_t* histogram) {
+	lua_createtable(L, 0, 9);
+	lua_pushinteger(L, histogram->count);
+	lua_setfield(L, -2, "count");
+	lua_pushinteger(L, histogram->sum);
+	lua_setfield(L, -2, "sum");
+	lua_pushinteger(L, histogram->min);
+	lua_setfield(L, -2, "min");
+	lua_pushinteger(L, histogram->max);
+	lua_setfield(L, -2, "max");
+	lua_pushnumber(L, histogram->count ? (double)histogram->sum / histogram->count : 0);
+	lua_setfield(L, -2, "mean");
+	int i;
+	for ( i = 0; i < 4; i++ ) {
+		lua_pushinteger(L, histogram_quantile(histogram, QUANTILES[i]));
+		lua_setfield(L, -2, QUANTILE_NAMES[i]);
 	}
-	
-	return 1;
 }
 
-static int
-_httpd_close(lua_State* L) {
-	lhttpd_t* lhttpd = (lhttpd_t*)lua_touserdata(L, 1);
-	if ( lhttpd->closed == 1 ) {
-		luaL_error(L, "httpd already closed");
+static void
+stats_probe(evutil_socket_t fd, short what, void* ud) {
+	lstats_t* stats = ud;
+	uint64_t now = stats_clock();
+	if ( stats->probe_expect ) {
+		histogram_record(&stats->lag, now > stats->probe_expect ? now - stats->probe_expect : 0);
 	}
-	luaL_unref(L, LUA_REGISTRYINDEX, lhttpd->ref);
-	evhttp_free(lhttpd->ev);
-	lhttpd->closed = 1;
-	return 0;
+	stats->probe_expect = now + stats->probe_interval;
 }
 
-static int
-_httpd_alive(lua_State* L) {
-	lhttpd_t* lhttpd = (lhttpd_t*)lua_touserdata(L, 1);
-	lua_pushboolean(L, lhttpd->closed == 0);
-	return 1;
+static void
+stats_free(levent_t* levent) {
+	lstats_t* stats = levent->stats;
+	if ( stats->probe ) {
+		event_free(stats->probe);
+	}
+	free(stats);
+	levent->stats = NULL;
 }
 
+//ev:stats_enable(on,lag_interval),lag is sampled by a timer every lag_interval seconds
 static int
-_httpd(lua_State* L) {
-	levent_t* levent = (levent_t*)lua_touserdata(L, 1);
-	size_t sz;
-	const char* ip = lua_tolstring(L, 2, &sz);
-	int port = lua_tointeger(L, 3);
-	int multi = lua_toboolean(L, 4);
+_stats_enable(lua_State* L) {
+	levent_t* levent = ( levent_t* )lua_touserdata(L, 1);
+	int on = lua_toboolean(L, 2);
+	double interval = luaL_optnumber(L, 3, 0.1);
 
-	struct sockaddr_in sin;
-	sin.sin_family = AF_INET;
-	sin.sin_addr.s_addr = inet_addr(ip);
-	sin.sin_port = htons(port);
-	memset(sin.sin_zero, 0x00, 8);
+	if ( levent->stats ) {
+		stats_free(levent);
+	}
+	if ( !on ) {
+		return 0;
+	}
 
-	int flag = LEV_OPT_REUSEABLE | LEV_OPT_CLOSE_ON_FREE | LEV_OPT_CLOSE_ON_EXEC;
-	if ( multi ) {
-		flag |= LEV_OPT_REUSEABLE_PORT;
+	lstats_t* stats = malloc(sizeof( *stats ));
+	memset(stats, 0, sizeof( *stats ));
+	if ( interval > 0 ) {
+		struct timeval tv;
+		tv.tv_sec = (long)interval;
+		tv.tv_usec = (long)( ( interval - (long)interval ) * 1000000 );
+		stats->probe_interval = (uint64_t)( interval * 1000000 );
+		stats->probe = event_new(levent->ev_base, -1, EV_PERSIST, stats_probe, stats);
+		event_add(stats->probe, &tv);
+		stats->probe_expect = stats_clock() + stats->probe_interval;
 	}
+	levent->stats = stats;
+	return 0;
+}
 
-	struct evconnlistener* listener = evconnlistener_new_bind(levent->ev_base, NULL, NULL, flag, 16, ( struct sockaddr* )&sin, sizeof( struct sockaddr_in ));
-	if ( !listener ) {
-		return 0;
+//times are microseconds,counters are totals since enable or the last reset
+static int
+_stats(lua_State* L) {
+	levent_t* levent = ( levent_t* )lua_touserdata(L, 1);
+	int reset = lua_toboolean(L, 2);
+
+	lua_createtable(L, 0, 10);
+	lua_pushinteger(L, levent->live_buffers);
+	lua_setfield(L, -2, "buffers");
+	lua_pushinteger(L, levent->live_timers);
+	lua_setfield(L, -2, "timers");
+	lua_pushinteger(L, levent->live_listeners);
+	lua_setfield(L, -2, "listeners");
+	if ( levent->file_cache ) {
+		lua_pushinteger(L, levent->file_cache->hit);
+		lua_setfield(L, -2, "file_hit");
+		lua_pushinteger(L, levent->file_cache->miss);
+		lua_setfield(L, -2, "file_miss");
 	}
-	struct evhttp* ev = evhttp_new(levent->ev_base);
-	if ( !evhttp_bind_listener(ev, listener) ) {
-		evconnlistener_free(listener);
-		evhttp_free(ev);
-		return 0;
+
+	lstats_t* stats = levent->stats;
+	if ( !stats ) {
+		return 1;
+	}
+	lua_pushinteger(L, stats->iterations);
+	lua_setfield(L, -2, "iterations");
+	lua_pushinteger(L, stats->bytes_read);
+	lua_setfield(L, -2, "bytes_read");
+	lua_pushinteger(L, stats->bytes_written);
+	lua_setfield(L, -2, "bytes_written");
+	push_histogram(L, &stats->iteration);
+	lua_setfield(L, -2, "iteration");
+	push_histogram(L, &stats->lag);
+	lua_setfield(L, -2, "lag");
+
+	lua_createtable(L, 0, LUA_EV_MAX);
+	int i;
+	for ( i = 0; i < LUA_EV_MAX; i++ ) {
+		if ( stats->callback[i].count ) {
+			push_histogram(L, &stats->callback[i]);
+			lua_setfield(L, -2, EV_NAMES[i]);
+		}
+	}
+	lua_setfield(L, -2, "callback");
+
+	if ( reset ) {
+		struct event* probe = stats->probe;
+		uint64_t interval = stats->probe_interval;
+		memset(stats, 0, sizeof( *stats ));
+		stats->probe = probe;
+		stats->probe_interval = interval;
 	}
+	return 1;
+}
 
-	lhttpd_t* lhttpd = lua_newuserdata(L, sizeof( *lhttpd ));
-	lhttpd->levent = levent;
-	lhttpd->ev = ev;
-	lhttpd->closed = 0;
-	lhttpd->ref = _meta_init(L, META_HTTP);
+static void
+add_summary(luaL_Buffer* b, const char* prefix, const char* name, const char* label, lhistogram_t* histogram) {
+	char line[256];
+	const char* sep = label[0] ? "," : "";
+	int i;
+	for ( i = 0; i < 4; i++ ) {
+		snprintf(line, sizeof( line ), "%s_%s{%s%squantile=\"%g\"} %.6f\n", prefix, name, label, sep,
+				 QUANTILES[i], histogram_quantile(histogram, QUANTILES[i]) / 1e6);
+		luaL_addstring(b, line);
+	}
+	snprintf(line, sizeof( line ), "%s_%s_sum%s%s%s %.6f\n", prefix, name, label[0] ? "{" : "", label, label[0] ? "}" : "", histogram->sum / 1e6);
+	luaL_addstring(b, line);
+	snprintf(line, sizeof( line ), "%s_%s_count%s%s%s %llu\n", prefix, name, label[0] ? "{" : "", label, label[0] ? "}" : "", (unsigned long long)histogram->count);
+	luaL_addstring(b, line);
+}
 
-	evhttp_set_gencb(lhttpd->ev, on_httpd_request, lhttpd);
+static void
+add_value(luaL_Buffer* b, const char* prefix, const char* name, const char* type, unsigned long long value) {
+	char line[256];
+	snprintf(line, sizeof( line ), "# TYPE %s_%s %s\n%s_%s %llu\n", prefix, name, type, prefix, name, value);
+	luaL_addstring(b, line);
+}
 
+//prometheus text format,ready to be served by httpd
+static int
+_stats_text(lua_State* L) {
+	levent_t* levent = ( levent_t* )lua_touserdata(L, 1);
+	const char* prefix = luaL_optstring(L, 2, "event");
+
+	luaL_Buffer b;
+	luaL_buffinit(L, &b);
+	add_value(&b, prefix, "buffers", "gauge", levent->live_buffers);
+	add_value(&b, prefix, "timers", "gauge", levent->live_timers);
+	add_value(&b, prefix, "listeners", "gauge", levent->live_listeners);
+
+	lstats_t* stats = levent->stats;
+	if ( stats ) {
+		char line[256];
+		add_value(&b, prefix, "iterations_total", "counter", stats->iterations);
+		add_value(&b, prefix, "read_bytes_total", "counter", stats->bytes_read);
+		add_value(&b, prefix, "written_bytes_total", "counter", stats->bytes_written);
+
+		snprintf(line, sizeof( line ), "# TYPE %s_iteration_seconds summary\n", prefix);
+		luaL_addstring(&b, line);
+		add_summary(&b, prefix, "iteration_seconds", "", &stats->iteration);
+
+		snprintf(line, sizeof( line ), "# TYPE %s_lag_seconds summary\n", prefix);
+		luaL_addstring(&b, line);
+		add_summary(&b, prefix, "lag_seconds", "", &stats->lag);
+
+		snprintf(line, sizeof( line ), "# TYPE %s_callback_seconds summary\n", prefix);
+		luaL_addstring(&b, line);
+		int i;
+		for ( i = 0; i < LUA_EV_MAX; i++ ) {
+			if ( stats->callback[i].count ) {
+				char label[64];
+				snprintf(label, sizeof( label ), "type=\"%s\"", EV_NAMES[i]);
+				add_summary(&b, prefix, "callback_seconds", label, &stats->callback[i]);
+			}
+		}
+	}
+	luaL_pushresult(&b);
 	return 1;
 }
 
@@ -771,20 +5136,136 @@ static int
 _dispatch(lua_State* L) {
 	levent_t* levent = ( levent_t* )lua_touserdata(L, 1);
 	struct event_base* ev_base = levent->ev_base;
+	//iteration time need one loop at a time,only paid while stats are on
+	while ( levent->stats ) {
+		int result = event_base_loop(ev_base, EVLOOP_ONCE);
+		lstats_t* stats = levent->stats;
+		if ( stats ) {
+			stats->iterations++;
+			if ( stats->iter_first ) {
+				histogram_record(&stats->iteration, stats->iter_last - stats->iter_first);
+				stats->iter_first = 0;
+			}
+		}
+		if ( result != 0 || event_base_got_break(ev_base) || event_base_got_exit(ev_base) ) {
+			lua_pushinteger(L, result);
+			return 1;
+		}
+	}
 	int result = event_base_dispatch(ev_base);
 	lua_pushinteger(L, result);
 	return 1;
 }
 
+static void
+_batch_free(levent_t* levent) {
+	lua_State* L = levent->L;
+	int i;
+	for ( i = 0; i < levent->batch_count; i++ ) {
+		luaL_unref(L, LUA_REGISTRYINDEX, levent->batch[i].ref);
+		luaL_unref(L, LUA_REGISTRYINDEX, levent->batch[i].arg);
+	}
+	event_free(levent->batch_ev);
+	free(levent->batch);
+	luaL_unref(L, LUA_REGISTRYINDEX, levent->batch_table);
+	levent->batch_ev = NULL;
+	levent->batch = NULL;
+	levent->batch_size = 0;
+	levent->batch_count = 0;
+	levent->batch_table = LUA_NOREF;
+}
+
+static int
+_batch(lua_State* L) {
+	levent_t* levent = ( levent_t* )lua_touserdata(L, 1);
+	int size = luaL_optinteger(L, 2, 1024);
+
+	if ( levent->batch ) {
+		batch_flush(levent);
+		_batch_free(levent);
+	}
+	if ( size <= 0 ) {
+		return 0;
+	}
+
+	levent->batch = malloc(sizeof( levbatch_t ) * size);
+	levent->batch_size = size;
+	levent->batch_count = 0;
+	levent->batch_ev = event_new(levent->ev_base, -1, 0, batch_timeout, levent);
+	lua_createtable(L, size * 3, 0);
+	levent->batch_table = luaL_ref(L, LUA_REGISTRYINDEX);
+	return 0;
+}
+
+static void
+worker_attach(levent_t* levent) {
+	lworker_t* worker = levent->worker;
+	struct event* ev = event_new(levent->ev_base, -1, EV_PERSIST, mail_arrive, levent);
+
+	MUTEX_LOCK(&worker->lock);
+	worker->mail_ev = ev;
+	MUTEX_UNLOCK(&worker->lock);
+
+	//pick up mail sent before this loop existed
+	event_active(ev, EV_READ, 1);
+}
+
+static void
+worker_detach(levent_t* levent) {
+	lworker_t* worker = levent->worker;
+
+	MUTEX_LOCK(&worker->lock);
+	struct event* ev = worker->mail_ev;
+	worker->mail_ev = NULL;
+	MUTEX_UNLOCK(&worker->lock);
+
+	event_free(ev);
+	levent->worker = NULL;
+}
+
 static int
 _release(lua_State* L) {
 	levent_t* levent = ( levent_t* )lua_touserdata(L, 1);
+	if ( levent->batch ) {
+		_batch_free(levent);
+	}
+	if ( levent->worker ) {
+		worker_detach(levent);
+	}
+	while ( levent->pins ) {
+		lpin_t* pin = levent->pins;
+		levent->pins = pin->next;
+		free(pin);
+	}
 	while ( levent->freelist ) {
 		levtimer_t* timer = levent->freelist;
 		levent->freelist = timer->next;
 		event_free(timer->ev);
 	}
+	if ( levent->stats ) {
+		stats_free(levent);
+	}
+	if ( levent->file_cache ) {
+		file_cache_free(levent->file_cache);
+		levent->file_cache = NULL;
+	}
+	if ( levent->sched ) {
+		sched_free(L, levent->sched);
+		levent->sched = NULL;
+	}
+	if ( levent->jobs ) {
+		job_detach(levent);
+	}
+	while ( levent->udp_lingering ) {
+		ludp_t* ludp = levent->udp_lingering;
+		levent->udp_lingering = ludp->next_lingering;
+		udp_destroy(ludp);
+	}
 	evdns_base_free(levent->dns_base, 1);
+	if ( levent->dns_cache ) {
+		dns_cache_free(levent->dns_cache);
+		levent->dns_cache = NULL;
+	}
 	event_base_free(levent->ev_base);
 	luaL_unref(L, LUA_REGISTRYINDEX, levent->ref);
 	return 0;
@@ -808,6 +5289,13 @@ _now(lua_State* L) {
 	return 1;
 }
 
+//monotonic microseconds,for measuring short intervals
+static int
+_clock(lua_State* L) {
+	lua_pushinteger(L, stats_clock());
+	return 1;
+}
+
 static int
 _sleepex(lua_State* L) {
 	levent_t* levent = ( levent_t* )lua_touserdata(L, 1);
@@ -816,6 +5304,88 @@ _sleepex(lua_State* L) {
 	return 0;
 }
 
+//options:avoid = { "select",... },edge_triggered,o1,early_close,no_cache_time,precise_timer,
+//epoll_changelist,ignore_env,priorities
+//locking stay on,worker mail and offloaded jobs need it
+static struct event_config*
+event_options(lua_State* L, int index, int* priorities) {
+	struct event_config* config = event_config_new();
+	if ( lua_type(L, index) != LUA_TTABLE ) {
+		return config;
+	}
+
+	lua_getfield(L, index, "avoid");
+	if ( lua_type(L, -1) == LUA_TTABLE ) {
+		int i;
+		for ( i = 1; lua_rawgeti(L, -1, i) == LUA_TSTRING; i++ ) {
+			event_config_avoid_method(config, lua_tostring(L, -1));
+			lua_pop(L, 1);
+		}
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+
+	static const struct { const char* name; int feature; } FEATURES[] = {
+		{ "edge_triggered", EV_FEATURE_ET },
+		{ "o1", EV_FEATURE_O1 },
+		{ "early_close", EV_FEATURE_EARLY_CLOSE },
+	};
+	static const struct { const char* name; int flag; } FLAGS[] = {
+		{ "no_cache_time", EVENT_BASE_FLAG_NO_CACHE_TIME },
+		{ "precise_timer", EVENT_BASE_FLAG_PRECISE_TIMER },
+		{ "epoll_changelist", EVENT_BASE_FLAG_EPOLL_USE_CHANGELIST },
+		{ "ignore_env", EVENT_BASE_FLAG_IGNORE_ENV },
+#ifdef _WIN32
+		{ "iocp", EVENT_BASE_FLAG_STARTUP_IOCP },
+#endif
+	};
+	int features = 0;
+	int flags = 0;
+	size_t i;
+	for ( i = 0; i < sizeof( FEATURES ) / sizeof( FEATURES[0] ); i++ ) {
+		lua_getfield(L, index, FEATURES[i].name);
+		if ( lua_toboolean(L, -1) ) {
+			features |= FEATURES[i].feature;
+		}
+		lua_pop(L, 1);
+	}
+	for ( i = 0; i < sizeof( FLAGS ) / sizeof( FLAGS[0] ); i++ ) {
+		lua_getfield(L, index, FLAGS[i].name);
+		if ( lua_toboolean(L, -1) ) {
+			flags |= FLAGS[i].flag;
+		}
+		lua_pop(L, 1);
+	}
+	event_config_require_features(config, features);
+	event_config_set_flag(config, flags);
+
+	lua_getfield(L, index, "priorities");
+	*priorities = luaL_optinteger(L, -1, 1);
+	lua_pop(L, 1);
+	if ( *priorities < 1 || *priorities > EVENT_MAX_PRIORITIES ) {
+		event_config_free(config);
+		luaL_error(L, "priorities must be in [1,%d]", EVENT_MAX_PRIORITIES);
+	}
+	return config;
+}
+
+//backend method,its features and the priority count
+static int
+_backend(lua_State* L) {
+	levent_t* levent = ( levent_t* )lua_touserdata(L, 1);
+	int features = event_base_get_features(levent->ev_base);
+	lua_pushstring(L, event_base_get_method(levent->ev_base));
+	lua_createtable(L, 0, 3);
+	lua_pushboolean(L, features & EV_FEATURE_ET);
+	lua_setfield(L, -2, "edge_triggered");
+	lua_pushboolean(L, features & EV_FEATURE_O1);
+	lua_setfield(L, -2, "o1");
+	lua_pushboolean(L, features & EV_FEATURE_EARLY_CLOSE);
+	lua_setfield(L, -2, "early_close");
+	lua_pushinteger(L, levent->priorities);
+	return 3;
+}
+
 static int
 _event_new(lua_State* L) {
 #ifdef _WIN32
@@ -823,20 +5393,242 @@ _event_new(lua_State* L) {
 	WSAStartup(0x0201, &wsa_data);
 #endif
 
+	luaL_checktype(L, 1, LUA_TFUNCTION);
+	int priorities = 1;
+	struct event_config* config = event_options(L, 2, &priorities);
+	struct event_base* ev_base = event_base_new_with_config(config);
+	event_config_free(config);
+	if ( !ev_base ) {
+		luaL_error(L, "no event backend match the options");
+	}
+	//must happen before any event is added,dns below add its own
+	if ( priorities > 1 && event_base_priority_init(ev_base, priorities) < 0 ) {
+		event_base_free(ev_base);
+		luaL_error(L, "priority init failed:%d", priorities);
+	}
+
+	lua_settop(L, 1);
 	int callback = luaL_ref(L, LUA_REGISTRYINDEX);
 	levent_t* levent = lua_newuserdata(L, sizeof( *levent ));
-	levent->ev_base = event_base_new();
+	levent->ev_base = ev_base;
+	levent->priorities = priorities;
 	levent->dns_base = evdns_base_new(levent->ev_base, EVDNS_BASE_INITIALIZE_NAMESERVERS);
 	levent->L = L;
 	levent->callback = callback;
 	levent->freelist = NULL;
+	levent->batch_ev = NULL;
+	levent->batch = NULL;
+	levent->batch_size = 0;
+	levent->batch_count = 0;
+	levent->batch_table = LUA_NOREF;
+	levent->worker = NULL;
+	levent->pins = NULL;
+	levent->dns_cache = NULL;
+	levent->stats = NULL;
+	levent->file_cache = NULL;
+	levent->sched = NULL;
+	levent->jobs = NULL;
+	levent->udp_lingering = NULL;
+	levent->live_buffers = 0;
+	levent->live_timers = 0;
+	levent->live_listeners = 0;
 	levent->ref = _meta_init(L, META_EVENT);
 
+	lua_getfield(L, LUA_REGISTRYINDEX, WORKER_KEY);
+	lworker_t* worker = lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	if ( worker && !worker->mail_ev ) {
+		levent->worker = worker;
+		worker_attach(levent);
+	}
+
+	return 1;
+}
+
+static THREAD_PROC
+worker_main(void* ud) {
+	lworker_t* worker = ud;
+	lua_State* L = luaL_newstate();
+	luaL_openlibs(L);
+
+	lua_pushlightuserdata(L, worker);
+	lua_setfield(L, LUA_REGISTRYINDEX, WORKER_KEY);
+
+	lua_getglobal(L, "package");
+	lua_pushstring(L, WORKERS->path);
+	lua_setfield(L, -2, "path");
+	lua_pushstring(L, WORKERS->cpath);
+	lua_setfield(L, -2, "cpath");
+	lua_pop(L, 1);
+
+	MUTEX_LOCK(&WORKERS->lock);
+	int count = WORKERS->count;
+	MUTEX_UNLOCK(&WORKERS->lock);
+
+	if ( luaL_loadfile(L, WORKERS->script) != LUA_OK ) {
+		fprintf(stderr, "worker %d:%s\n", worker->id, lua_tostring(L, -1));
+	}
+	else {
+		lua_pushinteger(L, worker->id);
+		lua_pushinteger(L, count);
+		if ( lua_pcall(L, 2, 0, 0) != LUA_OK ) {
+			fprintf(stderr, "worker %d:%s\n", worker->id, lua_tostring(L, -1));
+		}
+	}
+	lua_close(L);
+	return 0;
+}
+
+static char*
+_package_field(lua_State* L, const char* field) {
+	lua_getglobal(L, "package");
+	lua_getfield(L, -1, field);
+	size_t size;
+	const char* str = luaL_checklstring(L, -1, &size);
+	char* result = malloc(size + 1);
+	memcpy(result, str, size + 1);
+	lua_pop(L, 2);
+	return result;
+}
+
+//start n threads,each run script(id,n) in its own lua_State and event loop
+static int
+_spawn_workers(lua_State* L) {
+	int count = luaL_checkinteger(L, 1);
+	size_t size;
+	const char* script = luaL_checklstring(L, 2, &size);
+	if ( WORKERS ) {
+		luaL_error(L, "workers already spawned");
+	}
+	luaL_argcheck(L, count > 0, 1, "worker count must be positive");
+
+	lworker_group_t* group = malloc(sizeof( *group ));
+	group->count = count;
+	group->workers = malloc(sizeof( lworker_t ) * count);
+	group->script = malloc(size + 1);
+	memcpy(group->script, script, size + 1);
+	group->path = _package_field(L, "path");
+	group->cpath = _package_field(L, "cpath");
+	MUTEX_INIT(&group->lock);
+
+	int i;
+	for ( i = 0; i < count; i++ ) {
+		lworker_t* worker = &group->workers[i];
+		worker->id = i + 1;
+		worker->mailbox = NULL;
+		worker->mail_ev = NULL;
+		MUTEX_INIT(&worker->lock);
+	}
+	WORKERS = group;
+
+	//workers started early wait here for the final count
+	MUTEX_LOCK(&group->lock);
+	int started = 0;
+	for ( i = 0; i < count; i++ ) {
+		if ( THREAD_CREATE(&group->workers[i].thread, worker_main, &group->workers[i]) ) {
+			started++;
+		}
+		else {
+			break;
+		}
+	}
+	group->count = started;
+	MUTEX_UNLOCK(&group->lock);
+
+	lua_pushinteger(L, started);
+	return 1;
+}
+
+static int
+_join_workers(lua_State* L) {
+	lworker_group_t* group = WORKERS;
+	if ( !group ) {
+		return 0;
+	}
+	int i;
+	for ( i = 0; i < group->count; i++ ) {
+		THREAD_JOIN(group->workers[i].thread);
+	}
+
+	WORKERS = NULL;
+	for ( i = 0; i < group->count; i++ ) {
+		lworker_t* worker = &group->workers[i];
+		while ( worker->mailbox ) {
+			lmail_t* mail = worker->mailbox;
+			worker->mailbox = mail->next;
+			free(mail);
+		}
+		MUTEX_FREE(&worker->lock);
+	}
+	MUTEX_FREE(&group->lock);
+	free(group->workers);
+	free(group->script);
+	free(group->path);
+	free(group->cpath);
+	free(group);
+	return 0;
+}
+
+static int
+_worker_id(lua_State* L) {
+	lua_getfield(L, LUA_REGISTRYINDEX, WORKER_KEY);
+	lworker_t* worker = lua_touserdata(L, -1);
+	lua_pushinteger(L, worker ? worker->id : 0);
+	return 1;
+}
+
+static int
+_worker_send(lua_State* L) {
+	int id = luaL_checkinteger(L, 1);
+	size_t size;
+	const char* data = luaL_checklstring(L, 2, &size);
+	lworker_group_t* group = WORKERS;
+	int count = 0;
+	if ( group ) {
+		MUTEX_LOCK(&group->lock);
+		count = group->count;
+		MUTEX_UNLOCK(&group->lock);
+	}
+	if ( id < 1 || id > count ) {
+		luaL_error(L, "no such worker:%d", id);
+	}
+	lworker_t* worker = &group->workers[id - 1];
+
+	lua_getfield(L, LUA_REGISTRYINDEX, WORKER_KEY);
+	lworker_t* self = lua_touserdata(L, -1);
+	lua_pop(L, 1);
+
+	lmail_t* mail = malloc(sizeof( *mail ) + size);
+	mail->source = self ? self->id : 0;
+	mail->size = size;
+	memcpy(mail->data, data, size);
+
+	lmail_t* head;
+	do {
+		head = worker->mailbox;
+		mail->next = head;
+	} while ( !ATOM_CAS_POINTER(&worker->mailbox, head, mail) );
+
+	//only the push onto an empty mailbox has to wake the receiver
+	if ( head == NULL ) {
+		MUTEX_LOCK(&worker->lock);
+		if ( worker->mail_ev ) {
+			event_active(worker->mail_ev, EV_READ, 1);
+		}
+		MUTEX_UNLOCK(&worker->lock);
+	}
+
+	lua_pushboolean(L, 1);
 	return 1;
 }
 
 EXPORT int
 luaopen_event_core(lua_State* L) {
+	//bases are lockable,so worker mail and pool threads can event_active them
+	EVTHREAD_INIT();
+
+	job_register_builtin();
+
 	luaL_newmetatable(L, META_EVENT);
 	const luaL_Reg meta_event[] = {
 		{ "listen", _listen },
@@ -845,10 +5637,30 @@ luaopen_event_core(lua_State* L) {
 		{ "bind", _bind },
 		{ "httpd", _httpd },
 		{ "dns", _dns },
+		{ "dns_cache", _dns_cache },
+		{ "dns_stats", _dns_stats },
+		{ "batch", _batch },
+		{ "wheel", _wheel },
+		{ "rate_group", _rate_group },
+		{ "udp", _udp },
+		{ "pool", _pool },
+		{ "stats_enable", _stats_enable },
+		{ "stats", _stats },
+		{ "stats_text", _stats_text },
+		{ "file_cache", _file_cache },
+		{ "fork", _fork },
+		{ "wakeup", _wakeup },
+		{ "wait", _wait },
+		{ "run", _sched_run },
+		{ "co_stats", _sched_stats },
+		{ "co_clean", _sched_clean },
+		{ "submit", _submit },
+		{ "job_stats", _job_stats },
 		{ "breakout", _break },
 		{ "dispatch", _dispatch },
 		{ "release", _release },
 		{ "now", _now },
+		{ "backend", _backend },
 		{ "sleep", _sleepex },
 		{ NULL, NULL },
 	};
@@ -859,9 +5671,24 @@ luaopen_event_core(lua_State* L) {
 	luaL_newmetatable(L, META_EVBUFFER);
 	const luaL_Reg meta_buffer[] = {
 		{ "write", _bufferevent_write },
+		{ "writev", _bufferevent_writev },
 		{ "read", _bufferevent_read },
 		{ "read_line", _bufferevent_read_line },
+		{ "peek", _bufferevent_peek },
+		{ "slice", _bufferevent_slice },
+		{ "consume", _bufferevent_consume },
+		{ "input_size", _bufferevent_input_size },
+		{ "frame", _bufferevent_frame },
+		{ "set_watermark", _bufferevent_set_watermark },
+		{ "output_size", _bufferevent_output_size },
+		{ "wait_writable", _bufferevent_wait_writable },
+		{ "send_file", _bufferevent_send_file },
+		{ "rate_limit", _bufferevent_rate_limit },
+		{ "rate_stats", _bufferevent_rate_stats },
+		{ "join_group", _bufferevent_join_group },
+		{ "leave_group", _bufferevent_leave_group },
 		{ "alive", _bufferevent_alive },
+		{ "priority", _bufferevent_priority },
 		{ "close", _bufferevent_close },
 		{ NULL, NULL },
 	};
@@ -879,6 +5706,57 @@ luaopen_event_core(lua_State* L) {
 	lua_setfield(L, -2, "__index");
 	lua_pop(L, 1);
 
+	luaL_newmetatable(L, META_WHEEL);
+	const luaL_Reg meta_wheel[] = {
+		{ "add", _wheel_add },
+		{ "cancel", _wheel_cancel },
+		{ "size", _wheel_size },
+		{ "release", _wheel_release },
+		{ "alive", _wheel_alive },
+		{ NULL, NULL },
+	};
+	luaL_newlib(L, meta_wheel);
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+
+	luaL_newmetatable(L, META_RATE_GROUP);
+	const luaL_Reg meta_rate_group[] = {
+		{ "set", _rate_group_set },
+		{ "min_share", _rate_group_min_share },
+		{ "totals", _rate_group_totals },
+		{ "reset", _rate_group_reset },
+		{ "release", _rate_group_release },
+		{ "alive", _rate_group_alive },
+		{ NULL, NULL },
+	};
+	luaL_newlib(L, meta_rate_group);
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+
+	luaL_newmetatable(L, META_UDP);
+	const luaL_Reg meta_udp[] = {
+		{ "send", _udp_send },
+		{ "close", _udp_close },
+		{ "alive", _udp_alive },
+		{ NULL, NULL },
+	};
+	luaL_newlib(L, meta_udp);
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+
+	luaL_newmetatable(L, META_POOL);
+	const luaL_Reg meta_pool[] = {
+		{ "checkout", _pool_checkout },
+		{ "checkin", _pool_checkin },
+		{ "stats", _pool_stats },
+		{ "release", _pool_release },
+		{ "alive", _pool_alive },
+		{ NULL, NULL },
+	};
+	luaL_newlib(L, meta_pool);
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+
 	luaL_newmetatable(L, META_LISTENER);
 	const luaL_Reg meta_listener[] = {
 		{ "close", _listen_close },
@@ -893,6 +5771,14 @@ luaopen_event_core(lua_State* L) {
 	const luaL_Reg meta_request[] = {
 		{ "reply", _reply_send },
 		{ "set_header", _reply_set_header },
+		{ "reply_file", _reply_file },
+		{ "reply_start", _reply_start },
+		{ "reply_chunk", _reply_chunk },
+		{ "reply_end", _reply_end },
+		{ "pending", _reply_pending },
+		{ "body", _request_body },
+		{ "body_view", _request_body_view },
+		{ "peer", _request_peer },
 		{ NULL, NULL },
 	};
 	luaL_newlib(L, meta_request);
@@ -903,6 +5789,8 @@ luaopen_event_core(lua_State* L) {
 	const luaL_Reg meta_http[] = {
 		{ "close", _httpd_close },
 		{ "alive", _httpd_alive },
+		{ "lazy_body", _httpd_lazy_body },
+		{ "max_body", _httpd_max_body },
 		{ NULL, NULL },
 	};
 	luaL_newlib(L, meta_http);
@@ -911,6 +5799,14 @@ luaopen_event_core(lua_State* L) {
 
 	const luaL_Reg l[] = {
 		{ "new", _event_new },
+		{ "clock", _clock },
+		{ "spawn_workers", _spawn_workers },
+		{ "join_workers", _join_workers },
+		{ "worker_id", _worker_id },
+		{ "send", _worker_send },
+		{ "offload", _offload },
+		{ "offload_stop", _offload_stop },
+		{ "register_job", _register_job },
 		{ NULL, NULL },
 	};
 	luaL_newlib(L, l);
@@ -0,0 +1,269 @@
+--loopback benchmark for event.core
+--lua bench_net.lua [threads] [conns,...] [seconds] [sizes,...] [address]
+--address is ip:port(default 127.0.0.1:18600) or unix:/path,the rpc server use port+1 or path.rpc
+--echo and rpc servers run in this thread,clients run on worker threads with their own loops
+local event = require "event"
+
+local _worker_id = event.worker_id()
+
+local function printf(fmt,...)
+	print(string.format(fmt,...))
+end
+
+local function split(str)
+	local list = {}
+	for item in string.gmatch(str,"[^,]+") do
+		table.insert(list,tonumber(item))
+	end
+	return list
+end
+
+local function addresses(address)
+	if address:sub(1,5) == "unix:" then
+		return address,nil,address .. ".rpc",nil
+	end
+	local ip,port = address:match("^(.+):(%d+)$")
+	port = tonumber(port)
+	return ip,port,ip,port + 1
+end
+
+--latency histogram keyed by microseconds,exact below 32us then 5 significant bits
+local function bucket(us)
+	if us < 32 then
+		return us
+	end
+	local shift = 0
+	local v = us
+	while v >= 32 do
+		v = v >> 1
+		shift = shift + 1
+	end
+	return v << shift
+end
+
+local function quantile(hist,total,q)
+	local keys = {}
+	for k in pairs(hist) do
+		table.insert(keys,k)
+	end
+	table.sort(keys)
+	local rank = math.ceil(total * q)
+	local seen = 0
+	for _,k in ipairs(keys) do
+		seen = seen + hist[k]
+		if seen >= rank then
+			return k
+		end
+	end
+	return keys[#keys] or 0
+end
+
+--echo server:whatever arrive go straight back
+local echo_server = event.channel:inherit()
+
+function echo_server:data()
+	local data = self:read()
+	if data then
+		self:write(data)
+	end
+end
+
+--echo client:one request in flight,wait until the whole payload is back
+local echo_client = event.channel:inherit()
+
+function echo_client:data()
+	if not self.need then
+		return
+	end
+	local size = math.min(self.need,self.channel_buff:input_size())
+	self.channel_buff:consume(size)
+	self.need = self.need - size
+	if self.need == 0 then
+		local session = self.session
+		self.session = nil
+		self.need = nil
+		event.wakeup(session,true)
+	end
+end
+
+function echo_client:disconnect()
+	if self.session then
+		local session = self.session
+		self.session = nil
+		event.wakeup(session,false,"channel closed")
+	end
+end
+
+function echo_client:request(payload)
+	self.session = event.gen_session()
+	self.need = #payload
+	self:write(payload)
+	return event.wait(self.session)
+end
+
+--rpc server:bench.echo return its argument,bench.ready/report drive the rounds
+local rpc_server = event.channel:inherit()
+
+local _control = {}
+
+function rpc_server:dispatch(file,method,...)
+	if method == "echo" then
+		return ...
+	end
+	return _control[method](...)
+end
+
+local function run_client(config,scenario,ip,port,rpc_ip,rpc_port)
+	local clients = {}
+	for i = 1,scenario.conns do
+		local client
+		if scenario.mode == "echo" then
+			client = event.connect(ip,port,echo_client)
+		else
+			client = event.connect(rpc_ip,rpc_port)
+		end
+		assert(client,"connect failed")
+		clients[i] = client
+	end
+
+	local payload = string.rep("x",scenario.size)
+	local result = {requests = 0,bytes = 0,errors = 0,hist = {}}
+	local hist = result.hist
+	local deadline = event.now() + config.seconds * 1000
+	local running = scenario.conns
+	local done = event.gen_session()
+
+	for _,client in ipairs(clients) do
+		event.fork(function ()
+			while event.now() < deadline do
+				local start = event.clock()
+				local ok
+				if scenario.mode == "echo" then
+					ok = client:request(payload)
+				else
+					ok = pcall(client.call,client,"bench","echo",payload)
+				end
+				if not ok then
+					result.errors = result.errors + 1
+					break
+				end
+				local us = bucket(event.clock() - start)
+				hist[us] = ( hist[us] or 0 ) + 1
+				result.requests = result.requests + 1
+				result.bytes = result.bytes + scenario.size * 2
+			end
+			running = running - 1
+			if running == 0 then
+				event.wakeup(done)
+			end
+		end)
+	end
+	event.wait(done)
+
+	for _,client in ipairs(clients) do
+		client:close()
+	end
+	return result
+end
+
+if _worker_id > 0 then
+	--client thread,the config come by mail once this loop exist
+	event.mail(function (source,config)
+		event.fork(function ()
+			local ip,port,rpc_ip,rpc_port = addresses(config.address)
+			local control = assert(event.connect(rpc_ip,rpc_port),"control connect failed")
+			while true do
+				local scenario = control:call("bench","ready",_worker_id)
+				if not scenario then
+					break
+				end
+				local result = run_client(config,scenario,ip,port,rpc_ip,rpc_port)
+				control:call("bench","report",_worker_id,result)
+			end
+			control:close()
+			event.breakout()
+		end)
+	end)
+	event.dispatch()
+	return
+end
+
+local args = {...}
+local config = {
+	threads = tonumber(args[1]) or 2,
+	conns = split(args[2] or "1,16"),
+	seconds = tonumber(args[3]) or 2,
+	sizes = split(args[4] or "64,1024,16384"),
+	address = args[5] or "127.0.0.1:18600",
+}
+
+local scenarios = {}
+for _,mode in ipairs({"echo","rpc"}) do
+	for _,conns in ipairs(config.conns) do
+		for _,size in ipairs(config.sizes) do
+			table.insert(scenarios,{mode = mode,conns = conns,size = size})
+		end
+	end
+end
+
+local ip,port,rpc_ip,rpc_port = addresses(config.address)
+assert(event.listen(ip,port,function () end,echo_server,false),"echo listen failed")
+assert(event.listen(rpc_ip,rpc_port,function () end,rpc_server,false),"rpc listen failed")
+
+--every client thread wait in ready until all of them are there,then the round start together
+local round = 1
+local arrived = {}
+local reports = {}
+
+function _control.ready(id)
+	local session = event.gen_session()
+	table.insert(arrived,session)
+	if #arrived == config.threads then
+		local list = arrived
+		arrived = {}
+		for _,s in ipairs(list) do
+			event.wakeup(s)
+		end
+	end
+	event.wait(session)
+	return scenarios[round]
+end
+
+function _control.report(id,result)
+	table.insert(reports,result)
+	if #reports < config.threads then
+		return
+	end
+
+	local scenario = scenarios[round]
+	local requests,bytes,errors,hist = 0,0,0,{}
+	for _,r in ipairs(reports) do
+		requests = requests + r.requests
+		bytes = bytes + r.bytes
+		errors = errors + r.errors
+		for k,n in pairs(r.hist) do
+			hist[k] = ( hist[k] or 0 ) + n
+		end
+	end
+	reports = {}
+	printf("%-4s size=%-6d conns=%-5d req/s=%-9.0f MB/s=%-8.2f p50=%-6dus p99=%-6dus p999=%-6dus errors=%d",
+		scenario.mode,scenario.size,scenario.conns * config.threads,
+		requests / config.seconds,bytes / config.seconds / 1048576,
+		quantile(hist,requests,0.5),quantile(hist,requests,0.99),quantile(hist,requests,0.999),errors)
+
+	round = round + 1
+	if round > #scenarios then
+		event.timer(0.1,function (timer)
+			timer:cancel()
+			event.breakout()
+		end)
+	end
+end
+
+printf("threads=%d seconds=%d address=%s",config.threads,config.seconds,config.address)
+config.threads = event.spawn_workers(config.threads,arg[0])
+for id = 1,config.threads do
+	event.send_worker(id,config)
+end
+event.dispatch()
+event.join_workers()
@@ -0,0 +1,201 @@
+--loopback echo benchmark for socket.core,the libevent backend against io_uring
+--lua bench_socket.lua [conns,...] [seconds] [sizes,...] [port] [backends,...]
+--echo server and clients share one loop,a backend that fall back to another is reported as skipped
+local core = require "socket.core"
+
+local LUA_EV_ERROR = 0
+local LUA_EV_ACCEPT = 2
+local LUA_EV_CONNECT = 3
+local LUA_EV_DATA = 4
+local LUA_EV_WRITABLE = 10
+
+--connects in flight at once,the listen backlog is small
+local CONNECT_BATCH = 8
+
+local function printf(fmt,...)
+	print(string.format(fmt,...))
+end
+
+local function split(str,convert)
+	local list = {}
+	for item in string.gmatch(str,"[^,]+") do
+		table.insert(list,convert and convert(item) or item)
+	end
+	return list
+end
+
+--latency histogram keyed by microseconds,exact below 32us then 5 significant bits
+local function bucket(us)
+	if us < 32 then
+		return us
+	end
+	local shift = 0
+	local v = us
+	while v >= 32 do
+		v = v >> 1
+		shift = shift + 1
+	end
+	return v << shift
+end
+
+local function quantile(hist,total,q)
+	local keys = {}
+	for k in pairs(hist) do
+		table.insert(keys,k)
+	end
+	table.sort(keys)
+	local rank = math.ceil(total * q)
+	local seen = 0
+	for _,k in ipairs(keys) do
+		seen = seen + hist[k]
+		if seen >= rank then
+			return k
+		end
+	end
+	return keys[#keys] or 0
+end
+
+--one request in flight per client,the next goes once the whole payload is back
+local function run(backend,scenario,config)
+	local loop
+	local payload = string.rep("x",scenario.size)
+	local clients = {}
+	local result = {requests = 0,bytes = 0,errors = 0,hist = {}}
+	local hist = result.hist
+	local opened = 0
+	local running = 0
+	local deadline
+
+	local function finish(client)
+		if client.done then
+			return
+		end
+		client.done = true
+		running = running - 1
+		if running == 0 then
+			loop:breakout()
+		end
+	end
+
+	local function request(client)
+		if loop:now() >= deadline then
+			finish(client)
+			return
+		end
+		client.start = core.clock()
+		client.need = scenario.size
+		if not client.session:write(payload) then
+			result.errors = result.errors + 1
+			finish(client)
+		end
+	end
+
+	local function open()
+		if opened == scenario.conns then
+			return
+		end
+		opened = opened + 1
+		local session,connected = loop:connect("127.0.0.1",config.port)
+		assert(session,connected)
+		local client = {session = session}
+		clients[session] = client
+		running = running + 1
+		if connected then
+			request(client)
+		end
+	end
+
+	local handler = {}
+
+	handler[LUA_EV_ACCEPT] = function (listener,session,addr)
+		open()
+	end
+
+	handler[LUA_EV_CONNECT] = function (session,ok,err)
+		local client = clients[session]
+		if not ok then
+			result.errors = result.errors + 1
+			finish(client)
+			return
+		end
+		request(client)
+	end
+
+	handler[LUA_EV_DATA] = function (session)
+		local client = clients[session]
+		if not client then
+			--echo server:whatever arrive go straight back in one write,
+			--writes split per chunk would meet nagle on the libevent backend
+			local data,size = session:peek(session:input_size())
+			session:write(data,size)
+			session:consume(size)
+			return
+		end
+		local size = math.min(client.need,session:input_size())
+		session:consume(size)
+		client.need = client.need - size
+		if client.need == 0 then
+			local us = bucket(core.clock() - client.start)
+			hist[us] = ( hist[us] or 0 ) + 1
+			result.requests = result.requests + 1
+			result.bytes = result.bytes + scenario.size * 2
+			request(client)
+		end
+	end
+
+	handler[LUA_EV_WRITABLE] = function (session)
+	end
+
+	handler[LUA_EV_ERROR] = function (session)
+		local client = clients[session]
+		if client and not client.done then
+			result.errors = result.errors + 1
+			finish(client)
+		end
+	end
+
+	loop = core.new(function (ev,...)
+		handler[ev](...)
+	end,backend)
+	if loop:backend() ~= backend then
+		loop:release()
+		return
+	end
+	assert(loop:listen("127.0.0.1",config.port))
+
+	local start = core.clock()
+	deadline = loop:now() + config.seconds
+	for i = 1,math.min(CONNECT_BATCH,scenario.conns) do
+		open()
+	end
+	loop:dispatch()
+	result.elapsed = ( core.clock() - start ) / 1000000
+	loop:release()
+	return result
+end
+
+local args = {...}
+local config = {
+	conns = split(args[1] or "1,16,64",tonumber),
+	seconds = tonumber(args[2]) or 2,
+	sizes = split(args[3] or "64,1024,16384",tonumber),
+	port = tonumber(args[4]) or 18610,
+	backends = split(args[5] or "event,uring"),
+}
+
+printf("seconds=%g port=%d",config.seconds,config.port)
+for _,conns in ipairs(config.conns) do
+	for _,size in ipairs(config.sizes) do
+		for _,backend in ipairs(config.backends) do
+			local scenario = {conns = conns,size = size}
+			local r = run(backend,scenario,config)
+			if not r then
+				printf("%-6s size=%-6d conns=%-5d skipped,not supported here",backend,size,conns)
+			else
+				printf("%-6s size=%-6d conns=%-5d req/s=%-9.0f MB/s=%-8.2f p50=%-6dus p99=%-6dus p999=%-6dus errors=%d",
+					backend,size,conns,r.requests / r.elapsed,r.bytes / r.elapsed / 1048576,
+					quantile(r.hist,r.requests,0.5),quantile(r.hist,r.requests,0.99),quantile(r.hist,r.requests,0.999),r.errors)
+			end
+		end
+	end
+end
@@ -1,4 +1,4 @@
-local event_core = require "event.core"
+﻿local event_core = require "event.core"
 local serialize = require "serialize"
 
 table.encode = table.encode or serialize.pack
@@ -6,11 +6,6 @@ table.decode = table.decode or serialize.unpack
 
 local _event
 
-local _co_pool = {}
-local _fork_queue = {}
-local _wakeup_queue = {}
-local _wait_co = {}
-
 local _session = 1
 local _main_co = coroutine.running()
 
@@ -21,12 +16,25 @@ local EV_CONNECT = 3
 local EV_DATA = 4
 local EV_HTTP = 5
 local EV_DNS = 6
+local EV_BATCH = 7
+local EV_MAIL = 8
+local EV_EXPIRE = 9
+local EV_WRITABLE = 10
+local EV_UDP = 11
+local EV_JOB = 12
 
 local _listener_ctx = setmetatable({},{__mode = "k"})
 local _channel_ctx = setmetatable({},{__mode = "k"})
 local _timer_ctx = setmetatable({},{__mode = "k"})
 local _httpd_ctx = setmetatable({},{__mode = "k"})
 local _dns_ctx = setmetatable({},{__mode = "k"})
+local _rate_group_ctx = setmetatable({},{__mode = "k"})
+local _udp_ctx = setmetatable({},{__mode = "k"})
+local _pool_ctx = setmetatable({},{__mode = "k"})
+local _mail_callback
+local _offload_started
+local _wheel
+local _wheel_ctx = {}
 
 local _M = {}
 
@@ -85,11 +93,44 @@ function channel:read_line()
 	return self.channel_buff:read_line()
 end
 
+function channel:peek(num)
+	return self.channel_buff:peek(num)
+end
+
+function channel:consume(num)
+	return self.channel_buff:consume(num)
+end
+
 function channel:dispatch(file,method,...)
 	print(file,method,...)
 end
 
-function channel:data()
+function channel:message(message)
+	if message.ret then
+		_M.wakeup(message.session,message.ok,table.unpack(message.args))
+		self.session_ctx[message.session] = nil
+	else
+		_M.fork(function ()
+			local result = {xpcall(self.dispatch,debug.traceback,self,message.file,message.method,table.unpack(message.args))}
+			if not result[1] then
+				if message.session ~= 0 then
+					self:ret(message.session,false,result[2])
+				end
+			else
+				self:ret(message.session,true,table.unpack(result,2))
+			end
+		end)
+	end
+end
+
+function channel:data(frames)
+	if frames then
+		for _,data in ipairs(frames) do
+			self:message(table.decode(data))
+		end
+		return
+	end
+
 	while true do
 		if self.state == STATE.HEAD then
 			local data = self:read(self.need)
@@ -107,22 +148,7 @@ function channel:data()
 			if data then
 				self.need = self.head
 				self.state = STATE.HEAD
-				local message = table.decode(data)
-				if message.ret then
-					_M.wakeup(message.session,message.ok,table.unpack(message.args))
-					self.session_ctx[message.session] = nil
-				else
-					_M.fork(function ()
-						local result = {xpcall(self.dispatch,debug.traceback,self,message.file,message.method,table.unpack(message.args))}
-						if not result[1] then
-							if message.session ~= 0 then
-								self:ret(message.session,false,result[2])
-							end
-						else
-							self:ret(message.session,true,table.unpack(result,2))
-						end
-					end)
-				end
+				self:message(table.decode(data))
 			else
 				break
 			end
@@ -130,28 +156,75 @@ function channel:data()
 	end
 end
 
-local function pack_table(channel_obj,tbl)
+local _head_fmt = {}
+
+--frame header and body go out as two parts,large bodies are pinned instead of copied
+local function write_table(channel_obj,tbl)
 	local str = table.encode(tbl)
-	local pat = string.format("I%dc%d",channel_obj.head,str:len())
-	return string.pack(pat,str:len()+channel_obj.head,str)
+	local fmt = _head_fmt[channel_obj.head]
+	if not fmt then
+		fmt = string.format("I%d",channel_obj.head)
+		_head_fmt[channel_obj.head] = fmt
+	end
+	channel_obj:writev({string.pack(fmt,str:len()+channel_obj.head),str})
+end
+
+--suspend the writing coroutine while output is above channel.write_high
+function channel:drain()
+	if not self.write_high or coroutine.running() == _main_co then
+		return
+	end
+	if self.channel_buff:wait_writable() then
+		local session = _M.gen_session()
+		self.session_ctx[session] = true
+		self.write_waiters = self.write_waiters or {}
+		table.insert(self.write_waiters,session)
+		local ok,err = _M.wait(session)
+		if not ok then
+			error(err)
+		end
+	end
+end
+
+function channel:writable()
+	local waiters = self.write_waiters
+	if not waiters then
+		return
+	end
+	self.write_waiters = nil
+	for _,session in ipairs(waiters) do
+		self.session_ctx[session] = nil
+		_M.wakeup(session,true)
+	end
 end
 
 function channel:write(str)
-	--FIXME
-	self.channel_buff:write(str)
+	self.channel_buff:write(str,true)
+	self:drain()
+end
+
+function channel:writev(list)
+	self.channel_buff:writev(list,true)
+	self:drain()
+end
+
+--path or fd,the file goes to the socket without passing through lua
+function channel:send_file(file,offset,length)
+	local ok,err = self.channel_buff:send_file(file,offset,length)
+	if ok then
+		self:drain()
+	end
+	return ok,err
 end
 
 function channel:send(file,method,...)
-	local str = pack_table(self,{file = file,method = method,session = 0,args = {...}})
-	self:write(str)
+	write_table(self,{file = file,method = method,session = 0,args = {...}})
 end
 
 function channel:call(file,method,...)
 	local session = _M.gen_session()
 	self.session_ctx[session] = true
-	local str = pack_table(self,{file = file,method = method,session = session,args = {...}})
-
-	self:write(str)
+	write_table(self,{file = file,method = method,session = session,args = {...}})
 
 	local result = {_M.wait(session)}
 
@@ -162,8 +235,12 @@ function channel:call(file,method,...)
 end
 
 function channel:ret(session,ok,...)
-	local str = pack_table(self,{ret = true,ok = ok,session = session,args = {...}})
-	self:write(str)
+	write_table(self,{ret = true,ok = ok,session = session,args = {...}})
+end
+
+--0 is served first,nil just return the current priority
+function channel:priority(priority)
+	return self.channel_buff:priority(priority)
 end
 
 function channel:close()
@@ -176,69 +253,36 @@ end
 
 _M.channel = channel
 
-local function co_create(func)
-	local co = table.remove(_co_pool)
-	if co == nil then
-		co = coroutine.create(function(...)
-			func(...)
-			while true do
-				func = nil
-				_co_pool[#_co_pool+1] = co
-				func = coroutine.yield(_M.CO_STATE.EXIT)
-				func(coroutine.yield())
-			end
-		end)
-	else
-		coroutine.resume(co, func)
+--"unix:/path" names a unix domain socket("unix:@name" in the abstract namespace),
+--anything else is an ipv4 or ipv6 address and port
+local function make_addr(ip,port)
+	if type(ip) == "string" and ip:sub(1,5) == "unix:" then
+		return {file = ip:sub(6)}
 	end
-	return co
-end
-
-local function co_monitor(co,ok,state,session)
-	if ok then
-		if state == _M.CO_STATE.WAIT then
-			_wait_co[session] = co
-		else
-			assert(state == _M.CO_STATE.EXIT)
-		end
-	else
-		io.stderr:write(debug.traceback(co,tostring(state)))
-	end
-end
-
-local function run_fork()
-	for i,info in ipairs(_fork_queue) do
-		_fork_queue[i] = nil
-		local co = co_create(function (...)
-			info.func(table.unpack(info.args))
-		end)
-		co_monitor(co,coroutine.resume(co))
-	end
-	_fork_queue = {}
-end
-
-local function run_wakeup()
-	for _,info in ipairs(_wakeup_queue) do
-		local co = _wait_co[info.session]
-		_wait_co[info.session] = nil
-		if co then
-			co_monitor(co,coroutine.resume(co,table.unpack(info.args)))
-		else
-			print(string.format("error wakeup:session:%s not found",info.session))
-		end
-	end
-	_wakeup_queue = {}
+	return {ip = ip,port = port}
 end
 
 local function create_channel(channel_class,channel_buff,ip,port)
 	local channel_obj = channel_class:new(channel_buff,ip,port)
 	channel_obj:init()
+	if channel_obj.data == channel.data then
+		--default protocol,let event.core split frames natively
+		channel_buff:frame(channel_obj.head,channel_obj.max_frame)
+	end
+	if channel_obj.write_high then
+		channel_buff:set_watermark(nil,nil,channel_obj.write_low or 0,channel_obj.write_high)
+	end
 	_channel_ctx[channel_buff] = channel_obj
 	return channel_obj
 end
 
-function _M.listen(ip,port,callback,channel_class)
-	local listener = _event:listen(false,{ip = ip,port = port})
+--opts:backlog,defer_accept,accept_batch(max connections per accept callback)
+function _M.listen(ip,port,callback,channel_class,reuse_port,opts)
+	--workers share the port through SO_REUSEPORT by default
+	if reuse_port == nil then
+		reuse_port = event_core.worker_id() > 0
+	end
+	local listener = _event:listen(reuse_port,make_addr(ip,port),opts)
 	if not listener then
 		return false
 	end
@@ -246,8 +290,13 @@ function _M.listen(ip,port,callback,channel_class)
 	return listener
 end
 
-function _M.httpd(ip,port,callback)
-	local httpd = _event:httpd(ip,port)
+--opts as in listen,plus reuse_port which also default to on inside workers
+function _M.httpd(ip,port,callback,opts)
+	local reuse_port = opts and opts.reuse_port
+	if reuse_port == nil then
+		reuse_port = event_core.worker_id() > 0
+	end
+	local httpd = _event:httpd(make_addr(ip,port),reuse_port,opts)
 	if not httpd then
 		return false
 	end
@@ -255,20 +304,73 @@ function _M.httpd(ip,port,callback)
 	return httpd
 end
 
+--callback(udp,data,ip,port) for every datagram,udp:send(data,ip,port) to reply
+--udp:close() keep the socket until queued datagrams drain,return how many were still queued
+function _M.udp(ip,port,callback,max_size)
+	local udp,err = _event:udp({ip = ip,port = port},max_size)
+	if not udp then
+		return false,err
+	end
+	_udp_ctx[udp] = callback
+	return udp
+end
+
 function _M.dns(host,callback)
-	local dns = _event:dns(host)
-	if not dns then
-		return dns
+	local dns,result = _event:dns(host)
+	if dns == true then
+		--answered from cache
+		_M.fork(callback,result)
+		return true
+	elseif dns == false then
+		if result then
+			_M.fork(callback,false,result)
+			return true
+		end
+		return false
 	end
 	_dns_ctx[dns] = callback
 	return true
 end
 
+function _M.dns_stats()
+	return _event:dns_stats()
+end
+
+--keep up to max files open for send_file and reply_file
+function _M.file_cache(max,check_interval)
+	_event:file_cache(max,check_interval)
+end
+
+--loop lag,callback latency per event type and byte counters,off by default
+function _M.stats_enable(on,lag_interval)
+	_event:stats_enable(on,lag_interval)
+end
+
+function _M.stats(reset)
+	return _event:stats(reset)
+end
+
+function _M.stats_text(prefix)
+	return _event:stats_text(prefix)
+end
+
+--serve stats_text on http://ip:port/metrics
+function _M.stats_httpd(ip,port,prefix)
+	return _M.httpd(ip,port,function (_,req,method,path)
+		if path ~= "/metrics" then
+			req:reply(404,"Not Found")
+			return
+		end
+		req:set_header("Content-Type","text/plain; version=0.0.4")
+		req:reply(200,"OK",_event:stats_text(prefix))
+	end)
+end
+
 function _M.connect(ip,port,channel_class)
 	local co = coroutine.running()
 	assert(co ~= _main_co,string.format("cannot connect in main co"))
 	local session = _M.gen_session()
-	local ok,err = _event:connect(session,{ip = ip,port = port})
+	local ok,err = _event:connect(session,make_addr(ip,port))
 	if not ok then
 		return false,err
 	end
@@ -280,6 +382,53 @@ function _M.connect(ip,port,channel_class)
 	end
 end
 
+local pool = {}
+
+--connections keyed by ip and port,reused last in first out
+function _M.pool(max_idle,max_active,idle_timeout)
+	local core = _event:pool(max_idle,max_active,idle_timeout)
+	_pool_ctx[core] = true
+	return setmetatable({core = core},{__index = pool})
+end
+
+function pool:connect(ip,port,channel_class)
+	local co = coroutine.running()
+	assert(co ~= _main_co,string.format("cannot connect in main co"))
+	local session = _M.gen_session()
+	local ok,channel_buff = self.core:checkout(session,make_addr(ip,port))
+	if not ok then
+		return false,channel_buff
+	end
+	if not channel_buff then
+		ok,channel_buff = _M.wait(session)
+		if not ok then
+			return false,channel_buff
+		end
+	end
+	local channel_obj = _channel_ctx[channel_buff]
+	if channel_obj then
+		return channel_obj
+	end
+	return create_channel(channel_class or channel,channel_buff,ip,port)
+end
+
+--channel still waiting for replies can not be shared
+function pool:checkin(channel_obj)
+	if next(channel_obj.session_ctx) or channel_obj.state ~= STATE.HEAD then
+		channel_obj:close_immediately()
+		return false
+	end
+	return self.core:checkin(channel_obj.channel_buff)
+end
+
+function pool:stats()
+	return self.core:stats()
+end
+
+function pool:close()
+	self.core:release()
+end
+
 function _M.bind(fd,channel_class)
 	local channel_buff = _event:bind(fd)
 	return create_channel(channel_class or channel,channel_buff)
@@ -292,28 +441,120 @@ function _M.sleep(ti)
 	_M.wait(session)
 end
 
+--rates in bytes per second shared by every channel joined with group_channel
+function _M.rate_group(read_rate,read_burst,write_rate,write_burst,tick)
+	local group = _event:rate_group(read_rate,read_burst,write_rate,write_burst,tick)
+	_rate_group_ctx[group] = true
+	return group
+end
+
+function _M.group_channel(group,channel_obj)
+	channel_obj.channel_buff:join_group(group)
+end
+
+--cheap one shot timeout on the native timing wheel,return handle for cancel_timeout
+function _M.timeout(ti,callback)
+	if not _wheel then
+		_wheel = _event:wheel(_M.WHEEL_RESOLUTION or 0.01)
+	end
+	local session = _M.gen_session()
+	_wheel_ctx[session] = callback
+	return _wheel:add(ti,session)
+end
+
+function _M.cancel_timeout(handle)
+	local session = _wheel:cancel(handle)
+	if session then
+		_wheel_ctx[session] = nil
+		return true
+	end
+	return false
+end
+
+--deliver data/timeout events once per loop iteration,size <= 0 turn it off
+function _M.batch(size)
+	_event:batch(size)
+end
+
+--run script(id,count) on n threads,each with its own lua state and event loop
+function _M.spawn_workers(n,script)
+	return event_core.spawn_workers(n,script)
+end
+
+function _M.join_workers()
+	event_core.join_workers()
+end
+
+function _M.worker_id()
+	return event_core.worker_id()
+end
+
+function _M.send_worker(id,...)
+	return event_core.send(id,table.encode({...}))
+end
+
+--run a registered native job on the offload pool,the calling coroutine wait for ok,result
+function _M.offload(name,...)
+	local co = coroutine.running()
+	assert(co ~= _main_co,string.format("cannot offload in main co"))
+	if not _offload_started then
+		event_core.offload(_M.OFFLOAD_THREADS or 4)
+		_offload_started = true
+	end
+	local session = _M.gen_session()
+	_event:submit(session,name,...)
+	return _M.wait(session)
+end
+
+function _M.read_file(path)
+	return _M.offload("read_file",path)
+end
+
+function _M.write_file(path,data)
+	return _M.offload("write_file",path,data)
+end
+
+function _M.list_dir(path)
+	local ok,result = _M.offload("list_dir",path)
+	if not ok then
+		return false,result
+	end
+	local list = {}
+	for name in string.gmatch(result,"[^\n]+") do
+		table.insert(list,name)
+	end
+	return list
+end
+
+function _M.job_stats()
+	return _event:job_stats()
+end
+
+function _M.mail(callback)
+	_mail_callback = callback
+end
+
 function _M.sys_sleep(ti)
 	_event:sleep(ti)
 end
 
-function _M.timer(ti,callback)
-	local timer = _event:timer(ti)
+function _M.timer(ti,callback,priority)
+	local timer = _event:timer(ti,false,priority)
 	_timer_ctx[timer] = {callback = callback}
 	return timer
 end
 
+--coroutines,run queues and the session map live in event.core
 function _M.fork(func,...)
-	table.insert(_fork_queue,{func = func,args = {...}})
+	_event:fork(func,...)
 end
 
 function _M.wakeup(session,...)
-	table.insert(_wakeup_queue,{session = session,args = {...}})
+	_event:wakeup(session,...)
 end
 
 function _M.wait(session)
-	local co = coroutine.running()
-	assert(co ~= _main_co,string.format("cannot sleep in main co,wait op should run in fork"))
-	return coroutine.yield(_M.CO_STATE.WAIT,session)
+	return _event:wait(session)
 end
 
 function _M.gen_session()
@@ -326,12 +567,11 @@ function _M.gen_session()
 end
 
 function _M.co_clean()
-	_co_pool = {}
+	_event:co_clean()
 end
 
 function _M.dispatch()
-	run_wakeup()
-	run_fork()
+	_event:run()
 
 	local code = _event:dispatch()
 	
@@ -341,6 +581,12 @@ function _M.dispatch()
 		end
 	end
 
+	if _wheel then
+		_wheel:release()
+		_wheel = nil
+		_wheel_ctx = {}
+	end
+
 	for listener in pairs(_listener_ctx) do
 		if listener:alive() then
 			listener:close()
@@ -353,9 +599,27 @@ function _M.dispatch()
 		end
 	end
 
+	for core in pairs(_pool_ctx) do
+		if core:alive() then
+			core:release()
+		end
+	end
+
 	for channel_buff in pairs(_channel_ctx) do
 		if channel_buff:alive() then
-			channel_buff:close_immediately()
+			channel_buff:close()
+		end
+	end
+
+	for udp in pairs(_udp_ctx) do
+		if udp:alive() then
+			udp:close()
+		end
+	end
+
+	for group in pairs(_rate_group_ctx) do
+		if group:alive() then
+			group:release()
 		end
 	end
 	
@@ -375,6 +639,11 @@ function _M.now()
 	return _event:now()
 end
 
+--monotonic microseconds
+function _M.clock()
+	return event_core.clock()
+end
+
 local EV = {}
 
 EV[EV_TIMEOUT] = function (timer)
@@ -390,6 +659,18 @@ end
 
 EV[EV_ACCEPT] = function (listener,channel_buff,ip,port)
 	local info = _listener_ctx[listener]
+	if type(channel_buff) == "table" then
+		--accept batch:{buffer,ip,port,...,n = count}
+		local list = channel_buff
+		for i = 1,list.n * 3,3 do
+			local channel_obj = create_channel(info.channel_class,list[i],list[i+1],list[i+2])
+			local ok,err = xpcall(info.callback,debug.traceback,listener,channel_obj,list[i+1],list[i+2])
+			if not ok then
+				io.stderr:write(err)
+			end
+		end
+		return
+	end
 	local channel_obj = create_channel(info.channel_class,channel_buff,ip,port)
 	info.callback(listener,channel_obj,ip,port)
 end
@@ -398,9 +679,9 @@ EV[EV_CONNECT] = function (...)
 	_M.wakeup(...)
 end
 
-EV[EV_DATA] = function (channel_buff)
+EV[EV_DATA] = function (channel_buff,frames)
 	local channel = _channel_ctx[channel_buff]
-	channel:data()
+	channel:data(frames)
 end
 
 EV[EV_HTTP] = function (httpd,...)
@@ -408,6 +689,21 @@ EV[EV_HTTP] = function (httpd,...)
 	info.callback(httpd,...)
 end
 
+EV[EV_WRITABLE] = function (channel_buff)
+	local channel = _channel_ctx[channel_buff]
+	channel:writable()
+end
+
+EV[EV_UDP] = function (udp,packets,count)
+	local callback = _udp_ctx[udp]
+	for i = 1,count * 3,3 do
+		local ok,err = xpcall(callback,debug.traceback,udp,packets[i],packets[i+1],packets[i+2])
+		if not ok then
+			io.stderr:write(err)
+		end
+	end
+end
+
 EV[EV_ERROR] = function (channel_buff)
 	local channel = _channel_ctx[channel_buff]
 	channel:disconnect()
@@ -418,7 +714,43 @@ EV[EV_DNS] = function (dns,...)
 	callback(...)
 end
 
+EV[EV_MAIL] = function (source,data)
+	if _mail_callback then
+		_mail_callback(source,table.unpack(table.decode(data)))
+	end
+end
+
+EV[EV_JOB] = function (session,ok,result)
+	_M.wakeup(session,ok,result)
+end
+
+EV[EV_EXPIRE] = function (wheel,sessions,count)
+	for i = 1,count do
+		local session = sessions[i]
+		local callback = _wheel_ctx[session]
+		_wheel_ctx[session] = nil
+		local ok,err = xpcall(callback,debug.traceback)
+		if not ok then
+			io.stderr:write(err)
+		end
+	end
+end
+
+local function batch_dispatch(events,count)
+	for i = 1,count * 3,3 do
+		local ok,err = xpcall(EV[events[i]],debug.traceback,events[i+1],events[i+2])
+		if not ok then
+			io.stderr:write(err)
+		end
+	end
+	_event:run()
+end
+
 local function event_dispatch(ev,...)
+	if ev == EV_BATCH then
+		batch_dispatch(...)
+		return
+	end
 	local ev_func = EV[ev]
 	if not ev_func then
 		io.stderr:write(string.format("no such ev:%d",ev))
@@ -428,10 +760,27 @@ local function event_dispatch(ev,...)
 	if not ok then
 		io.stderr:write(err)
 	end
-	run_wakeup()
-	run_fork()
+	_event:run()
+end
+
+local function event_create(opts)
+	local ev = event_core.new(event_dispatch,opts)
+	ev:dns_cache(1024)
+	return ev
+end
+
+--rebuild the loop with backend options and priorities,only right after require
+function _M.setup(opts)
+	local ev = event_create(opts)
+	_event:release()
+	_event = ev
+	return _event:backend()
+end
+
+function _M.backend()
+	return _event:backend()
 end
 
-_event = event_core.new(event_dispatch)
+_event = event_create()
 
 return _M
@@ -0,0 +1,780 @@
+﻿#include "socket_tcp.h"
+
+#include "lua.h"
+#include "lualib.h"
+#include "lauxlib.h"
+
+#ifdef _WIN32
+#include <WS2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+#define EXPORT __declspec(dllexport)
+#else
+#define EXPORT
+#endif
+
+//same numbers as event.core,so one handler table can serve both
+#define LUA_EV_ERROR    0
+#define LUA_EV_ACCEPT   2
+#define LUA_EV_CONNECT  3
+#define LUA_EV_DATA     4
+#define LUA_EV_WRITABLE	10
+
+#define META_LOOP 		"meta_socket_loop"
+#define META_LISTENER 	"meta_socket_listener"
+#define META_SESSION 	"meta_socket_session"
+
+#define SLICE_STACK		16
+
+struct lsession;
+struct llistener;
+
+typedef struct lloop {
+	lua_State* L;
+	struct ev_loop_ctx* loop_ctx;
+	int callback;
+	int closed;
+	struct lsession* sessions;
+	struct llistener* listeners;
+} lloop_t;
+
+typedef struct llistener {
+	lloop_t* lloop;
+	struct ev_listener* listener;
+	int max;
+	int ref;
+	int closed;
+	struct llistener* prev;
+	struct llistener* next;
+} llistener_t;
+
+typedef struct lsession {
+	lloop_t* lloop;
+	struct ev_session* session;
+	int ref;
+	int closed;
+	int connecting;
+	//inside ev_session_write,its synchronous callbacks are not delivered
+	int writing;
+	//close asked while output still queued,free once it is flushed
+	int closing;
+	struct lsession* prev;
+	struct lsession* next;
+} lsession_t;
+
+static int
+_meta_init(lua_State* L, const char* meta) {
+	luaL_newmetatable(L, meta);
+	lua_setmetatable(L, -2);
+	lua_pushvalue(L, -1);
+	return luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+//every lua callback go through here,the event type is the first argument
+static void
+lloop_pcall(lloop_t* lloop, int nargs) {
+	lua_State* L = lloop->L;
+	if ( lua_pcall(L, nargs, 0, 0) != LUA_OK ) {
+		fprintf(stderr, "socket callback error:%s\n", lua_tostring(L, -1));
+		lua_pop(L, 1);
+	}
+}
+
+static void
+session_link(lloop_t* lloop, lsession_t* lsession) {
+	lsession->prev = NULL;
+	lsession->next = lloop->sessions;
+	if ( lloop->sessions ) {
+		lloop->sessions->prev = lsession;
+	}
+	lloop->sessions = lsession;
+}
+
+static void
+session_destroy(lsession_t* lsession) {
+	lloop_t* lloop = lsession->lloop;
+	if ( lsession->prev ) {
+		lsession->prev->next = lsession->next;
+	}
+	else {
+		lloop->sessions = lsession->next;
+	}
+	if ( lsession->next ) {
+		lsession->next->prev = lsession->prev;
+	}
+	lsession->closed = 1;
+	ev_session_free(lsession->session);
+	lsession->session = NULL;
+	luaL_unref(lloop->L, LUA_REGISTRYINDEX, lsession->ref);
+}
+
+static void
+session_event(lsession_t* lsession, int type) {
+	lloop_t* lloop = lsession->lloop;
+	lua_rawgeti(lloop->L, LUA_REGISTRYINDEX, lloop->callback);
+	lua_pushinteger(lloop->L, type);
+	lua_rawgeti(lloop->L, LUA_REGISTRYINDEX, lsession->ref);
+	lloop_pcall(lloop, 2);
+}
+
+static void
+read_complete(struct ev_session* session, void* ud) {
+	lsession_t* lsession = ud;
+	session_event(lsession, LUA_EV_DATA);
+}
+
+static void
+connect_result(lsession_t* lsession) {
+	lloop_t* lloop = lsession->lloop;
+	lua_State* L = lloop->L;
+	lsession->connecting = 0;
+
+	int err = 0;
+	socklen_t len = sizeof( err );
+	if ( getsockopt(ev_session_fd(lsession->session), SOL_SOCKET, SO_ERROR, (void*)&err, &len) < 0 ) {
+		err = errno;
+	}
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, lloop->callback);
+	lua_pushinteger(L, LUA_EV_CONNECT);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, lsession->ref);
+	if ( err == 0 ) {
+		ev_session_enable(lsession->session, EV_READ);
+		lua_pushboolean(L, 1);
+		lloop_pcall(lloop, 3);
+		return;
+	}
+	lua_pushboolean(L, 0);
+	lua_pushstring(L, strerror(err));
+	session_destroy(lsession);
+	lloop_pcall(lloop, 4);
+}
+
+static void
+write_complete(struct ev_session* session, void* ud) {
+	lsession_t* lsession = ud;
+	if ( lsession->writing ) {
+		return;
+	}
+	if ( lsession->connecting ) {
+		connect_result(lsession);
+		return;
+	}
+	if ( lsession->closing ) {
+		session_destroy(lsession);
+		return;
+	}
+	session_event(lsession, LUA_EV_WRITABLE);
+}
+
+static void
+event_happen(struct ev_session* session, void* ud) {
+	lsession_t* lsession = ud;
+	if ( lsession->writing ) {
+		return;
+	}
+	if ( lsession->connecting ) {
+		connect_result(lsession);
+		return;
+	}
+	if ( lsession->closing ) {
+		session_destroy(lsession);
+		return;
+	}
+	//what arrived together with the eof is still readable
+	if ( ev_session_input_size(session) > 0 ) {
+		session_event(lsession, LUA_EV_DATA);
+		if ( lsession->closed ) {
+			return;
+		}
+	}
+	session_event(lsession, LUA_EV_ERROR);
+	if ( !lsession->closed ) {
+		session_destroy(lsession);
+	}
+}
+
+static lsession_t*
+session_create(lua_State* L, lloop_t* lloop, struct ev_session* session) {
+	lsession_t* lsession = lua_newuserdata(L, sizeof( *lsession ));
+	memset(lsession, 0, sizeof( *lsession ));
+	lsession->lloop = lloop;
+	lsession->session = session;
+	lsession->ref = _meta_init(L, META_SESSION);
+	session_link(lloop, lsession);
+	ev_session_setcb(session, read_complete, write_complete, event_happen, lsession);
+	return lsession;
+}
+
+static void
+accept_complete(struct ev_listener* listener, int fd, const char* addr, void* ud) {
+	llistener_t* llistener = ud;
+	lloop_t* lloop = llistener->lloop;
+	lua_State* L = lloop->L;
+
+	struct ev_session* session = ev_session_bind(lloop->loop_ctx, fd, llistener->max);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, lloop->callback);
+	lua_pushinteger(L, LUA_EV_ACCEPT);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, llistener->ref);
+	session_create(L, lloop, session);
+	lua_pushstring(L, addr);
+	ev_session_enable(session, EV_READ);
+	lloop_pcall(lloop, 4);
+}
+
+static lloop_t*
+get_loop(lua_State* L) {
+	lloop_t* lloop = ( lloop_t* )luaL_checkudata(L, 1, META_LOOP);
+	if ( lloop->closed ) {
+		luaL_error(L, "loop already released");
+	}
+	return lloop;
+}
+
+static lsession_t*
+get_session(lua_State* L) {
+	lsession_t* lsession = ( lsession_t* )luaL_checkudata(L, 1, META_SESSION);
+	if ( lsession->closed || lsession->closing ) {
+		luaL_error(L, "session already closed");
+	}
+	return lsession;
+}
+
+//loop:listen(ip,port,max),max bound the bytes taken by one read event,0 for no bound
+static int
+_listen(lua_State* L) {
+	lloop_t* lloop = get_loop(L);
+	const char* ip = luaL_checkstring(L, 2);
+	int port = (int)luaL_checkinteger(L, 3);
+	int max = (int)luaL_optinteger(L, 4, 0);
+
+	llistener_t* llistener = lua_newuserdata(L, sizeof( *llistener ));
+	memset(llistener, 0, sizeof( *llistener ));
+	llistener->lloop = lloop;
+	llistener->max = max;
+	llistener->listener = ev_listener_bind_ipv4(lloop->loop_ctx, ip, (uint16_t)port, accept_complete, llistener);
+	if ( !llistener->listener ) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, strerror(errno));
+		return 2;
+	}
+	llistener->ref = _meta_init(L, META_LISTENER);
+	llistener->next = lloop->listeners;
+	if ( lloop->listeners ) {
+		lloop->listeners->prev = llistener;
+	}
+	lloop->listeners = llistener;
+	return 1;
+}
+
+//loop:connect(ip,port,max),return the session and true once connected,
+//or the session and false while in progress,a LUA_EV_CONNECT follow then
+static int
+_connect(lua_State* L) {
+	lloop_t* lloop = get_loop(L);
+	const char* ip = luaL_checkstring(L, 2);
+	int port = (int)luaL_checkinteger(L, 3);
+	int max = (int)luaL_optinteger(L, 4, 0);
+
+	struct sockaddr_in si;
+	memset(&si, 0, sizeof( si ));
+	si.sin_family = AF_INET;
+	si.sin_addr.s_addr = inet_addr(ip);
+	si.sin_port = htons((uint16_t)port);
+
+	int status;
+	struct ev_session* session = ev_session_connect(lloop->loop_ctx, (struct sockaddr*)&si, sizeof( si ), 0, max, &status);
+	if ( !session ) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, strerror(errno));
+		return 2;
+	}
+	lsession_t* lsession = session_create(L, lloop, session);
+	if ( status == CONNECT_STATUS_CONNECTED ) {
+		ev_session_enable(session, EV_READ);
+		lua_pushboolean(L, 1);
+	}
+	else {
+		lsession->connecting = 1;
+		ev_session_enable(session, EV_WRITE);
+		lua_pushboolean(L, 0);
+	}
+	return 2;
+}
+
+static int
+_dispatch(lua_State* L) {
+	lloop_t* lloop = get_loop(L);
+	loop_ctx_dispatch(lloop->loop_ctx);
+	return 0;
+}
+
+static int
+_break(lua_State* L) {
+	lloop_t* lloop = get_loop(L);
+	loop_ctx_break(lloop->loop_ctx);
+	return 0;
+}
+
+static int
+_now(lua_State* L) {
+	lloop_t* lloop = get_loop(L);
+	lua_pushnumber(L, loop_ctx_now(lloop->loop_ctx));
+	return 1;
+}
+
+//the backend actually running,"uring" may have fallen back to "event"
+static int
+_backend(lua_State* L) {
+	lloop_t* lloop = get_loop(L);
+	lua_pushstring(L, loop_ctx_backend(lloop->loop_ctx) == LOOP_BACKEND_URING ? "uring" : "event");
+	return 1;
+}
+
+static int
+_clean(lua_State* L) {
+	lloop_t* lloop = get_loop(L);
+	loop_ctx_clean(lloop->loop_ctx);
+	return 0;
+}
+
+//loop:high_water(bytes),cap on the bytes of free chunks the loop keep for reuse
+static int
+_high_water(lua_State* L) {
+	lloop_t* lloop = get_loop(L);
+	lua_Integer high_water = luaL_checkinteger(L, 2);
+	luaL_argcheck(L, high_water >= 0, 2, "negative high water");
+	loop_ctx_high_water(lloop->loop_ctx, (size_t)high_water);
+	return 0;
+}
+
+//{hit,miss,trim,cached,high_water,classes = {[size] = free chunks}}
+static int
+_chunk_stats(lua_State* L) {
+	lloop_t* lloop = get_loop(L);
+	struct chunk_stats stats;
+	loop_ctx_chunk_stats(lloop->loop_ctx, &stats);
+
+	lua_createtable(L, 0, 6);
+	lua_pushinteger(L, (lua_Integer)stats.hit);
+	lua_setfield(L, -2, "hit");
+	lua_pushinteger(L, (lua_Integer)stats.miss);
+	lua_setfield(L, -2, "miss");
+	lua_pushinteger(L, (lua_Integer)stats.trim);
+	lua_setfield(L, -2, "trim");
+	lua_pushinteger(L, (lua_Integer)stats.cached);
+	lua_setfield(L, -2, "cached");
+	lua_pushinteger(L, (lua_Integer)stats.high_water);
+	lua_setfield(L, -2, "high_water");
+
+	lua_createtable(L, 0, CHUNK_CLASS_MAX);
+	int i;
+	for ( i = 0; i < CHUNK_CLASS_MAX; i++ ) {
+		lua_pushinteger(L, stats.count[i]);
+		lua_rawseti(L, -2, 256 << i);
+	}
+	lua_setfield(L, -2, "classes");
+	return 1;
+}
+
+static void
+listener_destroy(llistener_t* llistener) {
+	lloop_t* lloop = llistener->lloop;
+	if ( llistener->prev ) {
+		llistener->prev->next = llistener->next;
+	}
+	else {
+		lloop->listeners = llistener->next;
+	}
+	if ( llistener->next ) {
+		llistener->next->prev = llistener->prev;
+	}
+	llistener->closed = 1;
+	ev_listener_free(llistener->listener);
+	llistener->listener = NULL;
+	luaL_unref(lloop->L, LUA_REGISTRYINDEX, llistener->ref);
+}
+
+//close every listener and session still open,then the loop itself
+static int
+_release(lua_State* L) {
+	lloop_t* lloop = ( lloop_t* )luaL_checkudata(L, 1, META_LOOP);
+	if ( lloop->closed ) {
+		return 0;
+	}
+	while ( lloop->listeners ) {
+		listener_destroy(lloop->listeners);
+	}
+	while ( lloop->sessions ) {
+		session_destroy(lloop->sessions);
+	}
+	luaL_unref(L, LUA_REGISTRYINDEX, lloop->callback);
+	loop_ctx_release(lloop->loop_ctx);
+	lloop->loop_ctx = NULL;
+	lloop->closed = 1;
+	return 0;
+}
+
+static int
+_listener_addr(lua_State* L) {
+	llistener_t* llistener = ( llistener_t* )luaL_checkudata(L, 1, META_LISTENER);
+	if ( llistener->closed ) {
+		return 0;
+	}
+	char addr[HOST_SIZE] = { 0 };
+	int port = 0;
+	if ( ev_listener_addr(llistener->listener, addr, sizeof( addr ), &port) < 0 ) {
+		return 0;
+	}
+	lua_pushstring(L, addr);
+	lua_pushinteger(L, port);
+	return 2;
+}
+
+static int
+_listener_close(lua_State* L) {
+	llistener_t* llistener = ( llistener_t* )luaL_checkudata(L, 1, META_LISTENER);
+	if ( !llistener->closed ) {
+		listener_destroy(llistener);
+	}
+	return 0;
+}
+
+static int
+_listener_alive(lua_State* L) {
+	llistener_t* llistener = ( llistener_t* )luaL_checkudata(L, 1, META_LISTENER);
+	lua_pushboolean(L, !llistener->closed);
+	return 1;
+}
+
+static int
+_session_read(lua_State* L) {
+	lsession_t* lsession = get_session(L);
+	lua_Integer n = luaL_optinteger(L, 2, 0);
+	luaL_argcheck(L, n >= 0, 2, "size must not be negative");
+	size_t size = (size_t)n;
+
+	size_t len = ev_session_input_size(lsession->session);
+	if ( len == 0 ) {
+		return 0;
+	}
+	if ( size == 0 || size > len ) {
+		size = len;
+	}
+
+	const char* data = ev_session_pullup(lsession->session, size);
+	lua_pushlstring(L, data, size);
+	ev_session_drain(lsession->session, size);
+	return 1;
+}
+
+//read up to and including sep,nothing if it has not arrived yet
+static int
+_session_read_util(lua_State* L) {
+	lsession_t* lsession = get_session(L);
+	size_t sep_len;
+	const char* sep = luaL_checklstring(L, 2, &sep_len);
+	luaL_argcheck(L, sep_len > 0, 2, "empty separator");
+
+	char out[1024];
+	size_t length;
+	char* data = ev_session_read_util(lsession->session, sep, sep_len, out, sizeof( out ), &length);
+	if ( !data ) {
+		return 0;
+	}
+	lua_pushlstring(L, data, length);
+	if ( data != out ) {
+		free(data);
+	}
+	return 1;
+}
+
+//length up to and including sep,for peek(n) then consume(n) without a copy
+static int
+_session_search(lua_State* L) {
+	lsession_t* lsession = get_session(L);
+	size_t sep_len;
+	const char* sep = luaL_checklstring(L, 2, &sep_len);
+	luaL_argcheck(L, sep_len > 0, 2, "empty separator");
+
+	int length = ev_session_search(lsession->session, sep, sep_len);
+	if ( length < 0 ) {
+		return 0;
+	}
+	lua_pushinteger(L, length);
+	return 1;
+}
+
+//borrowed view over the input,valid until next consume/read or callback return,
+//without size it is the first chunk as it is
+static int
+_session_peek(lua_State* L) {
+	lsession_t* lsession = get_session(L);
+	lua_Integer n = luaL_optinteger(L, 2, 0);
+	luaL_argcheck(L, n >= 0, 2, "size must not be negative");
+	size_t size = (size_t)n;
+
+	size_t len = ev_session_input_size(lsession->session);
+	if ( len == 0 ) {
+		return 0;
+	}
+	if ( size == 0 ) {
+		struct ev_slice slice;
+		ev_session_peek(lsession->session, 0, &slice, 1);
+		lua_pushlightuserdata(L, (void*)slice.data);
+		lua_pushinteger(L, slice.size);
+		return 2;
+	}
+	if ( size > len ) {
+		return 0;
+	}
+	lua_pushlightuserdata(L, ev_session_pullup(lsession->session, size));
+	lua_pushinteger(L, size);
+	return 2;
+}
+
+//borrowed views over every contiguous chunk,without pullup
+static int
+_session_slice(lua_State* L) {
+	lsession_t* lsession = get_session(L);
+	lua_Integer n = luaL_optinteger(L, 2, 0);
+	luaL_argcheck(L, n >= 0, 2, "size must not be negative");
+	size_t size = (size_t)n;
+
+	if ( ev_session_input_size(lsession->session) == 0 ) {
+		return 0;
+	}
+
+	struct ev_slice stack_slices[SLICE_STACK];
+	struct ev_slice* slices = stack_slices;
+	int cap = SLICE_STACK;
+	int count = ev_session_peek(lsession->session, size, slices, cap);
+	while ( count == cap ) {
+		cap *= 2;
+		if ( slices != stack_slices ) {
+			free(slices);
+		}
+		slices = malloc(sizeof( *slices ) * cap);
+		count = ev_session_peek(lsession->session, size, slices, cap);
+	}
+
+	lua_createtable(L, count * 2, 0);
+	int i;
+	size_t total = 0;
+	for ( i = 0; i < count; i++ ) {
+		total += slices[i].size;
+		lua_pushlightuserdata(L, (void*)slices[i].data);
+		lua_rawseti(L, -2, i * 2 + 1);
+		lua_pushinteger(L, slices[i].size);
+		lua_rawseti(L, -2, i * 2 + 2);
+	}
+
+	if ( slices != stack_slices ) {
+		free(slices);
+	}
+	lua_pushinteger(L, total);
+	return 2;
+}
+
+static int
+_session_consume(lua_State* L) {
+	lsession_t* lsession = get_session(L);
+	lua_Integer n = luaL_checkinteger(L, 2);
+	luaL_argcheck(L, n >= 0, 2, "size must not be negative");
+	size_t size = (size_t)n;
+	ev_session_drain(lsession->session, size);
+	lua_pushinteger(L, ev_session_input_size(lsession->session));
+	return 1;
+}
+
+static int
+_session_input_size(lua_State* L) {
+	lsession_t* lsession = get_session(L);
+	lua_pushinteger(L, ev_session_input_size(lsession->session));
+	return 1;
+}
+
+static int
+_session_output_size(lua_State* L) {
+	lsession_t* lsession = get_session(L);
+	lua_pushinteger(L, ev_session_output_size(lsession->session));
+	return 1;
+}
+
+//session:write(data) or session:write(lightuserdata,size),
+//return the bytes gone now,the rest is queued and LUA_EV_WRITABLE follow once it is flushed
+static int
+_session_write(lua_State* L) {
+	lsession_t* lsession = get_session(L);
+	const char* data;
+	size_t size;
+	if ( lua_type(L, 2) == LUA_TLIGHTUSERDATA ) {
+		data = lua_touserdata(L, 2);
+		size = luaL_checkinteger(L, 3);
+	}
+	else {
+		data = luaL_checklstring(L, 2, &size);
+	}
+
+	lsession->writing = 1;
+	int total = ev_session_write_copy(lsession->session, data, size);
+	lsession->writing = 0;
+	if ( total < 0 ) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, "session broken");
+		return 2;
+	}
+	lua_pushinteger(L, total);
+	return 1;
+}
+
+//close after the queued output is flushed,or right now with session:close(true)
+static int
+_session_close(lua_State* L) {
+	lsession_t* lsession = ( lsession_t* )luaL_checkudata(L, 1, META_SESSION);
+	if ( lsession->closed || lsession->closing ) {
+		return 0;
+	}
+	int now = lua_toboolean(L, 2);
+	if ( now || lsession->connecting || ev_session_output_size(lsession->session) == 0 ) {
+		session_destroy(lsession);
+		return 0;
+	}
+	lsession->closing = 1;
+	ev_session_disable(lsession->session, EV_READ);
+	return 0;
+}
+
+static int
+_session_alive(lua_State* L) {
+	lsession_t* lsession = ( lsession_t* )luaL_checkudata(L, 1, META_SESSION);
+	lua_pushboolean(L, !lsession->closed && !lsession->closing);
+	return 1;
+}
+
+static int
+_session_fd(lua_State* L) {
+	lsession_t* lsession = get_session(L);
+	lua_pushinteger(L, ev_session_fd(lsession->session));
+	return 1;
+}
+
+//stop or resume reading,for back pressure
+static int
+_session_pause(lua_State* L) {
+	lsession_t* lsession = get_session(L);
+	if ( lua_toboolean(L, 2) ) {
+		ev_session_disable(lsession->session, EV_READ);
+	}
+	else {
+		ev_session_enable(lsession->session, EV_READ);
+	}
+	return 0;
+}
+
+//socket.core.clock(),monotonic microseconds,finer than loop:now which is cached per iteration
+static int
+_clock(lua_State* L) {
+#ifdef _WIN32
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+	if ( !freq.QuadPart ) {
+		QueryPerformanceFrequency(&freq);
+	}
+	QueryPerformanceCounter(&now);
+	lua_pushinteger(L, (lua_Integer)( now.QuadPart * 1000000 / freq.QuadPart ));
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	lua_pushinteger(L, (lua_Integer)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+#endif
+	return 1;
+}
+
+static const char* const BACKEND_NAME[] = { "event", "uring", NULL };
+
+//socket.core.new(callback,backend),callback(type,...) for every event of this loop,
+//backend is "event"(default) or "uring",which fall back to "event" where io_uring is not usable
+static int
+_loop_new(lua_State* L) {
+#ifdef _WIN32
+	WSADATA wsa_data;
+	WSAStartup(0x0201, &wsa_data);
+#endif
+	luaL_checktype(L, 1, LUA_TFUNCTION);
+	int backend = luaL_checkoption(L, 2, "event", BACKEND_NAME);
+	lua_settop(L, 1);
+
+	lloop_t* lloop = lua_newuserdata(L, sizeof( *lloop ));
+	memset(lloop, 0, sizeof( *lloop ));
+	lloop->L = L;
+	lloop->loop_ctx = loop_ctx_create_backend(backend == 1 ? LOOP_BACKEND_URING : LOOP_BACKEND_EVENT);
+	lua_pushvalue(L, 1);
+	lloop->callback = luaL_ref(L, LUA_REGISTRYINDEX);
+
+	luaL_newmetatable(L, META_LOOP);
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+int EXPORT
+luaopen_socket_core(lua_State* L) {
+	luaL_newmetatable(L, META_LOOP);
+	const luaL_Reg meta_loop[] = {
+		{ "listen", _listen },
+		{ "connect", _connect },
+		{ "dispatch", _dispatch },
+		{ "breakout", _break },
+		{ "now", _now },
+		{ "backend", _backend },
+		{ "clean", _clean },
+		{ "high_water", _high_water },
+		{ "chunk_stats", _chunk_stats },
+		{ "release", _release },
+		{ NULL, NULL },
+	};
+	luaL_newlib(L, meta_loop);
+	lua_setfield(L, -2, "__index");
+	lua_pushcfunction(L, _release);
+	lua_setfield(L, -2, "__gc");
+	lua_pop(L, 1);
+
+	luaL_newmetatable(L, META_LISTENER);
+	const luaL_Reg meta_listener[] = {
+		{ "addr", _listener_addr },
+		{ "close", _listener_close },
+		{ "alive", _listener_alive },
+		{ NULL, NULL },
+	};
+	luaL_newlib(L, meta_listener);
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+
+	luaL_newmetatable(L, META_SESSION);
+	const luaL_Reg meta_session[] = {
+		{ "read", _session_read },
+		{ "read_util", _session_read_util },
+		{ "search", _session_search },
+		{ "peek", _session_peek },
+		{ "slice", _session_slice },
+		{ "consume", _session_consume },
+		{ "input_size", _session_input_size },
+		{ "output_size", _session_output_size },
+		{ "write", _session_write },
+		{ "close", _session_close },
+		{ "alive", _session_alive },
+		{ "fd", _session_fd },
+		{ "pause", _session_pause },
+		{ NULL, NULL },
+	};
+	luaL_newlib(L, meta_session);
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+
+	const luaL_Reg l[] = {
+		{ "new", _loop_new },
+		{ "clock", _clock },
+		{ NULL, NULL },
+	};
+	luaL_newlib(L, l);
+	return 1;
+}
@@ -1,11 +1,53 @@
 ﻿
 #include "socket_tcp.h"
+#ifdef _WIN32
 #include <io.h>
 #include <windows.h>
+#endif
 #define MIN_BUFFER_SIZE 256
 #define MAX_BUFFER_SIZE 1024*1024
+#define CHUNK_HIGH_WATER 4*1024*1024
 
+#define SCAN_SEP_MAX 16
+
+#ifdef _MSC_VER
 #define inline __inline
+#endif
+
+#if defined( __SSE2__ ) || defined( _M_X64 ) || ( defined( _M_IX86_FP ) && _M_IX86_FP >= 2 )
+#define SCAN_SSE2
+#include <emmintrin.h>
+#endif
+#if defined( __AVX2__ )
+#include <immintrin.h>
+#endif
+
+#if defined( _LINUX )
+#include <linux/io_uring.h>
+#if defined( IORING_RECV_MULTISHOT )
+#define SOCKET_URING
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+#ifdef SOCKET_URING
+#define URING_ENTRIES 1024
+#define URING_BUFFER_COUNT 512
+#define URING_BUFFER_SIZE 16384
+#define URING_BUFFER_GROUP 0
+#define URING_IOV 64
+
+//low bits of user_data,the rest is the listener or session
+#define URING_OP_ACCEPT 1
+#define URING_OP_RECV 2
+#define URING_OP_RECV_ONE 3
+#define URING_OP_SEND 4
+#define URING_OP_POLL 5
+#define URING_OP_CANCEL 6
+#define URING_OP_MASK 7
+#endif
 
 typedef struct data_buffer {
 	struct data_buffer* prev;
@@ -22,9 +64,71 @@ typedef struct ev_buffer {
 	int total;
 } ev_buffer_t;
 
+//free chunks by power of two size class,MIN_BUFFER_SIZE << i,linked through their first bytes
+typedef struct chunk_pool {
+	void* freelist[CHUNK_CLASS_MAX];
+	int count[CHUNK_CLASS_MAX];
+	size_t cached;
+	size_t high_water;
+	uint64_t hit;
+	uint64_t miss;
+	uint64_t trim;
+} chunk_pool_t;
+
+#ifdef SOCKET_URING
+//completion ring living beside the event base,its fd turn readable once completions are posted
+typedef struct uring {
+	int fd;
+	struct event* rio;
+	struct event* flush;
+	int flushing;
+	int closing;
+	int inflight;
+	int multishot_accept;
+	int multishot_recv;
+	struct ev_session* send_queue;
+
+	void* ring_ptr;
+	size_t ring_size;
+	struct io_uring_sqe* sqes;
+	size_t sqes_size;
+	unsigned sq_entries;
+	unsigned sq_pending;
+	unsigned* sq_head;
+	unsigned* sq_tail;
+	unsigned* sq_mask;
+	unsigned* sq_flags;
+	unsigned* sq_array;
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned* cq_mask;
+	struct io_uring_cqe* cqes;
+
+	//completions moved off a full cq while uring_sqe wait for sq room,the next reap handle them first
+	struct io_uring_cqe* backlog;
+	unsigned backlog_count;
+	unsigned backlog_size;
+
+	//buffers handed to the kernel for recv,one is picked per completion
+	//and come back here when the session consume it
+	struct io_uring_buf_ring* br;
+	char* buffers;
+	unsigned short br_tail;
+} uring_t;
+
+typedef struct uring_send {
+	struct msghdr msg;
+	struct iovec iov[URING_IOV];
+} uring_send_t;
+#endif
+
 typedef struct ev_loop_ctx {
 	struct event_base* loop;
 	data_buffer_t* freelist;
+	chunk_pool_t pool;
+#ifdef SOCKET_URING
+	uring_t* uring;
+#endif
 } ev_loop_ctx_t;
 
 typedef struct ev_listener {
@@ -33,6 +137,10 @@ typedef struct ev_listener {
 	int fd;
 	listener_callback accept_cb;
 	void* userdata;
+#ifdef SOCKET_URING
+	int inflight;
+	int zombie;
+#endif
 } ev_listener_t;
 
 typedef struct ev_session {
@@ -45,9 +153,31 @@ typedef struct ev_session {
 	int max;
 	int threshold;
 
+	//input before scan_offset hold no match of scan_sep,so a repeated search resume there,
+	//from scan_chunk(at scan_chunk_offset) until something is consumed
+	char scan_sep[SCAN_SEP_MAX];
+	int scan_sep_len;
+	int scan_offset;
+	data_buffer_t* scan_chunk;
+	int scan_chunk_offset;
+
 	ev_buffer_t input;
 	ev_buffer_t output;
 
+#ifdef SOCKET_URING
+	//requests in flight,a freed session stay as zombie until the last one complete
+	int inflight;
+	int zombie;
+	int read_enabled;
+	int recv_armed;
+	int sending;
+	int send_queued;
+	int polling;
+	struct ev_session* send_next;
+	data_buffer_t* recv_chunk;
+	uring_send_t* send_io;
+#endif
+
 	ev_session_callback read_cb;
 	ev_session_callback write_cb;
 	ev_session_callback event_cb;
@@ -58,6 +188,100 @@ typedef struct ev_session {
 void ev_session_free(ev_session_t* ev_session);
 void ev_session_disable(ev_session_t* ev_session, int ev);
 
+//class of a chunk size,-1 when it is not one of the pooled sizes
+static inline int
+chunk_class(size_t size) {
+	int i;
+	for ( i = 0; i < CHUNK_CLASS_MAX; i++ ) {
+		if ( ( (size_t)MIN_BUFFER_SIZE << i ) == size ) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+//smallest pooled size holding size bytes,MAX_BUFFER_SIZE at most
+static inline int
+chunk_fit(size_t size) {
+	size_t fit = MIN_BUFFER_SIZE;
+	while ( fit < size && fit < MAX_BUFFER_SIZE ) {
+		fit <<= 1;
+	}
+	return (int)fit;
+}
+
+static inline void*
+chunk_alloc(ev_loop_ctx_t* loop_ctx, size_t size) {
+	chunk_pool_t* pool = &loop_ctx->pool;
+	int i = chunk_class(size);
+	if ( i >= 0 && pool->freelist[i] ) {
+		void* chunk = pool->freelist[i];
+		pool->freelist[i] = *(void**)chunk;
+		pool->count[i]--;
+		pool->cached -= size;
+		pool->hit++;
+		return chunk;
+	}
+	pool->miss++;
+	return malloc(size);
+}
+
+#ifdef SOCKET_URING
+static inline void
+uring_buffer_put(uring_t* ring, int bid) {
+	struct io_uring_buf* buf = &ring->br->bufs[ring->br_tail & ( URING_BUFFER_COUNT - 1 )];
+	buf->addr = (uint64_t)(uintptr_t)( ring->buffers + (size_t)bid * URING_BUFFER_SIZE );
+	buf->len = URING_BUFFER_SIZE;
+	buf->bid = (unsigned short)bid;
+	ring->br_tail++;
+	__atomic_store_n(&ring->br->tail, ring->br_tail, __ATOMIC_RELEASE);
+}
+#endif
+
+//any malloc'd block of a pooled size is good for the pool,whoever allocated it,
+//a provided recv buffer go back to the ring instead
+static inline void
+chunk_release(ev_loop_ctx_t* loop_ctx, void* chunk, size_t size) {
+	chunk_pool_t* pool = &loop_ctx->pool;
+#ifdef SOCKET_URING
+	uring_t* ring = loop_ctx->uring;
+	if ( ring && (char*)chunk >= ring->buffers && (char*)chunk < ring->buffers + (size_t)URING_BUFFER_COUNT * URING_BUFFER_SIZE ) {
+		uring_buffer_put(ring, (int)( ( (char*)chunk - ring->buffers ) / URING_BUFFER_SIZE ));
+		return;
+	}
+#endif
+	int i = chunk_class(size);
+	if ( i < 0 || pool->cached + size > pool->high_water ) {
+		if ( i >= 0 ) {
+			pool->trim++;
+		}
+		free(chunk);
+		return;
+	}
+	*(void**)chunk = pool->freelist[i];
+	pool->freelist[i] = chunk;
+	pool->count[i]++;
+	pool->cached += size;
+}
+
+//free cached chunks,largest first,until no more than keep bytes are left
+static void
+chunk_trim(ev_loop_ctx_t* loop_ctx, size_t keep) {
+	chunk_pool_t* pool = &loop_ctx->pool;
+	int i;
+	for ( i = CHUNK_CLASS_MAX - 1; i >= 0 && pool->cached > keep; i-- ) {
+		size_t size = (size_t)MIN_BUFFER_SIZE << i;
+		while ( pool->freelist[i] && pool->cached > keep ) {
+			void* chunk = pool->freelist[i];
+			pool->freelist[i] = *(void**)chunk;
+			pool->count[i]--;
+			pool->cached -= size;
+			pool->trim++;
+			free(chunk);
+		}
+	}
+}
+
 static inline data_buffer_t*
 buffer_next(ev_loop_ctx_t* loop_ctx) {
 	data_buffer_t* db = NULL;
@@ -99,12 +323,35 @@ buffer_append(ev_buffer_t* ev_buffer, data_buffer_t* db) {
 }
 
 static inline void
-buffer_release(ev_buffer_t* ev_buffer) {
+buffer_release(ev_loop_ctx_t* loop_ctx, ev_buffer_t* ev_buffer) {
 	while ( ev_buffer->head ) {
 		data_buffer_t* tmp = ev_buffer->head;
 		ev_buffer->head = ev_buffer->head->next;
-		free(tmp->data);
-		free(tmp);
+		chunk_release(loop_ctx, tmp->data, tmp->size);
+		buffer_reclaim(loop_ctx, tmp);
+	}
+	ev_buffer->tail = NULL;
+	ev_buffer->total = 0;
+}
+
+//drop size bytes from the front,emptied chunks go back to the pool
+static inline void
+buffer_consume(ev_loop_ctx_t* loop_ctx, ev_buffer_t* ev_buffer, int size) {
+	ev_buffer->total -= size;
+	while ( ev_buffer->head ) {
+		data_buffer_t* db = ev_buffer->head;
+		int left = db->wpos - db->rpos;
+		if ( size < left ) {
+			db->rpos += size;
+			break;
+		}
+		size -= left;
+		ev_buffer->head = db->next;
+		chunk_release(loop_ctx, db->data, db->size);
+		buffer_reclaim(loop_ctx, db);
+	}
+	if ( ev_buffer->head == NULL ) {
+		ev_buffer->tail = NULL;
 	}
 }
 
@@ -121,43 +368,60 @@ _ev_accept_cb(evutil_socket_t fd, short events, void * userdata) {
 	listener->accept_cb(listener, accept_fd, addr, listener->userdata);
 }
 
+//scatter into the spare room of the last input chunk plus a fresh chunk of threshold size,
+//a short read means the socket is drained for now
 static void
 _ev_read_cb(evutil_socket_t fd, short events, void * userdata) {
 	ev_session_t* ev_session = userdata;
+	ev_loop_ctx_t* loop_ctx = ev_session->loop_ctx;
 
-	data_buffer_t* rdb = buffer_next(ev_session->loop_ctx);
-	rdb->data = malloc(ev_session->threshold);
-	rdb->size = ev_session->threshold;
+	data_buffer_t* spare = buffer_next(loop_ctx);
+	spare->size = ev_session->threshold;
+	spare->data = chunk_alloc(loop_ctx, spare->size);
 	int fail = 0;
 	int total = ev_session->input.total;
 	for ( ;; ) {
-		int n = (int)_read(ev_session->fd, (char*)rdb->data + rdb->wpos, rdb->size - rdb->wpos);
+		struct iovec iov[2];
+		int count = 0;
+		int room = 0;
+		data_buffer_t* tail = ev_session->input.tail;
+		if ( tail && tail->size > tail->wpos ) {
+			room = tail->size - tail->wpos;
+			iov[count].iov_base = (char*)tail->data + tail->wpos;
+			iov[count].iov_len = room;
+			count++;
+		}
+		iov[count].iov_base = spare->data;
+		iov[count].iov_len = spare->size;
+		count++;
+
+		int n = socket_readv(ev_session->fd, iov, count);
 		if ( n < 0 ) {
-			if ( errno ) {
-				if ( errno == EINTR ) {
-					continue;
-				}
-				else if ( errno == EAGAIN ) {
-					break;
-				}
-				else {
-					fail = 1;
-					break;
-				}
-			}
-			else {
-				assert(0);
+			if ( errno != EAGAIN ) {
+				fail = 1;
 			}
+			break;
 		}
 		else if ( n == 0 ) {
 			fail = 1;
 			break;
 		}
+
+		total += n;
+		int full = n == room + spare->size;
+		if ( n <= room ) {
+			tail->wpos += n;
+			ev_session->input.total += n;
+		}
 		else {
-			total += n;
-			rdb->wpos += n;
+			if ( room > 0 ) {
+				tail->wpos += room;
+				ev_session->input.total += room;
+			}
+			spare->wpos = n - room;
+			buffer_append(&ev_session->input, spare);
 
-			if ( rdb->wpos == rdb->size ) {
+			if ( full ) {
 				ev_session->threshold *= 2;
 				if ( ev_session->threshold > MAX_BUFFER_SIZE )
 					ev_session->threshold = MAX_BUFFER_SIZE;
@@ -168,13 +432,21 @@ _ev_read_cb(evutil_socket_t fd, short events, void * userdata) {
 					ev_session->threshold = MIN_BUFFER_SIZE;
 			}
 
-			if ( ev_session->max > 0 && total >= ev_session->max ) {
-				break;
-			}
+			spare = buffer_next(loop_ctx);
+			spare->size = ev_session->threshold;
+			spare->data = chunk_alloc(loop_ctx, spare->size);
+		}
+
+		if ( !full ) {
+			break;
+		}
+		if ( ev_session->max > 0 && total >= ev_session->max ) {
+			break;
 		}
 	}
 
-	buffer_append(&ev_session->input, rdb);
+	chunk_release(loop_ctx, spare->data, spare->size);
+	buffer_reclaim(loop_ctx, spare);
 
 	if ( fail ) {
 		ev_session_disable(ev_session, EV_READ | EV_WRITE);
@@ -190,14 +462,28 @@ _ev_read_cb(evutil_socket_t fd, short events, void * userdata) {
 	}
 }
 
+//gather up to IOV_MAX queued chunks per call,fully sent chunks go back to the pool
+//and a partial one keep its rpos until the next writable
 static void
 _ev_write_cb(evutil_socket_t fd, short events, void * userdata) {
 	ev_session_t* ev_session = userdata;
 
 	while ( ev_session->output.head != NULL ) {
-		data_buffer_t* wdb = ev_session->output.head;
-		int left = wdb->wpos - wdb->rpos;
-		int total = socket_write(ev_session->fd, (char*)wdb->data + wdb->rpos, left);
+		struct iovec iov[IOV_MAX];
+		int count = 0;
+		int want = 0;
+		data_buffer_t* wdb;
+		for ( wdb = ev_session->output.head; wdb && count < IOV_MAX; wdb = wdb->next ) {
+			int left = wdb->wpos - wdb->rpos;
+			if ( left > 0 ) {
+				iov[count].iov_base = (char*)wdb->data + wdb->rpos;
+				iov[count].iov_len = left;
+				count++;
+				want += left;
+			}
+		}
+
+		int total = count > 0 ? socket_writev(ev_session->fd, iov, count) : 0;
 		if ( total < 0 ) {
 			ev_session_disable(ev_session, EV_READ | EV_WRITE);
 			ev_session->alive = 0;
@@ -205,42 +491,703 @@ _ev_write_cb(evutil_socket_t fd, short events, void * userdata) {
 				ev_session->event_cb(ev_session, ev_session->userdata);
 			return;
 		}
-		else {
-			ev_session->output.total -= total;
-			if ( total == left ) {
-				free(wdb->data);
-				ev_session->output.head = wdb->next;
-				buffer_reclaim(ev_session->loop_ctx, wdb);
-				if ( ev_session->output.head == NULL ) {
-					ev_session->output.head = ev_session->output.tail = NULL;
-					break;
-				}
+
+		buffer_consume(ev_session->loop_ctx, &ev_session->output, total);
+		if ( ev_session->output.head == NULL ) {
+			break;
+		}
+		if ( total < want ) {
+			return;
+		}
+	}
+
+	ev_session_disable(ev_session, EV_WRITE);
+	assert(ev_session->output.total == 0);
+	if ( ev_session->write_cb ) {
+		ev_session->write_cb(ev_session, ev_session->userdata);
+	}
+}
+
+#ifdef SOCKET_URING
+static void uring_reap(ev_loop_ctx_t* loop_ctx);
+
+static void
+uring_submit(uring_t* ring) {
+	while ( ring->sq_pending > 0 ) {
+		int n = (int)syscall(__NR_io_uring_enter, ring->fd, ring->sq_pending, 0, 0, NULL, 0);
+		if ( n < 0 ) {
+			if ( errno == EINTR ) {
+				continue;
 			}
-			else {
-				wdb->rpos += total;
-				return;
+			//EBUSY and EAGAIN clear once completions are reaped,the flush come again then
+			if ( errno != EBUSY && errno != EAGAIN ) {
+				fprintf(stderr, "io_uring_enter error:%s\n", strerror(errno));
 			}
+			return;
 		}
+		ring->sq_pending -= n;
 	}
+}
 
-	ev_session_disable(ev_session, EV_WRITE);
+//the flush is a zero timeout timer,so it run once per loop iteration after the poll,
+//and sqes taken by callbacks meanwhile go to the kernel together
+static inline void
+uring_schedule(uring_t* ring) {
+	if ( !ring->flushing ) {
+		struct timeval tv = { 0, 0 };
+		ring->flushing = 1;
+		event_add(ring->flush, &tv);
+	}
+}
+
+//copy what the cq hold aside without running it,callers of uring_sqe are not ready for callbacks
+static void
+uring_stash(uring_t* ring) {
+	unsigned head = *ring->cq_head;
+	unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	for ( ; head != tail; head++ ) {
+		if ( ring->backlog_count == ring->backlog_size ) {
+			ring->backlog_size = ring->backlog_size ? ring->backlog_size * 2 : URING_ENTRIES;
+			ring->backlog = realloc(ring->backlog, sizeof( *ring->backlog ) * ring->backlog_size);
+		}
+		ring->backlog[ring->backlog_count++] = ring->cqes[head & *ring->cq_mask];
+	}
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static struct io_uring_sqe*
+uring_sqe(ev_loop_ctx_t* loop_ctx, void* owner, int op) {
+	uring_t* ring = loop_ctx->uring;
+	unsigned tail = *ring->sq_tail;
+	//a slot is reused only once the kernel consumed it,submit refused(EBUSY) want cq room
+	while ( tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries ) {
+		uring_submit(ring);
+		if ( tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) < ring->sq_entries ) {
+			break;
+		}
+		syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		uring_stash(ring);
+	}
+	unsigned index = tail & *ring->sq_mask;
+	struct io_uring_sqe* sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof( *sqe ));
+	sqe->user_data = (uint64_t)(uintptr_t)owner | op;
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->sq_pending++;
+	ring->inflight++;
+	uring_schedule(ring);
+	return sqe;
+}
+
+//every request on fd,or the one owner has for op when fd < 0
+static void
+uring_cancel(ev_loop_ctx_t* loop_ctx, int fd, void* owner, int op) {
+	struct io_uring_sqe* sqe = uring_sqe(loop_ctx, NULL, URING_OP_CANCEL);
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = fd;
+	if ( fd >= 0 ) {
+		sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+	}
+	else {
+		sqe->addr = (uint64_t)(uintptr_t)owner | op;
+	}
+}
+
+static void
+uring_accept(ev_listener_t* listener) {
+	uring_t* ring = listener->loop_ctx->uring;
+	struct io_uring_sqe* sqe = uring_sqe(listener->loop_ctx, listener, URING_OP_ACCEPT);
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = listener->fd;
+	if ( ring->multishot_accept ) {
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	}
+	listener->inflight++;
+}
+
+//multishot recv into the provided buffers,the kernel pick one per completion
+static void
+uring_recv(ev_session_t* ev_session) {
+	uring_t* ring = ev_session->loop_ctx->uring;
+	struct io_uring_sqe* sqe = uring_sqe(ev_session->loop_ctx, ev_session, URING_OP_RECV);
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = ev_session->fd;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BUFFER_GROUP;
+	if ( ring->multishot_recv ) {
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+	}
+	ev_session->recv_armed = URING_OP_RECV;
+	ev_session->inflight++;
+}
+
+//the provided buffers ran out,read once into a pooled chunk and go back to them after
+static void
+uring_recv_one(ev_session_t* ev_session) {
+	ev_loop_ctx_t* loop_ctx = ev_session->loop_ctx;
+	data_buffer_t* db = buffer_next(loop_ctx);
+	db->size = URING_BUFFER_SIZE;
+	db->data = chunk_alloc(loop_ctx, db->size);
+	ev_session->recv_chunk = db;
+
+	struct io_uring_sqe* sqe = uring_sqe(loop_ctx, ev_session, URING_OP_RECV_ONE);
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = ev_session->fd;
+	sqe->addr = (uint64_t)(uintptr_t)db->data;
+	sqe->len = db->size;
+	ev_session->recv_armed = URING_OP_RECV_ONE;
+	ev_session->inflight++;
+}
+
+//one sendmsg in flight per session gathering up to URING_IOV queued chunks,
+//what a short send leave is sent again from its completion
+static void
+uring_sendmsg(ev_session_t* ev_session) {
+	uring_send_t* io = ev_session->send_io;
+	if ( !io ) {
+		io = malloc(sizeof( *io ));
+		ev_session->send_io = io;
+	}
+	int count = 0;
+	data_buffer_t* wdb;
+	for ( wdb = ev_session->output.head; wdb && count < URING_IOV; wdb = wdb->next ) {
+		int left = wdb->wpos - wdb->rpos;
+		if ( left > 0 ) {
+			io->iov[count].iov_base = (char*)wdb->data + wdb->rpos;
+			io->iov[count].iov_len = left;
+			count++;
+		}
+	}
+	if ( count == 0 ) {
+		return;
+	}
+	memset(&io->msg, 0, sizeof( io->msg ));
+	io->msg.msg_iov = io->iov;
+	io->msg.msg_iovlen = count;
+
+	struct io_uring_sqe* sqe = uring_sqe(ev_session->loop_ctx, ev_session, URING_OP_SEND);
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = ev_session->fd;
+	sqe->addr = (uint64_t)(uintptr_t)&io->msg;
+	sqe->len = 1;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	ev_session->sending = 1;
+	ev_session->inflight++;
+}
+
+//the sendmsg is built at the flush,so every write of the iteration go out together
+//instead of the first one alone and the rest as a small segment held by nagle
+static void
+uring_send(ev_session_t* ev_session) {
+	if ( ev_session->send_queued ) {
+		return;
+	}
+	uring_t* ring = ev_session->loop_ctx->uring;
+	ev_session->send_queued = 1;
+	ev_session->inflight++;
+	ev_session->send_next = ring->send_queue;
+	ring->send_queue = ev_session;
+	uring_schedule(ring);
+}
+
+//writable with nothing queued,for a connect in progress
+static void
+uring_poll(ev_session_t* ev_session) {
+	struct io_uring_sqe* sqe = uring_sqe(ev_session->loop_ctx, ev_session, URING_OP_POLL);
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = ev_session->fd;
+	sqe->poll32_events = POLLOUT;
+	ev_session->polling = 1;
+	ev_session->inflight++;
+}
+
+static void
+uring_enable(ev_session_t* ev_session, int ev) {
+	if ( ev & EV_READ ) {
+		ev_session->read_enabled = 1;
+		if ( !ev_session->recv_armed ) {
+			uring_recv(ev_session);
+		}
+	}
+	if ( ev & EV_WRITE ) {
+		if ( ev_session->output.head ) {
+			if ( !ev_session->sending ) {
+				uring_send(ev_session);
+			}
+		}
+		else if ( !ev_session->polling ) {
+			uring_poll(ev_session);
+		}
+	}
+}
+
+//a send in flight is left to finish,a recv or poll is cancelled
+static void
+uring_disable(ev_session_t* ev_session, int ev) {
+	if ( ev & EV_READ ) {
+		ev_session->read_enabled = 0;
+		if ( ev_session->recv_armed ) {
+			uring_cancel(ev_session->loop_ctx, -1, ev_session, ev_session->recv_armed);
+		}
+	}
+	if ( ev & EV_WRITE ) {
+		if ( ev_session->polling ) {
+			uring_cancel(ev_session->loop_ctx, -1, ev_session, URING_OP_POLL);
+		}
+	}
+}
+
+static void
+uring_session_reclaim(ev_session_t* ev_session) {
+	closesocket(ev_session->fd);
+	buffer_release(ev_session->loop_ctx, &ev_session->input);
+	buffer_release(ev_session->loop_ctx, &ev_session->output);
+	free(ev_session->send_io);
+	free(ev_session);
+}
+
+//nothing reach the callbacks of a zombie or of a ring being torn down
+static inline int
+uring_session_dead(ev_session_t* ev_session) {
+	if ( ev_session->zombie ) {
+		if ( ev_session->inflight == 0 ) {
+			uring_session_reclaim(ev_session);
+		}
+		return 1;
+	}
+	return ev_session->loop_ctx->uring->closing || !ev_session->alive;
+}
+
+static void
+uring_send_flush(ev_loop_ctx_t* loop_ctx) {
+	uring_t* ring = loop_ctx->uring;
+	while ( ring->send_queue ) {
+		ev_session_t* ev_session = ring->send_queue;
+		ring->send_queue = ev_session->send_next;
+		ev_session->send_queued = 0;
+		ev_session->inflight--;
+		if ( uring_session_dead(ev_session) ) {
+			continue;
+		}
+		if ( !ev_session->sending ) {
+			uring_sendmsg(ev_session);
+		}
+	}
+}
+
+static void
+uring_session_fail(ev_session_t* ev_session) {
+	uring_disable(ev_session, EV_READ | EV_WRITE);
+	ev_session->alive = 0;
+	if ( ev_session->event_cb ) {
+		ev_session->event_cb(ev_session, ev_session->userdata);
+	}
+}
+
+//the next recv is armed before read_cb,which may free the session
+static void
+uring_received(ev_session_t* ev_session, int res) {
+	if ( res == -ENOBUFS ) {
+		if ( ev_session->read_enabled && !ev_session->recv_armed ) {
+			uring_recv_one(ev_session);
+		}
+		return;
+	}
+	if ( res > 0 || res == -ECANCELED ) {
+		if ( ev_session->read_enabled && !ev_session->recv_armed ) {
+			uring_recv(ev_session);
+		}
+		if ( res > 0 && ev_session->read_enabled && ev_session->read_cb ) {
+			ev_session->read_cb(ev_session, ev_session->userdata);
+		}
+		return;
+	}
+	uring_session_fail(ev_session);
+}
+
+static void
+uring_recv_done(ev_session_t* ev_session, int res, unsigned flags) {
+	uring_t* ring = ev_session->loop_ctx->uring;
+	if ( !( flags & IORING_CQE_F_MORE ) ) {
+		ev_session->inflight--;
+		ev_session->recv_armed = 0;
+	}
+	if ( flags & IORING_CQE_F_BUFFER ) {
+		int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+		if ( res > 0 ) {
+			data_buffer_t* db = buffer_next(ev_session->loop_ctx);
+			db->data = ring->buffers + (size_t)bid * URING_BUFFER_SIZE;
+			db->size = URING_BUFFER_SIZE;
+			db->wpos = res;
+			buffer_append(&ev_session->input, db);
+		}
+		else {
+			uring_buffer_put(ring, bid);
+		}
+	}
+	if ( uring_session_dead(ev_session) ) {
+		return;
+	}
+	//kernel without multishot recv,arm one recv per completion from now on
+	if ( res == -EINVAL && ring->multishot_recv ) {
+		ring->multishot_recv = 0;
+		res = -ECANCELED;
+	}
+	uring_received(ev_session, res);
+}
+
+static void
+uring_recv_one_done(ev_session_t* ev_session, int res) {
+	ev_session->inflight--;
+	ev_session->recv_armed = 0;
+	data_buffer_t* db = ev_session->recv_chunk;
+	ev_session->recv_chunk = NULL;
+	if ( res > 0 ) {
+		db->wpos = res;
+		buffer_append(&ev_session->input, db);
+	}
+	else {
+		chunk_release(ev_session->loop_ctx, db->data, db->size);
+		buffer_reclaim(ev_session->loop_ctx, db);
+	}
+	if ( uring_session_dead(ev_session) ) {
+		return;
+	}
+	uring_received(ev_session, res);
+}
+
+static void
+uring_send_done(ev_session_t* ev_session, int res) {
+	ev_session->inflight--;
+	ev_session->sending = 0;
+	if ( uring_session_dead(ev_session) ) {
+		return;
+	}
+	if ( res < 0 ) {
+		uring_session_fail(ev_session);
+		return;
+	}
+	buffer_consume(ev_session->loop_ctx, &ev_session->output, res);
+	if ( ev_session->output.head ) {
+		uring_send(ev_session);
+		return;
+	}
 	assert(ev_session->output.total == 0);
 	if ( ev_session->write_cb ) {
 		ev_session->write_cb(ev_session, ev_session->userdata);
 	}
 }
 
+static void
+uring_poll_done(ev_session_t* ev_session, int res) {
+	ev_session->inflight--;
+	ev_session->polling = 0;
+	if ( uring_session_dead(ev_session) || res == -ECANCELED ) {
+		return;
+	}
+	if ( res < 0 ) {
+		uring_session_fail(ev_session);
+		return;
+	}
+	if ( ev_session->output.head ) {
+		if ( !ev_session->sending ) {
+			uring_send(ev_session);
+		}
+		return;
+	}
+	if ( ev_session->write_cb ) {
+		ev_session->write_cb(ev_session, ev_session->userdata);
+	}
+}
+
+//the accept is armed again before accept_cb,which may free the listener
+static void
+uring_accept_done(ev_listener_t* listener, int res, unsigned flags) {
+	uring_t* ring = listener->loop_ctx->uring;
+	int more = flags & IORING_CQE_F_MORE;
+	if ( !more ) {
+		listener->inflight--;
+	}
+	if ( listener->zombie || ring->closing ) {
+		if ( res >= 0 ) {
+			closesocket(res);
+		}
+		if ( listener->zombie && listener->inflight == 0 ) {
+			closesocket(listener->fd);
+			free(listener);
+		}
+		return;
+	}
+	if ( !more ) {
+		//kernel without multishot accept,arm one accept per completion from now on
+		if ( res == -EINVAL && ring->multishot_accept ) {
+			ring->multishot_accept = 0;
+			uring_accept(listener);
+			return;
+		}
+		if ( res != -ECANCELED ) {
+			uring_accept(listener);
+		}
+	}
+	if ( res < 0 ) {
+		if ( res != -ECANCELED ) {
+			fprintf(stderr, "accept fd error:%s\n", strerror(-res));
+		}
+		return;
+	}
+
+	char ip[INET6_ADDRSTRLEN] = { 0 };
+	char addr[HOST_SIZE] = { 0 };
+	int port = 0;
+	if ( get_peername(res, ip, sizeof( ip ), &port) == 0 ) {
+		_snprintf(addr, HOST_SIZE, "%s:%d", ip, port);
+	}
+	else {
+		_snprintf(addr, HOST_SIZE, "ipc:unknown");
+	}
+	socket_keep_alive(res);
+	listener->accept_cb(listener, res, addr, listener->userdata);
+}
+
+static void
+uring_complete(ev_loop_ctx_t* loop_ctx, struct io_uring_cqe* cqe) {
+	uring_t* ring = loop_ctx->uring;
+	int op = (int)( cqe->user_data & URING_OP_MASK );
+	void* owner = (void*)(uintptr_t)( cqe->user_data & ~(uint64_t)URING_OP_MASK );
+	if ( !( cqe->flags & IORING_CQE_F_MORE ) ) {
+		ring->inflight--;
+	}
+	switch ( op ) {
+		case URING_OP_ACCEPT:
+			uring_accept_done(owner, cqe->res, cqe->flags);
+			break;
+		case URING_OP_RECV:
+			uring_recv_done(owner, cqe->res, cqe->flags);
+			break;
+		case URING_OP_RECV_ONE:
+			uring_recv_one_done(owner, cqe->res);
+			break;
+		case URING_OP_SEND:
+			uring_send_done(owner, cqe->res);
+			break;
+		case URING_OP_POLL:
+			uring_poll_done(owner, cqe->res);
+			break;
+		default:
+			break;
+	}
+}
+
+static void
+uring_reap(ev_loop_ctx_t* loop_ctx) {
+	uring_t* ring = loop_ctx->uring;
+	//the backlog may grow while it is handled,entries are copied out before each callback
+	unsigned i;
+	for ( i = 0; i < ring->backlog_count; i++ ) {
+		struct io_uring_cqe cqe = ring->backlog[i];
+		uring_complete(loop_ctx, &cqe);
+	}
+	ring->backlog_count = 0;
+	for ( ;; ) {
+		unsigned head = *ring->cq_head;
+		if ( head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE) ) {
+			//completions the ring had no room for wait in the kernel until asked for
+			if ( !( __atomic_load_n(ring->sq_flags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW ) ) {
+				break;
+			}
+			syscall(__NR_io_uring_enter, ring->fd, 0, 0, IORING_ENTER_GETEVENTS, NULL, 0);
+			if ( head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE) ) {
+				break;
+			}
+		}
+		struct io_uring_cqe cqe = ring->cqes[head & *ring->cq_mask];
+		__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+		uring_complete(loop_ctx, &cqe);
+	}
+}
+
+static void
+_uring_cb(evutil_socket_t fd, short events, void* userdata) {
+	uring_reap(userdata);
+}
+
+//the sqes of the last iteration go in one io_uring_enter,and what that already completed
+//is handled right away instead of waiting for the ring fd to turn readable
+static void
+_uring_flush_cb(evutil_socket_t fd, short events, void* userdata) {
+	ev_loop_ctx_t* loop_ctx = userdata;
+	uring_t* ring = loop_ctx->uring;
+	ring->flushing = 0;
+	uring_send_flush(loop_ctx);
+	uring_submit(ring);
+	uring_reap(loop_ctx);
+	if ( ring->sq_pending > 0 ) {
+		uring_schedule(ring);
+	}
+}
+
+static void
+uring_free(uring_t* ring) {
+	if ( ring->rio ) {
+		event_free(ring->rio);
+	}
+	if ( ring->flush ) {
+		event_free(ring->flush);
+	}
+	if ( ring->sqes ) {
+		munmap(ring->sqes, ring->sqes_size);
+	}
+	if ( ring->ring_ptr ) {
+		munmap(ring->ring_ptr, ring->ring_size);
+	}
+	close(ring->fd);
+	if ( ring->br ) {
+		munmap(ring->br, sizeof( struct io_uring_buf ) * URING_BUFFER_COUNT);
+	}
+	free(ring->buffers);
+	free(ring->backlog);
+	free(ring);
+}
+
+//NULL when the kernel lack io_uring or provided buffer rings(5.19),the loop stay on libevent then
+static uring_t*
+uring_create(ev_loop_ctx_t* loop_ctx) {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof( params ));
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = URING_ENTRIES * 4;
+	int fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+	if ( fd < 0 ) {
+		return NULL;
+	}
+	uring_t* ring = malloc(sizeof( *ring ));
+	memset(ring, 0, sizeof( *ring ));
+	ring->fd = fd;
+	if ( !( params.features & IORING_FEAT_SINGLE_MMAP ) || !( params.features & IORING_FEAT_NODROP ) ) {
+		uring_free(ring);
+		return NULL;
+	}
+
+	size_t sq_size = params.sq_off.array + params.sq_entries * sizeof( unsigned );
+	size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof( struct io_uring_cqe );
+	ring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+	void* ptr = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if ( ptr == MAP_FAILED ) {
+		uring_free(ring);
+		return NULL;
+	}
+	ring->ring_ptr = ptr;
+	ring->sqes_size = params.sq_entries * sizeof( struct io_uring_sqe );
+	ptr = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if ( ptr == MAP_FAILED ) {
+		uring_free(ring);
+		return NULL;
+	}
+	ring->sqes = ptr;
+
+	char* base = ring->ring_ptr;
+	ring->sq_entries = params.sq_entries;
+	ring->sq_head = (unsigned*)( base + params.sq_off.head );
+	ring->sq_tail = (unsigned*)( base + params.sq_off.tail );
+	ring->sq_mask = (unsigned*)( base + params.sq_off.ring_mask );
+	ring->sq_flags = (unsigned*)( base + params.sq_off.flags );
+	ring->sq_array = (unsigned*)( base + params.sq_off.array );
+	ring->cq_head = (unsigned*)( base + params.cq_off.head );
+	ring->cq_tail = (unsigned*)( base + params.cq_off.tail );
+	ring->cq_mask = (unsigned*)( base + params.cq_off.ring_mask );
+	ring->cqes = (struct io_uring_cqe*)( base + params.cq_off.cqes );
+
+	ptr = mmap(NULL, sizeof( struct io_uring_buf ) * URING_BUFFER_COUNT, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if ( ptr == MAP_FAILED ) {
+		uring_free(ring);
+		return NULL;
+	}
+	ring->br = ptr;
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof( reg ));
+	reg.ring_addr = (uint64_t)(uintptr_t)ring->br;
+	reg.ring_entries = URING_BUFFER_COUNT;
+	reg.bgid = URING_BUFFER_GROUP;
+	if ( syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0 ) {
+		uring_free(ring);
+		return NULL;
+	}
+	ring->buffers = malloc((size_t)URING_BUFFER_COUNT * URING_BUFFER_SIZE);
+	int i;
+	for ( i = 0; i < URING_BUFFER_COUNT; i++ ) {
+		uring_buffer_put(ring, i);
+	}
+
+	ring->multishot_accept = 1;
+	ring->multishot_recv = 1;
+	ring->rio = event_new(loop_ctx->loop, fd, EV_READ | EV_PERSIST, _uring_cb, loop_ctx);
+	ring->flush = evtimer_new(loop_ctx->loop, _uring_flush_cb, loop_ctx);
+	event_add(ring->rio, NULL);
+	return ring;
+}
+
+//cancel whatever is still in flight and wait it out,zombies are reclaimed on the way
+static void
+uring_release(ev_loop_ctx_t* loop_ctx) {
+	uring_t* ring = loop_ctx->uring;
+	ring->closing = 1;
+	uring_send_flush(loop_ctx);
+	if ( ring->inflight > 0 ) {
+		struct io_uring_sqe* sqe = uring_sqe(loop_ctx, NULL, URING_OP_CANCEL);
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->fd = -1;
+		sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY | IORING_ASYNC_CANCEL_ALL;
+	}
+	while ( ring->inflight > 0 ) {
+		uring_submit(ring);
+		syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		uring_reap(loop_ctx);
+	}
+	uring_free(ring);
+	loop_ctx->uring = NULL;
+}
+#endif
+
+//LOOP_BACKEND_URING fall back to libevent where io_uring is not usable,loop_ctx_backend tell which one run
 ev_loop_ctx_t*
-loop_ctx_create() {
+loop_ctx_create_backend(int backend) {
 	ev_loop_ctx_t* loop_ctx = malloc(sizeof(*loop_ctx));
 	memset(loop_ctx, 0, sizeof(*loop_ctx));
 	loop_ctx->loop = event_base_new();
+	loop_ctx->pool.high_water = CHUNK_HIGH_WATER;
+#ifdef SOCKET_URING
+	if ( backend == LOOP_BACKEND_URING ) {
+		loop_ctx->uring = uring_create(loop_ctx);
+	}
+#endif
 	return loop_ctx;
 }
 
+ev_loop_ctx_t*
+loop_ctx_create() {
+	return loop_ctx_create_backend(LOOP_BACKEND_EVENT);
+}
+
+int
+loop_ctx_backend(ev_loop_ctx_t* loop_ctx) {
+#ifdef SOCKET_URING
+	if ( loop_ctx->uring ) {
+		return LOOP_BACKEND_URING;
+	}
+#endif
+	return LOOP_BACKEND_EVENT;
+}
+
 void
 loop_ctx_release(ev_loop_ctx_t* loop_ctx) {
+#ifdef SOCKET_URING
+	if ( loop_ctx->uring ) {
+		uring_release(loop_ctx);
+	}
+#endif
 	event_base_free(loop_ctx->loop);
+	chunk_trim(loop_ctx, 0);
 
 	while ( loop_ctx->freelist ) {
 		data_buffer_t* tmp = loop_ctx->freelist;
@@ -272,11 +1219,12 @@ loop_ctx_now(ev_loop_ctx_t* loop_ctx) {
 	if ( status < 0 ) {
 		return -1;
 	}
-	return val.tv_sec + val.tv_usec / 1000000;
+	return val.tv_sec + val.tv_usec / 1000000.0;
 }
 
 void
 loop_ctx_clean(ev_loop_ctx_t* loop_ctx) {
+	chunk_trim(loop_ctx, 0);
 	while ( loop_ctx->freelist ) {
 		data_buffer_t* tmp = loop_ctx->freelist;
 		loop_ctx->freelist = loop_ctx->freelist->next;
@@ -284,6 +1232,27 @@ loop_ctx_clean(ev_loop_ctx_t* loop_ctx) {
 	}
 }
 
+//cached chunks beyond high_water bytes are freed instead of kept
+void
+loop_ctx_high_water(ev_loop_ctx_t* loop_ctx, size_t high_water) {
+	loop_ctx->pool.high_water = high_water;
+	chunk_trim(loop_ctx, high_water);
+}
+
+void
+loop_ctx_chunk_stats(ev_loop_ctx_t* loop_ctx, struct chunk_stats* stats) {
+	chunk_pool_t* pool = &loop_ctx->pool;
+	stats->cached = pool->cached;
+	stats->high_water = pool->high_water;
+	stats->hit = pool->hit;
+	stats->miss = pool->miss;
+	stats->trim = pool->trim;
+	int i;
+	for ( i = 0; i < CHUNK_CLASS_MAX; i++ ) {
+		stats->count[i] = pool->count[i];
+	}
+}
+
 ev_listener_t*
 ev_listener_bind(struct ev_loop_ctx* loop_ctx, struct sockaddr* addr, int addrlen, int backlog, int flag, listener_callback accept_cb, void* userdata) {
 	int fd = socket_listen(addr, addrlen, backlog, flag);
@@ -291,11 +1260,20 @@ ev_listener_bind(struct ev_loop_ctx* loop_ctx, struct sockaddr* addr, int addrle
 		return NULL;
 	}
 	ev_listener_t* listener = malloc(sizeof(*listener));
+	memset(listener, 0, sizeof(*listener));
 	listener->loop_ctx = loop_ctx;
 	listener->fd = fd;
 	listener->accept_cb = accept_cb;
 	listener->userdata = userdata;
-	listener->rio = event_new(loop_ctx->loop, fd, EV_READ, _ev_accept_cb, listener);
+#ifdef SOCKET_URING
+	if ( loop_ctx->uring ) {
+		//the ring wait for the connection itself,a blocking fd keep it from returning EAGAIN
+		socket_nonblock(fd, false);
+		uring_accept(listener);
+		return listener;
+	}
+#endif
+	listener->rio = event_new(loop_ctx->loop, fd, EV_READ | EV_PERSIST, _ev_accept_cb, listener);
 	event_add(listener->rio, NULL);
 	return listener;
 }
@@ -324,6 +1302,18 @@ ev_listener_addr(ev_listener_t* listener, char* addr, size_t length, int* port)
 
 void
 ev_listener_free(ev_listener_t* listener) {
+#ifdef SOCKET_URING
+	if ( listener->loop_ctx->uring ) {
+		if ( listener->inflight > 0 ) {
+			listener->zombie = 1;
+			uring_cancel(listener->loop_ctx, listener->fd, NULL, 0);
+			return;
+		}
+		closesocket(listener->fd);
+		free(listener);
+		return;
+	}
+#endif
 	if ( event_pending(listener->rio, EV_READ, NULL) ) {
 		event_del(listener->rio);
 	}
@@ -340,11 +1330,19 @@ ev_session_bind(struct ev_loop_ctx* loop_ctx, int fd, int max) {
 	ev_session->fd = fd;
 	ev_session->max = max;
 	ev_session->threshold = MIN_BUFFER_SIZE;
+	ev_session->alive = 1;
+	socket_no_sigpipe(fd);
 
-	ev_session->rio = event_new(loop_ctx->loop, fd, EV_READ, _ev_read_cb, ev_session);
-	ev_session->wio = event_new(loop_ctx->loop, fd, EV_WRITE, _ev_write_cb, ev_session);
+#ifdef SOCKET_URING
+	if ( loop_ctx->uring ) {
+		socket_nonblock(fd, false);
+		return ev_session;
+	}
+#endif
 
-	ev_session->alive = 1;
+	//both persist,read stay armed across callbacks and a partial flush wait for the next writable
+	ev_session->rio = event_new(loop_ctx->loop, fd, EV_READ | EV_PERSIST, _ev_read_cb, ev_session);
+	ev_session->wio = event_new(loop_ctx->loop, fd, EV_WRITE | EV_PERSIST, _ev_write_cb, ev_session);
 
 	return ev_session;
 }
@@ -370,13 +1368,25 @@ ev_session_connect(struct ev_loop_ctx* loop_ctx, struct sockaddr* addr, int addr
 void
 ev_session_free(ev_session_t* ev_session) {
 	ev_session->alive = 0;
+#ifdef SOCKET_URING
+	if ( ev_session->loop_ctx->uring ) {
+		ev_session->read_enabled = 0;
+		if ( ev_session->inflight > 0 ) {
+			ev_session->zombie = 1;
+			uring_cancel(ev_session->loop_ctx, ev_session->fd, NULL, 0);
+			return;
+		}
+		uring_session_reclaim(ev_session);
+		return;
+	}
+#endif
 	ev_session_disable(ev_session, EV_READ | EV_WRITE);
 	event_free(ev_session->rio);
 	event_free(ev_session->wio);
 	closesocket(ev_session->fd);
 
-	buffer_release(&ev_session->input);
-	buffer_release(&ev_session->output);
+	buffer_release(ev_session->loop_ctx, &ev_session->input);
+	buffer_release(ev_session->loop_ctx, &ev_session->output);
 
 	free(ev_session);
 }
@@ -391,6 +1401,12 @@ ev_session_setcb(ev_session_t* ev_session, ev_session_callback read_cb, ev_sessi
 
 void
 ev_session_enable(ev_session_t* ev_session, int ev) {
+#ifdef SOCKET_URING
+	if ( ev_session->loop_ctx->uring ) {
+		uring_enable(ev_session, ev);
+		return;
+	}
+#endif
 	if ( ev & EV_READ ) {
 		if ( !event_pending(ev_session->rio, EV_READ, NULL) ) {
 			event_add(ev_session->rio, NULL);
@@ -405,6 +1421,12 @@ ev_session_enable(ev_session_t* ev_session, int ev) {
 
 void
 ev_session_disable(ev_session_t* ev_session, int ev) {
+#ifdef SOCKET_URING
+	if ( ev_session->loop_ctx->uring ) {
+		uring_disable(ev_session, ev);
+		return;
+	}
+#endif
 	if ( ev & EV_READ ) {
 		if ( event_pending(ev_session->rio, EV_READ, NULL) ) {
 			event_del(ev_session->rio);
@@ -432,6 +1454,62 @@ ev_session_output_size(ev_session_t* ev_session) {
 	return ev_session->output.total;
 }
 
+//whether a write may try the socket right away,with io_uring everything is queued
+//and go out in the sendmsg submitted at the end of the round
+static inline int
+write_direct(ev_session_t* ev_session) {
+#ifdef SOCKET_URING
+	if ( ev_session->loop_ctx->uring ) {
+		return 0;
+	}
+#endif
+	return !event_pending(ev_session->wio, EV_WRITE, NULL);
+}
+
+static inline int
+bit_scan(unsigned int mask) {
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return (int)index;
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+
+//first c in data,32 or 16 bytes per compare where the target has AVX2 or SSE2
+static inline const char*
+find_byte(const char* data, size_t size, char c) {
+	size_t i = 0;
+#if defined( __AVX2__ )
+	__m256i needle32 = _mm256_set1_epi8(c);
+	for ( ; i + 32 <= size; i += 32 ) {
+		__m256i block = _mm256_loadu_si256((const __m256i*)( data + i ));
+		unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, needle32));
+		if ( mask ) {
+			return data + i + bit_scan(mask);
+		}
+	}
+#endif
+#if defined( SCAN_SSE2 )
+	__m128i needle = _mm_set1_epi8(c);
+	for ( ; i + 16 <= size; i += 16 ) {
+		__m128i block = _mm_loadu_si128((const __m128i*)( data + i ));
+		unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(block, needle));
+		if ( mask ) {
+			return data + i + bit_scan(mask);
+		}
+	}
+#endif
+	for ( ; i < size; i++ ) {
+		if ( data[i] == c ) {
+			return data + i;
+		}
+	}
+	return NULL;
+}
+
+//whether sep start at from in db,following the chain when it straddle chunks
 static inline int
 check_eol(data_buffer_t* db, int from, const char* sep, size_t sep_len) {
 	while ( db ) {
@@ -444,37 +1522,89 @@ check_eol(data_buffer_t* db, int from, const char* sep, size_t sep_len) {
 			if ( memcmp((char*)db->data + from, sep, sz) ) {
 				return 0;
 			}
+			sep += sz;
+			sep_len -= sz;
 		}
 		db = db->next;
-		sep += sz;
-		sep_len -= sz;
-		from = 0;
+		if ( db ) {
+			from = db->rpos;
+		}
 	}
 	return 0;
 }
 
+static inline void
+scan_forward(ev_session_t* ev_session, size_t size) {
+	ev_session->scan_offset = ev_session->scan_offset > (int)size ? ev_session->scan_offset - (int)size : 0;
+	ev_session->scan_chunk = NULL;
+}
+
+//length up to and including sep,-1 if not there yet.
+//candidates come from the first byte of sep,and the search resume where the last one for
+//the same sep gave up,so a header arriving in small pieces is scanned once instead of once per piece
 static inline int
 search_eol(ev_session_t* ev_session, const char* sep, size_t sep_len) {
+	int remember = sep_len <= SCAN_SEP_MAX;
+	if ( !remember || ev_session->scan_sep_len != (int)sep_len || memcmp(ev_session->scan_sep, sep, sep_len) ) {
+		ev_session->scan_offset = 0;
+		ev_session->scan_chunk = NULL;
+		if ( remember ) {
+			memcpy(ev_session->scan_sep, sep, sep_len);
+			ev_session->scan_sep_len = sep_len;
+		}
+	}
+
+	int start = ev_session->scan_offset;
 	data_buffer_t* current = ev_session->input.head;
 	int offset = 0;
+	if ( ev_session->scan_chunk ) {
+		current = ev_session->scan_chunk;
+		offset = ev_session->scan_chunk_offset;
+	}
+	data_buffer_t* last = NULL;
+	int last_offset = 0;
 	while ( current ) {
-		int i = current->rpos;
-		for ( ; i < current->wpos; i++ ) {
-			int ret = check_eol(current, i, sep, sep_len);
-			if ( ret == 1 ) {
-				return offset + sep_len;
+		const char* base = (char*)current->data + current->rpos;
+		int len = current->wpos - current->rpos;
+		int from = start > offset ? start - offset : 0;
+		while ( from < len ) {
+			const char* hit = find_byte(base + from, len - from, sep[0]);
+			if ( !hit ) {
+				break;
+			}
+			int i = (int)( hit - base );
+			if ( check_eol(current, current->rpos + i, sep, sep_len) ) {
+				if ( remember ) {
+					ev_session->scan_offset = offset + i;
+					ev_session->scan_chunk = current;
+					ev_session->scan_chunk_offset = offset;
+				}
+				return offset + i + sep_len;
 			}
-			++offset;
+			from = i + 1;
 		}
+		last = current;
+		last_offset = offset;
+		offset += len;
 		current = current->next;
 	}
 
+	//a match may still start in the last sep_len - 1 bytes
+	if ( remember ) {
+		int next = offset - (int)sep_len + 1;
+		ev_session->scan_offset = next > 0 ? next : 0;
+		ev_session->scan_chunk = NULL;
+		if ( last && last_offset <= ev_session->scan_offset ) {
+			ev_session->scan_chunk = last;
+			ev_session->scan_chunk_offset = last_offset;
+		}
+	}
 	return -1;
 }
 
 size_t
 ev_session_read(struct ev_session* ev_session, char* result, size_t size) {
-	if ( (int)size > ev_session->input.total )
+	if ( size > (size_t)ev_session->input.total )
 		size = ev_session->input.total;
 
 	int offset = 0;
@@ -494,7 +1624,7 @@ ev_session_read(struct ev_session* ev_session, char* result, size_t size) {
 			memcpy(result + offset, (char*)rdb->data + rdb->rpos, left);
 			offset += left;
 			need -= left;
-			free(rdb->data);
+			chunk_release(ev_session->loop_ctx, rdb->data, rdb->size);
 
 			data_buffer_t* tmp = ev_session->input.head;
 
@@ -508,10 +1638,113 @@ ev_session_read(struct ev_session* ev_session, char* result, size_t size) {
 		}
 	}
 	ev_session->input.total -= size;
+	scan_forward(ev_session, size);
+
+	return size;
+}
+
+//length up to and including the separator,-1 if it has not arrived
+int
+ev_session_search(ev_session_t* ev_session, const char* sep, size_t size) {
+	return search_eol(ev_session, sep, size);
+}
+
+size_t
+ev_session_drain(ev_session_t* ev_session, size_t size) {
+	if ( size > (size_t)ev_session->input.total )
+		size = ev_session->input.total;
+
+	int need = size;
+	while ( need > 0 ) {
+		data_buffer_t* rdb = ev_session->input.head;
+		int left = rdb->wpos - rdb->rpos;
+		if ( need < left ) {
+			rdb->rpos += need;
+			need = 0;
+		}
+		else {
+			need -= left;
+			chunk_release(ev_session->loop_ctx, rdb->data, rdb->size);
+			ev_session->input.head = rdb->next;
+			if ( ev_session->input.head == NULL ) {
+				ev_session->input.tail = NULL;
+				assert(need == 0);
+			}
+			buffer_reclaim(ev_session->loop_ctx, rdb);
+		}
+	}
+	ev_session->input.total -= size;
+	scan_forward(ev_session, size);
 
 	return size;
 }
 
+//make the first size bytes contiguous,copy only when they straddle chunks
+char*
+ev_session_pullup(ev_session_t* ev_session, size_t size) {
+	if ( size == 0 || size > (size_t)ev_session->input.total ) {
+		return NULL;
+	}
+	data_buffer_t* head = ev_session->input.head;
+	while ( head->rpos == head->wpos ) {
+		ev_session->scan_chunk = NULL;
+		ev_session->input.head = head->next;
+		chunk_release(ev_session->loop_ctx, head->data, head->size);
+		buffer_reclaim(ev_session->loop_ctx, head);
+		head = ev_session->input.head;
+	}
+	if ( head->wpos - head->rpos >= (int)size ) {
+		return (char*)head->data + head->rpos;
+	}
+
+	//the bytes move but stay in front,so the scan position stand
+	int scan_offset = ev_session->scan_offset;
+	data_buffer_t* db = buffer_next(ev_session->loop_ctx);
+	db->size = size > MAX_BUFFER_SIZE ? (int)size : chunk_fit(size);
+	db->data = chunk_alloc(ev_session->loop_ctx, db->size);
+	ev_session_read(ev_session, db->data, size);
+	db->wpos = size;
+	ev_session->scan_offset = scan_offset;
+	ev_session->scan_chunk = NULL;
+
+	db->next = ev_session->input.head;
+	if ( db->next ) {
+		db->next->prev = db;
+	}
+	else {
+		ev_session->input.tail = db;
+	}
+	ev_session->input.head = db;
+	ev_session->input.total += size;
+	return db->data;
+}
+
+//borrowed views over the input chunks covering at most size bytes(0 for all),
+//they stay valid until the next read,drain or pullup
+int
+ev_session_peek(ev_session_t* ev_session, size_t size, struct ev_slice* slices, int count) {
+	data_buffer_t* current = ev_session->input.head;
+	size_t total = 0;
+	int i = 0;
+	while ( current && i < count ) {
+		size_t len = current->wpos - current->rpos;
+		if ( size > 0 && total + len > size ) {
+			len = size - total;
+		}
+		if ( len > 0 ) {
+			slices[i].data = (char*)current->data + current->rpos;
+			slices[i].size = len;
+			i++;
+			total += len;
+			if ( size > 0 && total == size ) {
+				break;
+			}
+		}
+		current = current->next;
+	}
+	return i;
+}
+
 char* ev_session_read_util(ev_session_t* ev_session, const char* sep, size_t size, char* out, size_t out_size, size_t* length) {
 	int offset = search_eol(ev_session, sep, size);
 	if ( offset < 0 ) {
@@ -531,7 +1764,7 @@ ev_session_write(ev_session_t* ev_session, char* data, size_t size) {
 	if ( ev_session->alive == 0 )
 		return -1;
 
-	if ( !event_pending(ev_session->wio, EV_WRITE, NULL) ) {
+	if ( write_direct(ev_session) ) {
 		int total = socket_write(ev_session->fd, data, size);
 		if ( total < 0 ) {
 			ev_session_disable(ev_session, EV_READ | EV_WRITE);
@@ -566,6 +1799,63 @@ ev_session_write(ev_session_t* ev_session, char* data, size_t size) {
 		wdb->wpos = size;
 		wdb->size = size;
 		buffer_append(&ev_session->output, wdb);
+		ev_session_enable(ev_session, EV_WRITE);
+		return 0;
+	}
+}
+
+//write from the caller's memory,only what the socket does not take now is copied,
+//into pooled chunks,filling the spare room of the last queued one first
+int
+ev_session_write_copy(ev_session_t* ev_session, const char* data, size_t size) {
+	if ( ev_session->alive == 0 )
+		return -1;
+	if ( size == 0 )
 		return 0;
+
+	int total = 0;
+	if ( write_direct(ev_session) ) {
+		total = socket_write(ev_session->fd, (char*)data, size);
+		if ( total < 0 ) {
+			ev_session_disable(ev_session, EV_READ | EV_WRITE);
+			ev_session->alive = 0;
+			if ( ev_session->event_cb )
+				ev_session->event_cb(ev_session, ev_session->userdata);
+			return -1;
+		}
+		if ( total == (int)size ) {
+			if ( ev_session->write_cb ) {
+				ev_session->write_cb(ev_session, ev_session->userdata);
+			}
+			return total;
+		}
+	}
+
+	size_t offset = total;
+	data_buffer_t* tail = ev_session->output.tail;
+	if ( tail && tail->size > tail->wpos ) {
+		size_t room = tail->size - tail->wpos;
+		if ( room > size - offset ) {
+			room = size - offset;
+		}
+		memcpy((char*)tail->data + tail->wpos, data + offset, room);
+		tail->wpos += room;
+		ev_session->output.total += room;
+		offset += room;
+	}
+	while ( offset < size ) {
+		data_buffer_t* wdb = buffer_next(ev_session->loop_ctx);
+		wdb->size = chunk_fit(size - offset);
+		wdb->data = chunk_alloc(ev_session->loop_ctx, wdb->size);
+		size_t n = size - offset;
+		if ( n > (size_t)wdb->size ) {
+			n = wdb->size;
+		}
+		memcpy(wdb->data, data + offset, n);
+		wdb->wpos = n;
+		buffer_append(&ev_session->output, wdb);
+		offset += n;
 	}
+	ev_session_enable(ev_session, EV_WRITE);
+	return total;
 }
@@ -8,20 +8,44 @@
 #define CONNECT_STATUS_CONNECTING 		1
 #define CONNECT_STATUS_CONNECT_FAIL		2
 
+#define LOOP_BACKEND_EVENT				0
+#define LOOP_BACKEND_URING				1
+
 struct ev_loop_ctx;
 struct ev_listener;
 struct ev_session;
 
+#define CHUNK_CLASS_MAX 13
+
+//pooled chunk sizes are 256 << i for count[i]
+struct chunk_stats {
+	size_t cached;
+	size_t high_water;
+	uint64_t hit;
+	uint64_t miss;
+	uint64_t trim;
+	int count[CHUNK_CLASS_MAX];
+};
+
+struct ev_slice {
+	const char* data;
+	size_t size;
+};
+
 typedef void(*listener_callback)(struct ev_listener*, int fd, const char* addr, void *userdata);
 typedef void(*ev_session_callback)(struct ev_session*, void *userdata);
 
 struct ev_loop_ctx* loop_ctx_create();
+struct ev_loop_ctx* loop_ctx_create_backend(int backend);
+int loop_ctx_backend(struct ev_loop_ctx* loop_ctx);
 void loop_ctx_release(struct ev_loop_ctx* loop_ctx);
 struct event_base* loop_ctx_get(struct ev_loop_ctx* loop_ctx);
 double loop_ctx_now(struct ev_loop_ctx* loop_ctx);
 void loop_ctx_dispatch(struct ev_loop_ctx* loop_ctx);
 void loop_ctx_break(struct ev_loop_ctx* loop_ctx);
 void loop_ctx_clean(struct ev_loop_ctx* loop_ctx);
+void loop_ctx_high_water(struct ev_loop_ctx* loop_ctx, size_t high_water);
+void loop_ctx_chunk_stats(struct ev_loop_ctx* loop_ctx, struct chunk_stats* stats);
 
 struct ev_listener* ev_listener_bind_ipv4(struct ev_loop_ctx* loop_ctx, const char* ip, uint16_t port, listener_callback accept_cb, void* userdata);
 struct ev_listener* ev_listener_bind(struct ev_loop_ctx* loop_ctx, struct sockaddr* addr, int addrlen, int backlog, int flag, listener_callback accept_cb, void* userdata);
@@ -40,6 +64,11 @@ size_t ev_session_input_size(struct ev_session* ev_session);
 size_t ev_session_output_size(struct ev_session* ev_session);
 size_t ev_session_read(struct ev_session* ev_session, char* data, size_t size);
 char* ev_session_read_util(struct ev_session* ev_session, const char* sep, size_t size, char* out, size_t out_size, size_t* length);
+int ev_session_search(struct ev_session* ev_session, const char* sep, size_t size);
+size_t ev_session_drain(struct ev_session* ev_session, size_t size);
+char* ev_session_pullup(struct ev_session* ev_session, size_t size);
+int ev_session_peek(struct ev_session* ev_session, size_t size, struct ev_slice* slices, int count);
 int ev_session_write(struct ev_session* ev_session, char* data, size_t size);
+int ev_session_write_copy(struct ev_session* ev_session, const char* data, size_t size);
 
 #endif
\ No newline at end of file
@@ -1,6 +1,15 @@
 ﻿#include "socket_util.h"
+#ifdef _WIN32
 #include <ws2ipdef.h>
 #include <WS2tcpip.h>
+#endif
+
+//a reset peer must come back as EPIPE,not as SIGPIPE killing the process
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
 int socket_nonblock(int fd, bool nonblocking) {
 #if defined( WIN32 )
 	u_long val = nonblocking ? 1 : 0;
@@ -21,6 +30,17 @@ int socket_keep_alive(int fd) {
 	return setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, (void*)&keepalive, sizeof(keepalive));
 }
 
+//where send can not be told per call(bsd,macos),the socket is told once
+int socket_no_sigpipe(int fd) {
+#if !defined( MSG_NOSIGNAL ) && defined( SO_NOSIGPIPE )
+	int on = 1;
+	return setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, (void*)&on, sizeof(on));
+#else
+	(void)fd;
+	return 0;
+#endif
+}
+
 int socket_reuse_addr(int fd) {
 	int one = 1;
 	return setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (void*)&one, sizeof(one));
@@ -90,6 +110,7 @@ socket_connect(struct sockaddr* addr, int addrlen, int block, int* connected) {
 		return -1;
 
 	socket_keep_alive(fd);
+	socket_no_sigpipe(fd);
 
 	int status;
 	if ( !block ) {
@@ -155,7 +176,7 @@ int
 socket_write(int fd, char* data, size_t size) {
 	int total = 0;
 	for ( ;; ) {
-		int sz = (int)write(fd, data, size);
+		int sz = (int)send(fd, data, size, SEND_FLAGS);
 		if ( sz < 0 )  {
 			switch ( errno )
 			{
@@ -183,6 +204,76 @@ socket_write(int fd, char* data, size_t size) {
 	return total;
 }
 
+//one scatter read,bytes read,0 at eof or -1 with errno(EAGAIN when drained)
+int
+socket_readv(int fd, struct iovec* iov, int count) {
+#ifdef _WIN32
+	WSABUF buf[IOV_MAX];
+	int i;
+	for ( i = 0; i < count; i++ ) {
+		buf[i].buf = iov[i].iov_base;
+		buf[i].len = (ULONG)iov[i].iov_len;
+	}
+	DWORD n = 0;
+	DWORD flags = 0;
+	if ( WSARecv(fd, buf, count, &n, &flags, NULL, NULL) != 0 ) {
+		errno = WSAGetLastError() == WSAEWOULDBLOCK ? EAGAIN : EIO;
+		return -1;
+	}
+	return (int)n;
+#else
+	for ( ;; ) {
+		int n = (int)readv(fd, iov, count);
+		if ( n < 0 && errno == EINTR ) {
+			continue;
+		}
+		return n;
+	}
+#endif
+}
+
+//one gather write,bytes written(0 when the socket is full) or -1 on error
+int
+socket_writev(int fd, struct iovec* iov, int count) {
+#ifdef _WIN32
+	WSABUF buf[IOV_MAX];
+	int i;
+	for ( i = 0; i < count; i++ ) {
+		buf[i].buf = iov[i].iov_base;
+		buf[i].len = (ULONG)iov[i].iov_len;
+	}
+	DWORD n = 0;
+	if ( WSASend(fd, buf, count, &n, 0, NULL, NULL) != 0 ) {
+		if ( WSAGetLastError() == WSAEWOULDBLOCK ) {
+			return 0;
+		}
+		fprintf(stderr, "send fd :%d error:%d\n", fd, WSAGetLastError());
+		return -1;
+	}
+	return (int)n;
+#else
+	struct msghdr msg;
+	memset(&msg, 0, sizeof( msg ));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = count;
+	for ( ;; ) {
+		int n = (int)sendmsg(fd, &msg, SEND_FLAGS);
+		if ( n < 0 ) {
+			switch ( errno ) {
+				case EINTR:
+					continue;
+				case EAGAIN:
+					return 0;
+				default:
+					fprintf(stderr, "send fd :%d error:%s\n", fd, strerror(errno));
+					return -1;
+			}
+		}
+		return n;
+	}
+#endif
+}
+
 int
 socket_udp_write(int fd, char* data, size_t size, struct sockaddr* addr, size_t addrlen) {
 	int total = 0;
@@ -225,6 +316,7 @@ socket_accept(int listen_fd, char* info, size_t length) {
 	}
 
 	socket_keep_alive(client_fd);
+	socket_no_sigpipe(client_fd);
 	socket_nonblock(client_fd, true);
 
 	if ( u.s.sa_family == AF_INET ) {
@@ -9,7 +9,28 @@
 #include <stdint.h>
 #include <assert.h>
 #include <string.h>
+#include <limits.h>
+
+#ifdef _WIN32
 #include <WinSock2.h>
+struct iovec {
+	void* iov_base;
+	size_t iov_len;
+};
+#else
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#define closesocket close
+#define _snprintf snprintf
+#endif
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
 
 #define HOST_SIZE 128
 
@@ -27,6 +48,7 @@ union sockaddr_all {
 int socket_nonblock(int fd, bool nonblocking);
 int socket_no_delay(int fd);
 int socket_keep_alive(int fd);
+int socket_no_sigpipe(int fd);
 int socket_reuse_addr(int fd);
 int socket_recv_buffer(int fd,int size);
 int socket_send_buffer(int fd,int size);
@@ -37,6 +59,8 @@ int socket_bind(struct sockaddr *addr, int addrlen, int flag,int protocol);
 int socket_accept(int fd,char* info,size_t length);
 int socket_read(int fd,char* data,size_t size);
 int socket_write(int fd,char* data,size_t size);
+int socket_readv(int fd,struct iovec* iov,int count);
+int socket_writev(int fd,struct iovec* iov,int count);
 int socket_udp_write(int fd,char* data,size_t size,struct sockaddr* addr,size_t addrlen);
 int socket_pipe_write(int fd, void* data, size_t size);
 int get_peername(int fd,char* out,size_t out_len,int* port);
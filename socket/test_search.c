@@ -0,0 +1,177 @@
+//randomized check of the separator search against a naive one,not part of the library build
+//cc -O2 -D_LINUX -I../lua.lib test_search.c socket_util.c -levent -o test_search(add -mavx2 for the wide path)
+#include "socket_tcp.c"
+#include <time.h>
+
+#define ROUNDS		20000
+#define SEARCH_INPUT	300
+
+static const char*
+naive_byte(const char* data, size_t size, char c) {
+	size_t i;
+	for ( i = 0; i < size; i++ ) {
+		if ( data[i] == c ) {
+			return data + i;
+		}
+	}
+	return NULL;
+}
+
+static int
+naive_eol(const char* data, int size, const char* sep, int sep_len) {
+	int i;
+	for ( i = 0; i + sep_len <= size; i++ ) {
+		if ( memcmp(data + i, sep, sep_len) == 0 ) {
+			return i + sep_len;
+		}
+	}
+	return -1;
+}
+
+//every offset and length around the 16 and 32 byte blocks,target at each position or absent
+static int
+check_find_byte() {
+	char data[160];
+	int checks = 0;
+	size_t offset, size, at;
+	for ( offset = 0; offset < 32; offset++ ) {
+		for ( size = 0; size + offset <= sizeof( data ); size++ ) {
+			for ( at = 0; at <= size; at++ ) {
+				memset(data, 'a', sizeof( data ));
+				if ( at < size ) {
+					data[offset + at] = '\n';
+					//a second hit further on must not win over the first
+					if ( at + 7 < size ) {
+						data[offset + at + 7] = '\n';
+					}
+				}
+				const char* got = find_byte(data + offset, size, '\n');
+				const char* want = naive_byte(data + offset, size, '\n');
+				checks++;
+				if ( got != want ) {
+					printf("find_byte fail offset %d size %d at %d\n", (int)offset, (int)size, (int)at);
+					return -1;
+				}
+			}
+		}
+	}
+	return checks;
+}
+
+//input arrive in random pieces,each in its own chunk with some consumed room before rpos,
+//the search run after every piece so it resume from where the last one stopped,
+//matches are read away or the head is pulled up now and then to move the chunk boundaries
+static int
+check_search_eol(ev_loop_ctx_t* loop_ctx) {
+	const char* seps[] = { "\r\n", "\r\n\r\n", "x", "abcab", "0123456789abcdefXYZ" };
+	int checks = 0;
+	int round;
+	for ( round = 0; round < ROUNDS; round++ ) {
+		ev_session_t session;
+		memset(&session, 0, sizeof( session ));
+		session.loop_ctx = loop_ctx;
+
+		const char* sep = seps[rand() % 5];
+		int sep_len = (int)strlen(sep);
+		int size = rand() % SEARCH_INPUT;
+		char all[SEARCH_INPUT];
+		int i;
+		for ( i = 0; i < size; i++ ) {
+			int r = rand() % 10;
+			all[i] = r < 3 ? sep[rand() % sep_len] : ( r < 5 ? '\r' : 'a' + rand() % 3 );
+		}
+
+		int fed = 0;
+		int consumed = 0;
+		for ( ;; ) {
+			int piece = fed < size ? 1 + rand() % 40 : 0;
+			if ( fed + piece > size ) {
+				piece = size - fed;
+			}
+			if ( piece > 0 ) {
+				data_buffer_t* db = buffer_next(loop_ctx);
+				int pre = rand() % 3;
+				db->size = piece + 8;
+				db->data = malloc(db->size);
+				db->rpos = pre;
+				db->wpos = pre + piece;
+				memcpy((char*)db->data + pre, all + fed, piece);
+				buffer_append(&session.input, db);
+				fed += piece;
+			}
+
+			int got = search_eol(&session, sep, sep_len);
+			int want = naive_eol(all + consumed, fed - consumed, sep, sep_len);
+			checks++;
+			if ( got != want ) {
+				printf("search_eol fail round %d got %d want %d\n", round, got, want);
+				return -1;
+			}
+			if ( got > 0 && rand() % 2 ) {
+				char tmp[SEARCH_INPUT];
+				ev_session_read(&session, tmp, got);
+				consumed += got;
+			}
+			else if ( rand() % 4 == 0 && session.input.total > 1 ) {
+				ev_session_pullup(&session, 1 + rand() % session.input.total);
+			}
+			if ( piece == 0 ) {
+				break;
+			}
+		}
+		buffer_release(loop_ctx, &session.input);
+	}
+	return checks;
+}
+
+//a 1MB header arriving 100 bytes at a time with the separator at the very end,
+//a search that rescan from the head each time is quadratic here
+static double
+time_incremental(ev_loop_ctx_t* loop_ctx) {
+	ev_session_t session;
+	memset(&session, 0, sizeof( session ));
+	session.loop_ctx = loop_ctx;
+	clock_t start = clock();
+	int i;
+	for ( i = 0; i < 10000; i++ ) {
+		data_buffer_t* db = buffer_next(loop_ctx);
+		db->size = 100;
+		db->data = malloc(db->size);
+		memset(db->data, 'h', db->size);
+		db->wpos = 100;
+		if ( i == 9999 ) {
+			memcpy((char*)db->data + 96, "\r\n\r\n", 4);
+		}
+		buffer_append(&session.input, db);
+		int got = search_eol(&session, "\r\n\r\n", 4);
+		if ( ( got >= 0 ) != ( i == 9999 ) ) {
+			printf("incremental search fail at piece %d\n", i);
+			return -1;
+		}
+	}
+	buffer_release(loop_ctx, &session.input);
+	return (double)( clock() - start ) / CLOCKS_PER_SEC;
+}
+
+int
+main() {
+	srand(7);
+	ev_loop_ctx_t loop_ctx;
+	memset(&loop_ctx, 0, sizeof( loop_ctx ));
+	loop_ctx.pool.high_water = CHUNK_HIGH_WATER;
+
+	int bytes = check_find_byte();
+	if ( bytes < 0 ) {
+		return 1;
+	}
+	int searches = check_search_eol(&loop_ctx);
+	if ( searches < 0 ) {
+		return 1;
+	}
+	double elapsed = time_incremental(&loop_ctx);
+	if ( elapsed < 0 ) {
+		return 1;
+	}
+	printf("ok find_byte %d search_eol %d,1MB incremental %.3fs\n", bytes, searches, elapsed);
+	return 0;
+}